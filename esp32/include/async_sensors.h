@@ -0,0 +1,68 @@
+#ifndef ASYNC_SENSORS_H_
+#define ASYNC_SENSORS_H_
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <driver/rmt.h>
+
+/**
+ * Progress of a sensor's conversion, a conversion is started, then polled until
+ * it is done or it has failed
+ */
+enum ConversionStatus {
+  CONVERSION_IDLE = 0,
+  CONVERSION_PENDING,
+  CONVERSION_DONE,
+  CONVERSION_FAILED,
+};
+
+/**
+ * Driver of the BH1750 light sensor in one-time high resolution mode. Starting
+ * a conversion and collecting its result are two short I2C transactions, the
+ * sensor measures on its own in between and powers down afterward
+ */
+class AsyncBH1750 {
+ private:
+  TwoWire *wire;
+  uint8_t address;
+  bool isConverting = false;
+  unsigned long tsStarted = 0;
+
+ public:
+  AsyncBH1750(uint8_t, TwoWire & = Wire);
+  bool begin();
+  bool startConversion();
+  ConversionStatus pollConversion(float &);
+};
+
+enum DHTType {
+  DHT_TYPE_DHT11 = 0,
+  DHT_TYPE_DHT22,
+};
+
+/**
+ * Driver of the DHT11/DHT22 temperature and humidity sensors. The start signal
+ * is held without waiting and the sensor's reply is captured by the RMT
+ * peripheral, so no bit is timed by the CPU with the interrupts disabled
+ */
+class AsyncDHT {
+ private:
+  gpio_num_t pin;
+  rmt_channel_t channel;
+  DHTType type;
+  RingbufHandle_t rxBuffer = nullptr;
+  bool isConverting = false;
+  bool isCapturing = false;
+  unsigned long tsStarted = 0;
+  unsigned long tsCaptureStarted = 0;
+
+  void finishConversion();
+
+ public:
+  AsyncDHT(int, int, DHTType);
+  bool begin();
+  bool startConversion();
+  ConversionStatus pollConversion(float &, float &);
+};
+
+#endif  // ASYNC_SENSORS_H_
@@ -0,0 +1,60 @@
+#ifndef CONNECTION_SUPERVISOR_H_
+#define CONNECTION_SUPERVISOR_H_
+
+#include <Arduino.h>
+
+#include <functional>
+
+#include "happy_herbs.h"
+
+/**
+ * Exponential backoff with jitter, every failure doubles the upper bound of the
+ * delay until it reaches the maximum, and the delay is drawn between half of
+ * the bound and the bound so devices that fail together retry apart
+ */
+class Backoff {
+ private:
+  unsigned long baseDelay;
+  unsigned long maxDelay;
+  uint8_t nFailures = 0;
+
+ public:
+  Backoff(unsigned long, unsigned long);
+  void reset();
+  void saturate();
+  unsigned long next();
+};
+
+/**
+ * Where the connection with AWS stands, the supervisor only tries to connect
+ * the MQTT client once the station is connected to the access point
+ */
+enum ConnectionState {
+  CONNECTION_WIFI_DOWN = 0,
+  CONNECTION_MQTT_DOWN,
+  CONNECTION_UP,
+};
+
+/**
+ * Keeps the connection with AWS alive. A failed attempt is retried after a
+ * backoff that depends on what failed, so the task that runs the supervisor
+ * is never busy retrying and the other tasks get to run in between attempts
+ */
+class ConnectionSupervisor {
+ private:
+  HappyHerbsService *hhService;
+  ConnectionState state = CONNECTION_MQTT_DOWN;
+  Backoff wifiBackoff;
+  Backoff mqttBackoff;
+  std::function<void()> onConnected;
+
+  unsigned long handleDisconnect();
+
+ public:
+  ConnectionSupervisor(HappyHerbsService &);
+  void setOnConnected(std::function<void()>);
+  ConnectionState getState();
+  unsigned long run();
+};
+
+#endif  // CONNECTION_SUPERVISOR_H_
@@ -12,14 +12,231 @@ const String AWS_ROOTCA_CERT = "/creds/aws/rootca-cert.pem";
 const String AWS_CLIENT_CERT = "/creds/aws/device-cert.crt";
 const String AWS_CLIENT_KEY = "/creds/aws/device-key.key";
 
+const String TELEMETRY_BUFFER_PATH = "/telemetry/sensors.bin";
+
 const String TOPIC_STATE_SNAPSHOT = "stateSnapshot";
 const String TOPIC_SENSORS_MEASUREMENTS = "sensorsMeasurements";
+const String TOPIC_DEVICE_METRICS = "deviceMetrics";
+const String TOPIC_BENCH_REPORT = "benchReport";
+const String TOPIC_BENCH_LOAD = "benchLoad";
+
+const int TELEMETRY_SCHEMA_VERSION = 2;
+
+// Encodings of the telemetry topics, can be overridden with build flags
+#ifndef HH_SENSORS_MEASUREMENTS_ENCODING
+#define HH_SENSORS_MEASUREMENTS_ENCODING PAYLOAD_ENCODING_JSON
+#endif
+#ifndef HH_STATE_SNAPSHOT_ENCODING
+#define HH_STATE_SNAPSHOT_ENCODING PAYLOAD_ENCODING_JSON
+#endif
+
+// Sensors' measurements are published as summaries of the samples taken since
+// the last publish, low power builds wake up too rarely for a window to hold
+// more than one sample so they publish single samples
+#ifndef HH_SENSORS_AGGREGATION
+#ifdef __HAPPY_HERBS_LOW_POWER
+#define HH_SENSORS_AGGREGATION SENSORS_AGGREGATION_RAW
+#else
+#define HH_SENSORS_AGGREGATION SENSORS_AGGREGATION_WINDOW
+#endif
+#endif
+
+// Used when building with __HAPPY_HERBS_LOW_POWER, the MCU enters deep sleep
+// when the next task is due in at least LOW_POWER_MIN_SLEEP milliseconds and
+// the system has been idle for LOW_POWER_AWAKE_WINDOW milliseconds
+const unsigned long LOW_POWER_MIN_SLEEP = 60 * 1000;
+const unsigned long LOW_POWER_AWAKE_WINDOW = 5 * 1000;
+
+// Every zone has its own pump and is watered from the mean of the moisture
+// probes on ADC1 that are assigned to it, the pins are given for each target
+// below. Zone 0 is kept at the top level of the shadow and of the telemetry,
+// the other zones are kept in "zones" sub-objects. At most 13 zones fit in the
+// shadow's field mask, and at most 9 fit in the large JSON documents unless the
+// MQTT buffer is grown. The counts and the pin tables can be overridden with
+// build flags, e.g. 8 probes watered by 4 valves:
+//   -DHH_ZONE_COUNT=4 -DHH_MOISTURE_PROBE_COUNT=8
+//   '-DHH_GPIO_PUMPS_INIT={13,25,26,27}'
+//   '-DHH_ADC1_CHANNELS_MOISTURE_INIT={0,1,2,3,4,5,6,7}'
+//   '-DHH_MOISTURE_PROBE_ZONES_INIT={0,0,1,1,2,2,3,3}'
+#ifndef HH_ZONE_COUNT
+#define HH_ZONE_COUNT 1
+#endif
+#ifndef HH_MOISTURE_PROBE_COUNT
+#define HH_MOISTURE_PROBE_COUNT HH_ZONE_COUNT
+#endif
 
 const float DEFAULT_LIGHT_THRESHOLD = 100.0;
 const float DEFAULT_MOISTURE_THRESHOLD = 30.0;
+
+// The lamp and the watering are controlled against the thresholds with these
+// hysteresis bands and minimum dwell times. In low power builds, the control
+// runs less often so the MCU can sleep in between
+const float LIGHT_HYSTERESIS_BAND = 20.0;
+const unsigned long LAMP_MIN_DWELL = 10 * 60 * 1000;
+const float MOISTURE_HYSTERESIS_BAND = 5.0;
+const unsigned long MOISTURE_MIN_DWELL = 60 * 1000;
+const unsigned long WATERING_SOAK_TIME = 15 * 60 * 1000;
+#ifdef __HAPPY_HERBS_LOW_POWER
+const unsigned long THRESHOLD_CONTROL_INTERVAL = 5 * 60 * 1000;
+#else
+const unsigned long THRESHOLD_CONTROL_INTERVAL = 5 * 1000;
+#endif
+const unsigned long WIFI_FAST_CONNECT_TIMEOUT = 3 * 1000;
 const int MQTT_MESSAGE_BUFFER_SIZE = 2048;
+const int MQTT_PUBLISH_CHUNK_SIZE = 256;
+
+// Every JSON document used by the service is leased from these pools
+const int JSON_SMALL_DOCUMENT_CAPACITY = 512;
+const int JSON_SMALL_DOCUMENT_COUNT = 2;
+const int JSON_LARGE_DOCUMENT_CAPACITY = MQTT_MESSAGE_BUFFER_SIZE;
+const int JSON_LARGE_DOCUMENT_COUNT = 1;
+const unsigned long SHADOW_UPDATE_FLUSH_WINDOW = 100;
+
+// At most SHADOW_INFLIGHT_WINDOW shadow updates wait for a response from AWS
+// at once, an update is retransmitted if it is not answered within
+// SHADOW_ACK_TIMEOUT milliseconds and dropped after SHADOW_MAX_RETRANSMITS
+const int SHADOW_INFLIGHT_WINDOW = 4;
+const unsigned long SHADOW_ACK_TIMEOUT = 5 * 1000;
+const int SHADOW_MAX_RETRANSMITS = 3;
+
+// The shadow is only fetched after connecting or when a version of the shadow
+// has been missed, a fetch that is not answered within SHADOW_GET_TIMEOUT
+// milliseconds can be sent again
+const unsigned long SHADOW_GET_TIMEOUT = 5 * 1000;
+const int SHADOW_FILTER_CAPACITY = 128;
+
+// Capacity of the documents that hold the shadow's messages, the payloads are
+// parsed in place so the documents only hold the parsed values
+const int SHADOW_ZONE_DOCUMENT_CAPACITY = 128;
+const int SHADOW_GET_DOCUMENT_CAPACITY =
+    1024 + (HH_ZONE_COUNT - 1) * SHADOW_ZONE_DOCUMENT_CAPACITY;
+const int SHADOW_UPDATE_DOCUMENT_CAPACITY =
+    512 + (HH_ZONE_COUNT - 1) * SHADOW_ZONE_DOCUMENT_CAPACITY;
+const int SHADOW_ERROR_DOCUMENT_CAPACITY = 256;
+const int MAX_TOPIC_ROUTES = 16;
+const int STATUS_LED_QUEUE_SIZE = 8;
+const unsigned long SENSOR_SAMPLE_MAX_AGE = 5 * 1000;
+#ifdef __HAPPY_HERBS_LOW_POWER
+const unsigned long SENSOR_SAMPLING_INTERVAL = 60 * 1000;
+#else
+const unsigned long SENSOR_SAMPLING_INTERVAL = 5 * 1000;
+#endif
+const unsigned long SENSORS_AGGREGATION_INTERVAL = SENSOR_SAMPLING_INTERVAL;
+
+// Sensors' measurements are only published when a value moves beyond its
+// deadband, or once SENSORS_HEARTBEAT_INTERVAL milliseconds have passed since
+// the last publish. The deadbands are in the sensors' units and are part of the
+// shadow, a deadband of 0 publishes every measurement
+const float SENSOR_DEADBAND_LUX = 10.0;
+const float SENSOR_DEADBAND_MOISTURE = 2.0;
+const float SENSOR_DEADBAND_TEMPERATURE = 0.5;
+const float SENSOR_DEADBAND_HUMIDITY = 2.0;
+const unsigned long SENSORS_HEARTBEAT_INTERVAL = 60 * 60 * 1000;
+const int SENSORS_SUMMARY_CAPACITY =
+    1024 + (HH_ZONE_COUNT - 1) * SHADOW_ZONE_DOCUMENT_CAPACITY;
+const int STATE_SNAPSHOT_CAPACITY =
+    512 + (HH_ZONE_COUNT - 1) * SHADOW_ZONE_DOCUMENT_CAPACITY;
+
+// The documents that grow with the zones are leased from the large pool, a
+// document that does not fit in it could never be leased
+static_assert(SHADOW_GET_DOCUMENT_CAPACITY <= JSON_LARGE_DOCUMENT_CAPACITY &&
+                  SHADOW_UPDATE_DOCUMENT_CAPACITY <=
+                      JSON_LARGE_DOCUMENT_CAPACITY &&
+                  SENSORS_SUMMARY_CAPACITY <= JSON_LARGE_DOCUMENT_CAPACITY &&
+                  STATE_SNAPSHOT_CAPACITY <= JSON_LARGE_DOCUMENT_CAPACITY,
+              "Too many zones for the large JSON documents");
+
+// The moisture probes are sampled together in the background, every sample is
+// the mean of MOISTURE_OVERSAMPLING conversions and a reading is the median of
+// the last MOISTURE_RING_SIZE samples
+const unsigned long MOISTURE_SAMPLING_PERIOD = 200;
+const int MOISTURE_OVERSAMPLING = 16;
+const int MOISTURE_RING_SIZE = 9;
+const int COMMAND_QUEUE_SIZE = 8;
+const unsigned long COMMAND_POLL_INTERVAL = 10;
+const int TELEMETRY_BUFFER_CAPACITY = 512;
+const int TELEMETRY_DRAIN_BATCH_SIZE = 8;
+const unsigned long TELEMETRY_DRAIN_INTERVAL = 1000;
+
+// The latency histograms have fixed buckets, the upper bounds are given in
+// microseconds and the last bucket holds every longer duration
+const int METRICS_HISTOGRAM_BUCKETS = 5;
+const uint32_t METRICS_HISTOGRAM_BOUNDS[METRICS_HISTOGRAM_BUCKETS - 1] = {
+    100, 1000, 10 * 1000, 100 * 1000};
+const int METRICS_MAX_WATCHED_TASKS = 4;
+const unsigned long DEVICE_METRICS_INTERVAL = 10 * 60 * 1000;
+
+// Used when building with __HAPPY_HERBS_BENCH, the percentiles of every report
+// are taken over a uniform sample of BENCH_LATENCY_SAMPLES commands, and the
+// publish load holds every rate of BENCH_PUBLISH_RATES, in messages per second,
+// for BENCH_RATE_STEP_DURATION milliseconds
+const int BENCH_LATENCY_SAMPLES = 128;
+const unsigned long BENCH_PROBE_TIMEOUT = 10 * 1000;
+const int BENCH_RATE_STEPS = 6;
+const uint16_t BENCH_PUBLISH_RATES[BENCH_RATE_STEPS] = {1, 2, 5, 10, 20, 50};
+const unsigned long BENCH_RATE_STEP_DURATION = 5 * 60 * 1000;
+const unsigned long BENCH_REPORT_INTERVAL = 60 * 1000;
+
+// Used when building with __HAPPY_HERBS_ASYNC_LOG, the log lines are queued in
+// a ring buffer and written to Serial by a task that has the lowest priority
+const int LOG_LINE_SIZE = 256;
+const int LOG_RING_BUFFER_SIZE = 4 * 1024;
+const int LOG_TASK_STACK_SIZE = 3 * 1024;
+const int LOG_TASK_PRIORITY = 0;
+
+// Bounds of the delays between reconnection attempts, the delay doubles after
+// every failed attempt
+const unsigned long WIFI_RECONNECT_BACKOFF_BASE = 1000;
+const unsigned long WIFI_RECONNECT_BACKOFF_MAX = 60 * 1000;
+const unsigned long MQTT_RECONNECT_BACKOFF_BASE = 1000;
+const unsigned long MQTT_RECONNECT_BACKOFF_MAX = 5 * 60 * 1000;
+
+// The network task runs the MQTT client, it is pinned to the core running the
+// WiFi stack, while the control task is the Arduino loop task. On single-core
+// targets, the control task is given a higher priority instead
+const int NETWORK_TASK_STACK_SIZE = 10 * 1024;
+const int NETWORK_TASK_PRIORITY = 1;
+const int NETWORK_TASK_CORE = 0;
+const int CONTROL_TASK_PRIORITY = 2;
+
+// Firmware updates are received as AWS IoT Jobs, the image is streamed into the
+// inactive OTA partition by a task that runs next to the network task. A new
+// image is on trial until it reaches AWS, it is rolled back after
+// OTA_MAX_TRIAL_BOOTS boots or OTA_TRIAL_TIMEOUT milliseconds without reaching
+// AWS. The trial is kept in NVS, so it works with the stock bootloader and
+// survives the losses of power. The running version is compared with the jobs'
+// version, it is set with -DHH_FIRMWARE_VERSION=\"x.y.z\"
+#ifndef HH_FIRMWARE_VERSION
+#define HH_FIRMWARE_VERSION "dev"
+#endif
+const int OTA_CHUNK_SIZE = 1024;
+const int OTA_TASK_STACK_SIZE = 10 * 1024;
+const int OTA_TASK_PRIORITY = 1;
+const int OTA_JOB_DOCUMENT_CAPACITY = 1024;
+const unsigned long OTA_HTTP_TIMEOUT = 15 * 1000;
+const unsigned long OTA_POLL_INTERVAL = 1000;
+const int OTA_MAX_TRIAL_BOOTS = 3;
+const unsigned long OTA_TRIAL_TIMEOUT = 5 * 60 * 1000;
 
 const int HH_I2C_BH1750_ADDR = 0x23;
+const int HH_RMT_CHANNEL_DHT = 0;
+
+// The sensors' conversions are started and their results are collected later,
+// the running conversions are polled every SENSOR_POLL_INTERVAL milliseconds.
+// BH1750_CONVERSION_TIME is the longest conversion time in high resolution mode
+const unsigned long SENSOR_POLL_INTERVAL = 10;
+const unsigned long BH1750_CONVERSION_TIME = 180;
+
+// Timings of the DHT's reply in microseconds, except for the start signals and
+// the capture's timeout that are in milliseconds, the capture's timeout starts
+// when the line is released
+const unsigned long DHT11_START_SIGNAL = 20;
+const unsigned long DHT22_START_SIGNAL = 2;
+const unsigned long DHT_CAPTURE_TIMEOUT = 10;
+const uint16_t DHT_IDLE_THRESHOLD = 100;
+const uint32_t DHT_RESPONSE_MIN_DURATION = 60;
+const uint32_t DHT_BIT_THRESHOLD = 40;
+const int DHT_RX_BUFFER_SIZE = 512;
 
 #ifdef __HAPPY_HERBS_ESP32S2
 
@@ -31,6 +248,11 @@ const int HH_GPIO_LAMP = 21;
 const int HH_GPIO_PUMP = 0;
 const int HH_GPIO_DHT = 4;
 const int HH_GPIO_MOISTURE = 10;
+const int HH_ADC1_CHANNEL_MOISTURE = 9;  // GPIO10
+
+// Raw counts of the moisture sensor in dry air and in water, ADC1 is 13-bit
+const int MOISTURE_RAW_DRY = 7000;
+const int MOISTURE_RAW_WET = 3000;
 
 #else
 
@@ -41,7 +263,52 @@ const int HH_GPIO_LAMP = 12;
 const int HH_GPIO_PUMP = 13;
 const int HH_GPIO_DHT = 14;
 const int HH_GPIO_MOISTURE = 33;
+const int HH_ADC1_CHANNEL_MOISTURE = 5;  // GPIO33
+
+// Raw counts of the moisture sensor in dry air and in water, ADC1 is 12-bit
+const int MOISTURE_RAW_DRY = 3500;
+const int MOISTURE_RAW_WET = 1500;
 
 #endif
 
+// The pins of the zones' pumps, the ADC1 channels of the moisture probes, and
+// the zone that each probe belongs to
+#ifndef HH_GPIO_PUMPS_INIT
+#define HH_GPIO_PUMPS_INIT {HH_GPIO_PUMP}
+#endif
+#ifndef HH_ADC1_CHANNELS_MOISTURE_INIT
+#define HH_ADC1_CHANNELS_MOISTURE_INIT {HH_ADC1_CHANNEL_MOISTURE}
+#endif
+#ifndef HH_MOISTURE_PROBE_ZONES_INIT
+#define HH_MOISTURE_PROBE_ZONES_INIT {0}
+#endif
+const int HH_GPIO_PUMPS[] = HH_GPIO_PUMPS_INIT;
+const int HH_ADC1_CHANNELS_MOISTURE[] = HH_ADC1_CHANNELS_MOISTURE_INIT;
+constexpr int HH_MOISTURE_PROBE_ZONES[] = HH_MOISTURE_PROBE_ZONES_INIT;
+static_assert(sizeof(HH_GPIO_PUMPS) / sizeof(int) == HH_ZONE_COUNT,
+              "HH_GPIO_PUMPS_INIT must give one pin for each zone");
+static_assert(sizeof(HH_ADC1_CHANNELS_MOISTURE) / sizeof(int) ==
+                  HH_MOISTURE_PROBE_COUNT,
+              "HH_ADC1_CHANNELS_MOISTURE_INIT must give one channel for each "
+              "probe");
+static_assert(sizeof(HH_MOISTURE_PROBE_ZONES) / sizeof(int) ==
+                  HH_MOISTURE_PROBE_COUNT,
+              "HH_MOISTURE_PROBE_ZONES_INIT must give one zone for each probe");
+
+/**
+ * Check that the probes from the given one onwards belong to existing zones
+ *
+ * @param probe Index of the first probe to check
+ * @return True if every zone index is valid
+ */
+constexpr bool isMoistureProbeZoneValid(int probe) {
+  return probe >= HH_MOISTURE_PROBE_COUNT ||
+         (HH_MOISTURE_PROBE_ZONES[probe] >= 0 &&
+          HH_MOISTURE_PROBE_ZONES[probe] < HH_ZONE_COUNT &&
+          isMoistureProbeZoneValid(probe + 1));
+}
+static_assert(isMoistureProbeZoneValid(0),
+              "HH_MOISTURE_PROBE_ZONES_INIT must only give zones below "
+              "HH_ZONE_COUNT");
+
 #endif  // CONSTANTS_H
\ No newline at end of file
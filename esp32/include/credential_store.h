@@ -0,0 +1,41 @@
+#ifndef CREDENTIAL_STORE_H_
+#define CREDENTIAL_STORE_H_
+
+#include <Arduino.h>
+
+/**
+ * The credentials that are needed to connect the system to AWS
+ */
+enum CredentialID {
+  CREDENTIAL_MISC = 0,
+  CREDENTIAL_AWS_THING_NAME,
+  CREDENTIAL_AWS_IOT_ENDPOINT,
+  CREDENTIAL_AWS_ROOTCA_CERT,
+  CREDENTIAL_AWS_CLIENT_CERT,
+  CREDENTIAL_AWS_CLIENT_KEY,
+  CREDENTIAL_COUNT,
+};
+
+/**
+ * Provides the credentials as null-terminated strings. When the firmware is
+ * built with `__HAPPY_HERBS_EMBEDDED_CREDS`, the files are embedded in the
+ * firmware image and the strings are read directly from flash, otherwise the
+ * files are loaded from SPIFFS into the heap. The strings stay valid until they
+ * are released because the TLS client and the MQTT client keep the pointers.
+ *
+ * NOTE: An image with embedded credentials is specific to one device, so it is
+ * built without the OTA updater and must never be served as an OTA image
+ */
+class CredentialStore {
+ private:
+  const char *creds[CREDENTIAL_COUNT] = {};
+  bool isOwned[CREDENTIAL_COUNT] = {};
+
+ public:
+  ~CredentialStore();
+  bool begin();
+  const char *get(CredentialID);
+  void release(CredentialID);
+};
+
+#endif  // CREDENTIAL_STORE_H_
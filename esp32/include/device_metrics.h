@@ -0,0 +1,104 @@
+#ifndef DEVICE_METRICS_H_
+#define DEVICE_METRICS_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "constants.h"
+
+/**
+ * The timed sections of the firmware, every section has its own latency
+ * histogram
+ */
+enum DeviceMetric {
+  METRIC_TASK_TELEMETRY_DRAIN = 0,
+  METRIC_TASK_SERVICE_LOOP,
+  METRIC_TASK_STATE_SNAPSHOT,
+  METRIC_TASK_SENSORS_MEASUREMENTS,
+  METRIC_TASK_DEVICE_METRICS,
+  METRIC_TASK_COMMANDS,
+  METRIC_TASK_SENSORS_SAMPLING,
+  METRIC_TASK_SENSORS_POLLING,
+  METRIC_TASK_WATERING,
+  METRIC_TASK_LAMP,
+  METRIC_TASK_SENSORS_AGGREGATION,
+  METRIC_PUBLISH,
+  METRIC_HANDLE_CALLBACK,
+  METRIC_MQTT_CONNECT,
+  METRIC_COUNT,
+};
+
+/**
+ * The counted events, counters are never reset
+ */
+enum DeviceCounter {
+  COUNTER_MQTT_CONNECTS = 0,
+  COUNTER_MQTT_RECONNECTS,
+  COUNTER_MQTT_CONNECT_FAILURES,
+  COUNTER_PUBLISH_FAILURES,
+  COUNTER_SHADOW_RETRANSMITS,
+  COUNTER_COUNT,
+};
+
+/**
+ * Distribution of the durations of a section in fixed buckets, the upper bound
+ * of every bucket is given by METRICS_HISTOGRAM_BOUNDS and the last bucket
+ * holds every longer duration
+ */
+struct LatencyHistogram {
+  uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+  uint32_t count;
+  uint32_t maxMicros;
+};
+
+/**
+ * Aggregates the instrumentation of the firmware on the device, so that only
+ * the aggregates have to be published. The histograms are reset every time they
+ * are reported, the counters and the heap's minimum are kept since boot
+ */
+class DeviceMetrics {
+ private:
+  LatencyHistogram histograms[METRIC_COUNT] = {};
+  uint32_t counters[COUNTER_COUNT] = {};
+  const char *taskNames[METRICS_MAX_WATCHED_TASKS] = {};
+  TaskHandle_t tasks[METRICS_MAX_WATCHED_TASKS] = {};
+  int nTasks = 0;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+ public:
+  void record(DeviceMetric, uint32_t);
+  void increment(DeviceCounter);
+  bool watchTask(const char *, TaskHandle_t);
+  void report(JsonObject);
+};
+
+/**
+ * Times the scope that it lives in with the CPU's cycle counter and records the
+ * duration when it goes out of scope. The cycle counter is per core and wraps
+ * after 2^32 cycles, so this is meant for sections that run on one core and
+ * last for less than a few seconds
+ */
+class MetricTimer {
+ private:
+  DeviceMetrics *metrics;
+  DeviceMetric metric;
+  uint32_t startCycles;
+
+ public:
+  MetricTimer(DeviceMetrics *metrics, DeviceMetric metric) {
+    this->metrics = metrics;
+    this->metric = metric;
+    this->startCycles = ESP.getCycleCount();
+  }
+
+  ~MetricTimer() {
+    if (this->metrics) {
+      uint32_t cycles = ESP.getCycleCount() - this->startCycles;
+      this->metrics->record(this->metric, cycles / ESP.getCpuFreqMHz());
+    }
+  }
+};
+
+#endif  // DEVICE_METRICS_H_
@@ -0,0 +1,59 @@
+#ifndef GZIP_INFLATER_H_
+#define GZIP_INFLATER_H_
+
+#include <Arduino.h>
+#ifdef __HAPPY_HERBS_ESP32S2
+#include <esp32s2/rom/miniz.h>
+#else
+#include <esp32/rom/miniz.h>
+#endif
+
+#include "ioutils.h"
+
+/**
+ * The parts of a gzip stream, in the order they are received
+ */
+enum GzipStage {
+  GZIP_STAGE_HEADER = 0,
+  GZIP_STAGE_EXTRA_LENGTH,
+  GZIP_STAGE_EXTRA,
+  GZIP_STAGE_NAME,
+  GZIP_STAGE_COMMENT,
+  GZIP_STAGE_HEADER_CRC,
+  GZIP_STAGE_DEFLATE,
+  GZIP_STAGE_DONE,
+  GZIP_STAGE_FAILED,
+};
+
+/**
+ * Inflates a gzip stream that is received in chunks of any size, with the
+ * inflater of the ROM's miniz. The inflated bytes are passed to the handler
+ * straight from the inflater's 32KB dictionary, so the stream is never held in
+ * RAM. The trailer is not read, the inflater may have buffered part of it, so
+ * the caller must check the inflated bytes' length and digest on its own
+ */
+class GzipInflater {
+ private:
+  tinfl_decompressor *decompressor = nullptr;
+  uint8_t *dict = nullptr;
+  size_t dictOffset = 0;
+  GzipStage stage = GZIP_STAGE_FAILED;
+  uint8_t flags = 0;
+  uint8_t field[10];
+  size_t fieldLength = 0;
+  size_t extraRemaining = 0;
+
+  bool collect(const uint8_t *&, const uint8_t *, size_t);
+  void nextHeaderStage();
+  bool inflate(const uint8_t *&, const uint8_t *, const ChunkHandler &);
+
+ public:
+  ~GzipInflater();
+  bool begin();
+  bool write(const uint8_t *, size_t, const ChunkHandler &);
+  bool isDone();
+  bool hasFailed();
+  void end();
+};
+
+#endif  // GZIP_INFLATER_H_
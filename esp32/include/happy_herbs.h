@@ -3,13 +3,226 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <BH1750.h>
-#include <DHT.h>
 #include <PubSubClient.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include <functional>
+
+#include "async_sensors.h"
+#include "constants.h"
+#include "device_metrics.h"
+#include "inflight_window.h"
+#include "json_pool.h"
+#include "moisture_sensor.h"
+#include "running_stats.h"
+#include "soak_bench.h"
+#include "status_led.h"
+#include "telemetry_buffer.h"
 
 #define _TASK_STD_FUNCTION
 #include <TaskSchedulerDeclarations.h>
 
+/**
+ * Bit flags identifying the shadow's fields that have been changed locally but
+ * have not yet been reported to AWS
+ */
+typedef uint32_t ShadowFieldMask;
+
+/**
+ * Flags of the fields that are shared by every zone, the flags of the zones'
+ * fields follow them, see zoneShadowField()
+ */
+enum ShadowField : ShadowFieldMask {
+  SHADOW_FIELD_LAMP_STATE = 1 << 0,
+  SHADOW_FIELD_LIGHT_THRESHOLD = 1 << 1,
+  SHADOW_FIELD_LUX_DEADBAND = 1 << 2,
+  SHADOW_FIELD_MOISTURE_DEADBAND = 1 << 3,
+  SHADOW_FIELD_TEMPERATURE_DEADBAND = 1 << 4,
+  SHADOW_FIELD_HUMIDITY_DEADBAND = 1 << 5,
+};
+
+const int SHADOW_ZONE_FIELDS_SHIFT = 6;
+const ShadowFieldMask SHADOW_FIELDS_ALL = 0xffffffff;
+
+/**
+ * Fields that every zone has in the shadow
+ */
+enum ZoneShadowField {
+  ZONE_SHADOW_FIELD_PUMP_STATE = 0,
+  ZONE_SHADOW_FIELD_MOISTURE_THRESHOLD,
+  ZONE_SHADOW_FIELD_COUNT,
+};
+
+static_assert(SHADOW_ZONE_FIELDS_SHIFT +
+                      HH_ZONE_COUNT * ZONE_SHADOW_FIELD_COUNT <=
+                  32,
+              "Too many zones for the shadow's field mask");
+
+/**
+ * Get the flag of a zone's field
+ *
+ * @param zone The zone's index
+ * @param field The field of the zone
+ * @return The field's flag
+ */
+inline ShadowFieldMask zoneShadowField(int zone, int field) {
+  return (ShadowFieldMask)1
+         << (SHADOW_ZONE_FIELDS_SHIFT + zone * ZONE_SHADOW_FIELD_COUNT + field);
+}
+
+/**
+ * Function that processes a message received from a subscribed topic
+ */
+typedef std::function<void(const char *, byte *, unsigned int)> TopicHandler;
+
+/**
+ * An entry of the topic dispatch table, the topic's hash is computed when the
+ * handler is registered so routing a received message only compares strings
+ * when the hashes match
+ */
+struct TopicRoute {
+  String topic;
+  uint32_t hash;
+  unsigned int qos;
+  TopicHandler handler;
+};
+
+/**
+ * Identifiers of the sensors whose readings are cached by the state object,
+ * every zone has its own moisture sensor and HH_SENSOR_MOISTURE is the one of
+ * zone 0
+ */
+enum HappyHerbsSensor {
+  HH_SENSOR_LIGHT_BH1750 = 0,
+  HH_SENSOR_TEMPERATURE,
+  HH_SENSOR_HUMIDITY,
+  HH_SENSOR_MOISTURE,
+  HH_SENSOR_COUNT = HH_SENSOR_MOISTURE + HH_ZONE_COUNT,
+};
+
+/**
+ * Get the moisture sensor of a zone
+ *
+ * @param zone The zone's index
+ * @return The sensor's identifier
+ */
+inline HappyHerbsSensor zoneMoistureSensor(int zone) {
+  return (HappyHerbsSensor)(HH_SENSOR_MOISTURE + zone);
+}
+
+/**
+ * A sensor's reading along with the time at which it was taken
+ */
+struct SensorSample {
+  float value = NAN;
+  unsigned long tsMillis = 0;
+  bool isValid = false;
+};
+
+/**
+ * Encodings of the telemetry payloads. The MessagePack encoding uses short keys
+ * and includes the schema's version so the payload stays compact
+ */
+enum PayloadEncoding {
+  PAYLOAD_ENCODING_JSON = 0,
+  PAYLOAD_ENCODING_MSGPACK,
+};
+
+/**
+ * Whether the sensors' measurements are published as single samples or as
+ * summaries of every sample taken within a window
+ */
+enum SensorsAggregation {
+  SENSORS_AGGREGATION_RAW = 0,
+  SENSORS_AGGREGATION_WINDOW,
+};
+
+/**
+ * The part of the system's state that is kept in RTC memory while the MCU is in
+ * deep sleep, so the system resumes with the same shadow's state
+ */
+struct HappyHerbsRtcState {
+  int tsLampState;
+  int tsPumpStates[HH_ZONE_COUNT];
+  int tsLightThreshold;
+  int tsMoistureThresholds[HH_ZONE_COUNT];
+  int tsLuxDeadband;
+  int tsMoistureDeadband;
+  int tsTemperatureDeadband;
+  int tsHumidityDeadband;
+  int tsShadowGetResponse;
+  int shadowVersion;
+  int tsShadowUpdateDelta;
+  float lightThreshold;
+  float moistureThresholds[HH_ZONE_COUNT];
+  float sensorDeadbands[HH_SENSOR_COUNT];
+  float reportedSensors[HH_SENSOR_COUNT];
+  time_t tsSensorsReported;
+  bool lampState;
+};
+
+class HappyHerbsService;
+
+/**
+ * Types of the values of the shadow's fields
+ */
+enum ShadowFieldType {
+  SHADOW_FIELD_TYPE_BOOL = 0,
+  SHADOW_FIELD_TYPE_FLOAT,
+};
+
+/**
+ * Describes a field of the shadow's state: its name and type, the flag that
+ * marks it as changed, the member that keeps the timestamp of its last update,
+ * and the methods that apply a received value and read the current value.
+ * Boolean values are applied as 0 or 1
+ */
+struct ShadowFieldDescriptor {
+  const char *name;
+  ShadowFieldType type;
+  ShadowFieldMask flag;
+  int HappyHerbsService::*timestamp;
+  void (HappyHerbsService::*apply)(float);
+  float (HappyHerbsService::*read)();
+};
+
+/**
+ * Describes a field that every zone has in the shadow, the timestamps are kept
+ * for each zone and the methods take the zone's index
+ */
+struct ZoneShadowFieldDescriptor {
+  const char *name;
+  ShadowFieldType type;
+  int (HappyHerbsService::*timestamps)[HH_ZONE_COUNT];
+  void (HappyHerbsService::*apply)(int, float);
+  float (HappyHerbsService::*read)(int);
+};
+
+/**
+ * A change to a shadow's field that was received from AWS, commands are passed
+ * from the network task to the control task that applies them. The zone is -1
+ * for the fields that are shared by every zone
+ */
+struct HappyHerbsCommand {
+  int field;
+  int zone;
+  float value;
+};
+
+/**
+ * The plant watering routine of a zone, the timer's argument is the routine so
+ * the timer's callback knows which zone's pump to turn off
+ */
+struct WateringZone {
+  HappyHerbsService *service;
+  int zone;
+  esp_timer_handle_t timer;
+  volatile bool isWatering;
+};
+
 class IHappyHerbsStateController {
   virtual void writeLampPinID(bool) = 0;
   virtual void writePumpPinID(bool) = 0;
@@ -24,17 +237,34 @@ class IHappyHerbsStateController {
 class HappyHerbsState : public IHappyHerbsStateController {
  private:
   float lightThreshold = 0.0;
-  float moistureThreshold = 0.0;
+  float moistureThresholds[HH_ZONE_COUNT] = {};
+  float sensorDeadbands[HH_SENSOR_COUNT];
   int lampPinID;
-  int pumpPinID;
-  int moistureSensorPinID;
-  DHT *tempHumidSensorDHT;
-  BH1750 *lightSensorBH1750;
+  int pumpPinIDs[HH_ZONE_COUNT];
+  AsyncDHT *tempHumidSensorDHT;
+  AsyncBH1750 *lightSensorBH1750;
+  MoistureSensor *moistureSensor;
+
+  SensorSample samples[HH_SENSOR_COUNT];
+  unsigned long samplesMaxAge[HH_SENSOR_COUNT];
+  portMUX_TYPE samplesMux = portMUX_INITIALIZER_UNLOCKED;
+
+  void storeSample(HappyHerbsSensor, float);
+  void startConversion(HappyHerbsSensor);
 
  public:
-  HappyHerbsState(BH1750 &, DHT &, int, int, int);
+  HappyHerbsState(AsyncBH1750 &, AsyncDHT &, int, const int *,
+                  MoistureSensor &);
   bool begin();
 
+  void setSensorMaxAge(HappyHerbsSensor, unsigned long);
+  float readSensor(HappyHerbsSensor);
+  SensorSample readSample(HappyHerbsSensor);
+  float peekSensor(HappyHerbsSensor);
+  SensorSample peekSample(HappyHerbsSensor);
+  void startConversions();
+  bool pollConversions();
+  void refreshSensors();
   float readLightSensorBH1750();
   float readMoistureSensor();
   float readTemperatureSensor();
@@ -42,13 +272,19 @@ class HappyHerbsState : public IHappyHerbsStateController {
 
   void writeLampPinID(bool) override;
   void writePumpPinID(bool) override;
+  void writeZonePumpPinID(int, bool);
   bool readLampPinID();
   bool readPumpPinID();
+  bool readZonePumpPinID(int);
 
   void setLightThreshold(float) override;
   void setMoistureThreshold(float) override;
+  void setZoneMoistureThreshold(int, float);
   float getLightThreshold();
   float getMoistureThreshold();
+  float getZoneMoistureThreshold(int);
+  void setSensorDeadband(HappyHerbsSensor, float);
+  float getSensorDeadband(HappyHerbsSensor);
 };
 
 /**
@@ -59,17 +295,64 @@ class HappyHerbsService : IHappyHerbsStateController {
  private:
   HappyHerbsState *hhState;
   PubSubClient *pubsub;
-  Task taskPlantWatering;
+  StatusLed *statusLed = nullptr;
+  TelemetryBuffer *telemetryBuffer = nullptr;
+  DeviceMetrics *deviceMetrics = nullptr;
+  SoakBench *soakBench = nullptr;
+  int64_t tsMessageReceived = 0;
+  uint32_t nBenchLoadMessages = 0;
+  bool hasConnected = false;
+  WateringZone wateringZones[HH_ZONE_COUNT] = {};
+  uint64_t wateringDuration = 0;
 
   int tsLampState = 0;
-  int tsPumpState = 0;
+  int tsPumpStates[HH_ZONE_COUNT] = {};
   int tsLightThreshold = 0;
-  int tsMoistureThreshold = 0;
+  int tsMoistureThresholds[HH_ZONE_COUNT] = {};
+  int tsLuxDeadband = 0;
+  int tsMoistureDeadband = 0;
+  int tsTemperatureDeadband = 0;
+  int tsHumidityDeadband = 0;
 
   int tsShadowGetResponse = 0;
-  int tsShadowUpdateResponse = 0;
+  int shadowVersion = 0;
+  bool isShadowGetPending = false;
+  volatile bool isShadowGetRequested = false;
+  unsigned long tsShadowGet = 0;
+  StaticJsonDocument<SHADOW_FILTER_CAPACITY> shadowGetFilter;
+  StaticJsonDocument<SHADOW_FILTER_CAPACITY> shadowUpdateFilter;
   int tsShadowUpdateDelta = 0;
 
+  unsigned long tsFirstPublish = 0;
+  unsigned long tsLastActivity = 0;
+
+  PayloadEncoding sensorsMeasurementsEncoding =
+      HH_SENSORS_MEASUREMENTS_ENCODING;
+  PayloadEncoding stateSnapshotEncoding = HH_STATE_SNAPSHOT_ENCODING;
+
+  SensorsAggregation sensorsAggregation = HH_SENSORS_AGGREGATION;
+  RunningStats sensorsWindow[HH_SENSOR_COUNT];
+  unsigned long tsAggregated[HH_SENSOR_COUNT] = {};
+  time_t tsWindowStart = 0;
+
+  float reportedSensors[HH_SENSOR_COUNT];
+  time_t tsSensorsReported = 0;
+  unsigned long sensorsHeartbeat = SENSORS_HEARTBEAT_INTERVAL;
+
+  QueueHandle_t commandQueue = nullptr;
+
+  JsonDocumentPool<JSON_SMALL_DOCUMENT_CAPACITY, JSON_SMALL_DOCUMENT_COUNT>
+      smallJsonDocs;
+  JsonDocumentPool<JSON_LARGE_DOCUMENT_CAPACITY, JSON_LARGE_DOCUMENT_COUNT>
+      largeJsonDocs;
+
+  ShadowFieldMask shadowDirtyFields = 0;
+  unsigned long tsShadowDirty = 0;
+  portMUX_TYPE shadowDirtyMux = portMUX_INITIALIZER_UNLOCKED;
+  unsigned long shadowFlushWindow = 0;
+  InflightWindow shadowInflight;
+  uint32_t nextClientToken = 0;
+
   String thingName = "";
   String topicShadowGet = "";
   String topicShadowGetAccepted = "";
@@ -79,29 +362,110 @@ class HappyHerbsService : IHappyHerbsStateController {
   String topicShadowUpdateRejected = "";
   String topicShadowUpdateDelta = "";
 
+  TopicRoute topicRoutes[MAX_TOPIC_ROUTES];
+  int nTopicRoutes = 0;
+
+  static const ShadowFieldDescriptor SHADOW_FIELDS[];
+  static const int N_SHADOW_FIELDS;
+  static const ZoneShadowFieldDescriptor ZONE_SHADOW_FIELDS[];
+
+  void applyLampState(float);
+  void applyPumpState(int, float);
+  void applyLightThreshold(float);
+  void applyMoistureThreshold(int, float);
+  void applyLuxDeadband(float);
+  void applyMoistureDeadband(float);
+  void applyTemperatureDeadband(float);
+  void applyHumidityDeadband(float);
+  float readLampState();
+  float readPumpState(int);
+  float readLightThreshold();
+  float readMoistureThreshold(int);
+  float readLuxDeadband();
+  float readMoistureDeadband();
+  float readTemperatureDeadband();
+  float readHumidityDeadband();
+  void applyShadowDelta(JsonObjectConst, JsonObjectConst);
+  void applyZoneDelta(int, JsonObjectConst, JsonObjectConst);
+  void queueCommand(HappyHerbsCommand, ShadowFieldType, JsonVariantConst, int,
+                    int &);
+  void reportShadowFields(JsonObject, ShadowFieldMask);
+  void reportZoneFields(JsonObject, int, ShadowFieldMask);
+  ShadowFieldMask findMismatchedFields(JsonObjectConst, ShadowFieldMask);
+  ShadowFieldMask findMismatchedZoneFields(JsonObjectConst, int,
+                                           ShadowFieldMask);
+  bool trackShadowVersion(const JsonDocument &);
+
+  void markShadowDirty(ShadowFieldMask);
+  ShadowFieldMask takeShadowDirty();
+  bool publishShadowFields(ShadowFieldMask, bool, uint32_t);
+  void retransmitShadowUpdates();
+  bool acknowledgeShadowUpdate(const JsonDocument &,
+                               InflightUpdate * = nullptr);
+  void yieldToShadow();
+  void recordPublish();
+  bool shouldReportSensors(const SensorsRecord &, time_t);
+  void recordSensorsReported(const SensorsRecord &);
+  void registerShadowHandler(const String &,
+                             void (HappyHerbsService::*)(const JsonDocument &),
+                             size_t, const JsonDocument * = nullptr);
+
  public:
   HappyHerbsService(HappyHerbsState &, PubSubClient &);
-  void setupTaskPlantWatering(Scheduler &, long);
-  Task &getTaskPlantWatering();
+  bool begin();
+  void processCommands();
+  JsonDocumentLease leaseJsonDocument(size_t);
+  JsonPoolStats getSmallJsonPoolStats();
+  JsonPoolStats getLargeJsonPoolStats();
+  bool setupPlantWatering(long);
+  void startWatering(int = 0);
+  void stopWatering(int = 0);
   void setThingName(String);
+  void setStatusLed(StatusLed &);
+  void setTelemetryBuffer(TelemetryBuffer &);
+  void setDeviceMetrics(DeviceMetrics &);
+  void setSoakBench(SoakBench &);
+  void saveRtcState(HappyHerbsRtcState &);
+  void restoreRtcState(const HappyHerbsRtcState &);
+  bool isIdle(unsigned long);
+  void setSensorsMeasurementsEncoding(PayloadEncoding);
+  void setSensorsAggregation(SensorsAggregation);
+  void setSensorsHeartbeat(unsigned long);
+  void setStateSnapshotEncoding(PayloadEncoding);
+  void setShadowFlushWindow(unsigned long);
 
   void writeLampPinID(bool) override;
   void writePumpPinID(bool) override;
+  void writeZonePumpPinID(int, bool);
   void setLightThreshold(float) override;
   void setMoistureThreshold(float) override;
+  void setZoneMoistureThreshold(int, float);
+  void setSensorDeadband(HappyHerbsSensor, float);
 
   void loop();
   bool connect();
   bool connected();
+  int getMqttState();
+  unsigned long getTimeToFirstPublish();
 
   bool publish(const char *, const char *);
-  void publishJson(const char *, const JsonDocument &);
+  bool publishJson(const char *, const JsonDocument &);
+  bool publishDocument(const char *, const JsonDocument &, PayloadEncoding);
   void publishShadowGet();
+  void requestShadowGet();
   void publishShadowUpdate();
+  bool flushShadowUpdate();
   void publishSensorsMeasurements();
+  void aggregateSensors();
+  bool publishSensorsRecord(const SensorsRecord &);
+  int drainTelemetryBuffer(int);
   void publishStateSnapshot();
+  void publishDeviceMetrics();
+  void publishBenchLoad();
+  void publishBenchReport();
 
   bool subscribe(const char *, unsigned int = 0);
+  bool registerTopicHandler(const String &, TopicHandler, unsigned int = 1);
   void handleCallback(const char *, byte *, unsigned int);
   void handleShadowGetAccepted(const JsonDocument &);
   void handleShadowGetRejected(const JsonDocument &);
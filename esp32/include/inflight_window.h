@@ -0,0 +1,45 @@
+#ifndef INFLIGHT_WINDOW_H_
+#define INFLIGHT_WINDOW_H_
+
+#include <Arduino.h>
+
+#include "constants.h"
+
+/**
+ * A shadow update that has been published but has not been answered by AWS,
+ * the update is identified by the client token that AWS echoes in its response
+ */
+struct InflightUpdate {
+  uint32_t clientToken;
+  uint32_t fields;
+  bool hasDesired;
+  unsigned long tsSent;
+  uint8_t nRetransmits;
+  bool isUsed;
+};
+
+/**
+ * Bounded set of the shadow updates that are waiting for a response, several
+ * updates can be in flight at once so a publish never waits for the response
+ * of the previous one. An update that is not answered before the timeout is
+ * handed back to be retransmitted.
+ *
+ * NOTE: This is not thread-safe, it must only be used from the network task
+ */
+class InflightWindow {
+ private:
+  InflightUpdate updates[SHADOW_INFLIGHT_WINDOW] = {};
+  unsigned long timeout;
+  int nUpdates = 0;
+
+ public:
+  InflightWindow(unsigned long);
+  bool isFull();
+  bool isEmpty();
+  bool add(uint32_t, uint32_t, bool);
+  bool acknowledge(uint32_t, InflightUpdate * = nullptr);
+  InflightUpdate *nextExpired();
+  uint32_t clear();
+};
+
+#endif  // INFLIGHT_WINDOW_H_
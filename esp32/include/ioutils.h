@@ -1,19 +1,82 @@
 #ifndef IOUTILS_H_
 #define IOUTILS_H_
 
+#include <Arduino.h>
+
+#include <functional>
+
 /**
  * Load n bytes from the stream into a char arrary and return the pointer to the first element
  */
 char* loadStream(Stream&, int);
 
+/**
+ * Read n bytes from the stream in chunks that fit the given buffer, each chunk
+ * is passed to the handler as soon as it is read
+ */
+typedef std::function<bool(const uint8_t *, size_t)> ChunkHandler;
+size_t loadStream(Stream &, size_t, uint8_t *, size_t, const ChunkHandler &);
+
 /**
  * Load the entire content of on file on SPIFFS into a char array and return the pointer to the first element
  */
 char* loadFile(const char*);
 
 /**
- * Cycle the pin through HIGH and LOW with delays
+ * Read the entire content of a file on SPIFFS in chunks that fit the given
+ * buffer, without holding the whole file in memory
  */
-void ledBlink(int, int, int, int);
+bool loadFile(const char *, uint8_t *, size_t, const ChunkHandler &);
+
+/**
+ * A Print that accumulates written bytes and forwards them to the destination
+ * in chunks of N bytes, so that many small writes do not each become a write on
+ * the underlying stream. The bytes accepted by the destination are counted, and
+ * a short write sets the write error
+ */
+template <size_t N>
+class BufferedPrint : public Print {
+ private:
+  Print *dest;
+  uint8_t buf[N];
+  size_t len = 0;
+  size_t written = 0;
+
+ public:
+  BufferedPrint(Print &dest) { this->dest = &dest; }
+  ~BufferedPrint() { this->flush(); }
+
+  size_t write(uint8_t c) override {
+    this->buf[this->len++] = c;
+    if (this->len == N) {
+      this->flush();
+    }
+    return 1;
+  }
+
+  size_t write(const uint8_t *data, size_t size) override {
+    for (size_t i = 0; i < size; i++) {
+      this->write(data[i]);
+    }
+    return size;
+  }
+
+  void flush() {
+    if (this->len > 0) {
+      size_t n = this->dest->write(this->buf, this->len);
+      this->written += n;
+      if (n < this->len) {
+        this->setWriteError();
+      }
+      this->len = 0;
+    }
+  }
+
+  /**
+   * Get the number of bytes that the destination has accepted, the buffered
+   * bytes are only counted once they are flushed
+   */
+  size_t bytesWritten() { return this->written; }
+};
 
 #endif  // IOUTILS_H_
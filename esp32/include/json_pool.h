@@ -0,0 +1,130 @@
+#ifndef JSON_POOL_H_
+#define JSON_POOL_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+/**
+ * Usage statistics of a pool of JSON documents
+ */
+struct JsonPoolStats {
+  size_t capacity;
+  size_t count;
+  size_t maxLeased;
+  size_t maxMemoryUsage;
+};
+
+class IJsonDocumentPool {
+ public:
+  virtual JsonDocument *lease() = 0;
+  virtual void release(JsonDocument *) = 0;
+};
+
+/**
+ * A fixed number of JSON documents with the same capacity that are leased and
+ * released instead of being allocated on the stack, so the memory used by the
+ * documents is known at compile time. The pool keeps track of the highest
+ * number of leased documents and the highest memory usage of a document
+ */
+template <size_t Capacity, size_t Count>
+class JsonDocumentPool : public IJsonDocumentPool {
+ private:
+  StaticJsonDocument<Capacity> docs[Count];
+  bool isLeased[Count] = {};
+  size_t nLeased = 0;
+  size_t maxLeased = 0;
+  size_t maxMemoryUsage = 0;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+ public:
+  /**
+   * Get an unused document from the pool
+   *
+   * @return An empty document, or a null pointer if every document is leased
+   */
+  JsonDocument *lease() override {
+    JsonDocument *doc = nullptr;
+    portENTER_CRITICAL(&this->mux);
+    for (size_t i = 0; i < Count; i++) {
+      if (!this->isLeased[i]) {
+        this->isLeased[i] = true;
+        this->nLeased++;
+        if (this->nLeased > this->maxLeased) {
+          this->maxLeased = this->nLeased;
+        }
+        doc = &this->docs[i];
+        break;
+      }
+    }
+    portEXIT_CRITICAL(&this->mux);
+    return doc;
+  }
+
+  /**
+   * Return a document to the pool, the document is cleared so it can be reused
+   *
+   * @param doc A document that was leased from this pool
+   */
+  void release(JsonDocument *doc) override {
+    size_t memoryUsage = doc->memoryUsage();
+    doc->clear();
+    portENTER_CRITICAL(&this->mux);
+    for (size_t i = 0; i < Count; i++) {
+      if (doc == &this->docs[i] && this->isLeased[i]) {
+        this->isLeased[i] = false;
+        this->nLeased--;
+        break;
+      }
+    }
+    if (memoryUsage > this->maxMemoryUsage) {
+      this->maxMemoryUsage = memoryUsage;
+    }
+    portEXIT_CRITICAL(&this->mux);
+  }
+
+  JsonPoolStats stats() {
+    return {Capacity, Count, this->maxLeased, this->maxMemoryUsage};
+  }
+};
+
+/**
+ * A document leased from a pool, the document is returned to its pool when the
+ * lease goes out of scope
+ */
+class JsonDocumentLease {
+ private:
+  IJsonDocumentPool *pool;
+  JsonDocument *doc;
+
+ public:
+  JsonDocumentLease() {
+    this->pool = nullptr;
+    this->doc = nullptr;
+  }
+
+  JsonDocumentLease(IJsonDocumentPool &pool) {
+    this->pool = &pool;
+    this->doc = pool.lease();
+  }
+
+  JsonDocumentLease(JsonDocumentLease &&other) {
+    this->pool = other.pool;
+    this->doc = other.doc;
+    other.doc = nullptr;
+  }
+
+  JsonDocumentLease(const JsonDocumentLease &) = delete;
+  JsonDocumentLease &operator=(const JsonDocumentLease &) = delete;
+
+  ~JsonDocumentLease() {
+    if (this->doc) {
+      this->pool->release(this->doc);
+    }
+  }
+
+  explicit operator bool() const { return this->doc != nullptr; }
+  JsonDocument &operator*() { return *this->doc; }
+  JsonDocument *operator->() { return this->doc; }
+};
+
+#endif  // JSON_POOL_H_
@@ -0,0 +1,63 @@
+#ifndef LOGGING_H_
+#define LOGGING_H_
+
+#include <Arduino.h>
+
+#define HH_LOG_LEVEL_NONE 0
+#define HH_LOG_LEVEL_ERROR 1
+#define HH_LOG_LEVEL_WARN 2
+#define HH_LOG_LEVEL_INFO 3
+#define HH_LOG_LEVEL_DEBUG 4
+
+// Messages that are less severe than the level are compiled away, can be
+// overridden with build flags, e.g. `-DHH_LOG_LEVEL=HH_LOG_LEVEL_NONE`
+#ifndef HH_LOG_LEVEL
+#define HH_LOG_LEVEL HH_LOG_LEVEL_INFO
+#endif
+
+// Used to guard work that is only needed to build a log message, the condition
+// is a constant so the guarded code is removed when the level is disabled
+#define HH_LOG_ENABLED(level) (HH_LOG_LEVEL >= HH_LOG_LEVEL_##level)
+
+#if HH_LOG_LEVEL >= HH_LOG_LEVEL_ERROR
+#define HH_LOGE(...) logPrintf('E', __VA_ARGS__)
+#else
+#define HH_LOGE(...) ((void)0)
+#endif
+
+#if HH_LOG_LEVEL >= HH_LOG_LEVEL_WARN
+#define HH_LOGW(...) logPrintf('W', __VA_ARGS__)
+#else
+#define HH_LOGW(...) ((void)0)
+#endif
+
+#if HH_LOG_LEVEL >= HH_LOG_LEVEL_INFO
+#define HH_LOGI(...) logPrintf('I', __VA_ARGS__)
+#else
+#define HH_LOGI(...) ((void)0)
+#endif
+
+#if HH_LOG_LEVEL >= HH_LOG_LEVEL_DEBUG
+#define HH_LOGD(...) logPrintf('D', __VA_ARGS__)
+#else
+#define HH_LOGD(...) ((void)0)
+#endif
+
+/**
+ * Start the logger, when building with `__HAPPY_HERBS_ASYNC_LOG` the messages
+ * are queued in a ring buffer and written to Serial by a low priority task
+ */
+bool logBegin();
+
+/**
+ * Format one line and write it to the logger's output, the line is truncated
+ * to LOG_LINE_SIZE bytes
+ */
+void logPrintf(char, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Wait until every queued message has been written to Serial
+ */
+void logFlush();
+
+#endif  // LOGGING_H_
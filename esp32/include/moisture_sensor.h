@@ -0,0 +1,45 @@
+#ifndef MOISTURE_SENSOR_H_
+#define MOISTURE_SENSOR_H_
+
+#include <Arduino.h>
+#include <driver/adc.h>
+#include <esp_timer.h>
+
+#include "constants.h"
+
+/**
+ * Samples the moisture probes of every zone in the background, a zone may have
+ * several probes and its moisture is the mean of theirs. All probes are
+ * sampled in one pass, every sample is the mean of a burst of ADC1 conversions,
+ * the samples of each probe are kept in a ring buffer and the reading is the
+ * median of the ring, so a read never waits for the ADC.
+ *
+ * The raw counts are calibrated to percent using the counts that the probes
+ * give in dry air and in water, the probes give lower counts when wetter
+ */
+class MoistureSensor {
+ private:
+  adc1_channel_t channels[HH_MOISTURE_PROBE_COUNT];
+  int zones[HH_MOISTURE_PROBE_COUNT];
+  int nChannels;
+  int rawDry;
+  int rawWet;
+  esp_timer_handle_t samplingTimer = nullptr;
+  uint16_t samples[HH_MOISTURE_PROBE_COUNT][MOISTURE_RING_SIZE];
+  int head = 0;
+  int count = 0;
+  portMUX_TYPE samplesMux = portMUX_INITIALIZER_UNLOCKED;
+
+  static void onSamplingTimer(void *);
+  void sample();
+
+ public:
+  MoistureSensor(const int *, const int *, int, int, int);
+  bool begin(unsigned long);
+  void setCalibration(int, int);
+  int readRaw(int = 0);
+  float readPercent(int = 0);
+  float readZonePercent(int = 0);
+};
+
+#endif  // MOISTURE_SENSOR_H_
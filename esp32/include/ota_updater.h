@@ -0,0 +1,91 @@
+#ifndef OTA_UPDATER_H_
+#define OTA_UPDATER_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+
+#include "constants.h"
+#include "gzip_inflater.h"
+#include "happy_herbs.h"
+
+/**
+ * The stages of a firmware update, the download runs on its own task and the
+ * other stages run on the network task
+ */
+enum OtaState {
+  OTA_STATE_IDLE = 0,
+  OTA_STATE_DOWNLOADING,
+  OTA_STATE_DOWNLOADED,
+  OTA_STATE_FAILED,
+};
+
+/**
+ * Kept in NVS while a new image is on trial, so it survives the reboot into the
+ * new image and a loss of power. The image is rolled back if it does not reach
+ * AWS before rebooting OTA_MAX_TRIAL_BOOTS times
+ */
+struct OtaTrialState {
+  uint32_t magic;
+  uint8_t nBoots;
+  uint8_t previousSubtype;
+  bool isRolledBack;
+};
+
+/**
+ * Applies the firmware updates received as AWS IoT Jobs. The job's document
+ * gives the image's HTTPS URL, size, MD5, and version, the image is streamed
+ * into the inactive OTA partition in chunks of OTA_CHUNK_SIZE bytes and is
+ * never held in RAM. An image that is served gzip compressed, with the
+ * document's "compression" set to "gzip", is inflated while it is streamed
+ * through a 32KB dictionary, its size and MD5 are the ones of the inflated
+ * image. The job's status is reconciled from the version that is running, so
+ * an update that is interrupted by a reboot is never reported as having
+ * succeeded.
+ *
+ * NOTE: Every method must be called from the network task
+ */
+class OtaUpdater {
+ private:
+  HappyHerbsService *hhService;
+  const char *rootCA = nullptr;
+  bool isTrial = false;
+
+  String topicJobNotifyNext = "";
+  String topicJobGetNext = "";
+  String topicJobGetNextAccepted = "";
+  String topicJobsPrefix = "";
+
+  String jobId = "";
+  String url = "";
+  String md5 = "";
+  String version = "";
+  size_t size = 0;
+  bool isGzip = false;
+  GzipInflater inflater;
+  // set by the download task, the failure is written before the state
+  std::atomic<OtaState> state{OTA_STATE_IDLE};
+  const char *failure = nullptr;
+  uint8_t chunk[OTA_CHUNK_SIZE];
+
+  void handleJobExecution(JsonObjectConst);
+  bool publishJobStatus(const char *, const char *);
+  bool download();
+  void rollBack();
+  static void downloadTask(void *);
+
+ public:
+  OtaUpdater(HappyHerbsService &);
+  void begin();
+  void setThingName(String);
+  void setRootCA(const char *);
+  void confirm();
+  void requestNextJob();
+  bool isIdle();
+  void loop();
+};
+
+#endif  // OTA_UPDATER_H_
@@ -0,0 +1,85 @@
+#ifndef RUNNING_STATS_H_
+#define RUNNING_STATS_H_
+
+#include <Arduino.h>
+
+/**
+ * Summary of a sensor's samples over a window
+ */
+struct __attribute__((packed)) SensorSummary {
+  float mean;
+  float min;
+  float max;
+  float stddev;
+  uint16_t count;
+};
+
+/**
+ * Incremental min, max, mean and variance of a stream of samples using
+ * Welford's method, so a window of any length is summarized in constant memory
+ */
+class RunningStats {
+ private:
+  uint16_t count = 0;
+  float minValue = NAN;
+  float maxValue = NAN;
+  float mean = 0;
+  float m2 = 0;
+
+ public:
+  /**
+   * Start a new window
+   */
+  void reset() { *this = RunningStats(); }
+
+  /**
+   * Add a sample to the window, invalid samples are ignored
+   *
+   * @param value The sample
+   */
+  void add(float value) {
+    if (isnan(value) || this->count == UINT16_MAX) {
+      return;
+    }
+    this->count++;
+    if (this->count == 1) {
+      this->minValue = value;
+      this->maxValue = value;
+    } else {
+      this->minValue = fminf(this->minValue, value);
+      this->maxValue = fmaxf(this->maxValue, value);
+    }
+    float delta = value - this->mean;
+    this->mean += delta / this->count;
+    this->m2 += delta * (value - this->mean);
+  }
+
+  /**
+   * Summarize the samples that were added since the last reset
+   *
+   * @return The summary, every value is NaN if there was no sample
+   */
+  SensorSummary summary() {
+    SensorSummary summary;
+    summary.count = this->count;
+    summary.mean = this->count > 0 ? this->mean : NAN;
+    summary.min = this->minValue;
+    summary.max = this->maxValue;
+    summary.stddev = this->count > 0 ? sqrtf(this->m2 / this->count) : NAN;
+    return summary;
+  }
+
+  /**
+   * Summarize a single sample
+   *
+   * @param value The sample
+   * @return The summary of the sample
+   */
+  static SensorSummary single(float value) {
+    RunningStats stats;
+    stats.add(value);
+    return stats.summary();
+  }
+};
+
+#endif  // RUNNING_STATS_H_
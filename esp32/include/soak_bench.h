@@ -0,0 +1,84 @@
+#ifndef SOAK_BENCH_H_
+#define SOAK_BENCH_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+
+#include "constants.h"
+
+/**
+ * The latencies of a command sent from the cloud, they are measured from the
+ * arrival of the command's delta on the device, except for the echo which is
+ * measured from the publish of the device's report
+ */
+enum BenchLatency {
+  BENCH_LATENCY_ACTUATION = 0,
+  BENCH_LATENCY_ECHO,
+  BENCH_LATENCY_CLOUD_TO_ACTUATOR,
+  BENCH_LATENCY_END_TO_END,
+  BENCH_LATENCY_COUNT,
+};
+
+/**
+ * A uniform sample of at most BENCH_LATENCY_SAMPLES latencies, the percentiles
+ * are exact as long as fewer latencies have been recorded
+ */
+struct LatencyReservoir {
+  uint32_t samples[BENCH_LATENCY_SAMPLES];
+  uint32_t count;
+  uint32_t maxMicros;
+};
+
+/**
+ * The publishes that were made while the load was held at one rate
+ */
+struct BenchRateStep {
+  uint16_t rate;
+  uint32_t nAttempted;
+  uint32_t nSent;
+  uint32_t nBytes;
+  unsigned long duration;
+};
+
+/**
+ * Measures the firmware over a soak in the bench mode. A command is followed
+ * from the arrival of its delta, to the actuation of its GPIO, to the echo of
+ * the report that follows it, one command at a time. The publish load is
+ * stepped through BENCH_PUBLISH_RATES, and the heap's fragmentation is tracked
+ * since boot.
+ *
+ * NOTE: The command's arrival and echo are recorded by the network task and
+ * the actuation by the control task
+ */
+class SoakBench {
+ private:
+  LatencyReservoir reservoirs[BENCH_LATENCY_COUNT] = {};
+  int64_t tsDeltaArrival = 0;
+  int64_t tsActuation = 0;
+  uint32_t actuatedFields = 0;
+
+  BenchRateStep steps[BENCH_RATE_STEPS] = {};
+  BenchRateStep currentStep = {};
+  int step = 0;
+  unsigned long tsStepStart = 0;
+  uint32_t nCycles = 0;
+
+  float maxFragmentation = 0;
+  uint32_t minLargestBlock = UINT32_MAX;
+  portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+  void recordLatency(BenchLatency, int64_t);
+
+ public:
+  void recordDeltaArrival(int64_t);
+  void recordActuation(uint32_t);
+  void recordAccepted(uint32_t, unsigned long);
+  void recordLoadPublish(bool, size_t);
+  unsigned long loadInterval();
+  bool advanceLoad();
+  void sampleHeap();
+  void report(JsonObject);
+};
+
+#endif  // SOAK_BENCH_H_
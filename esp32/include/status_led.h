@@ -0,0 +1,43 @@
+#ifndef STATUS_LED_H_
+#define STATUS_LED_H_
+
+#include <Arduino.h>
+
+#define _TASK_STD_FUNCTION
+#include <TaskSchedulerDeclarations.h>
+
+#include "constants.h"
+
+/**
+ * Cycle the pin `n` times through HIGH for `onDuration` milliseconds and LOW
+ * for `offDuration` milliseconds
+ */
+struct BlinkPattern {
+  int onDuration;
+  int offDuration;
+  int n;
+};
+
+/**
+ * This class drives a LED through a queue of blink patterns using a task of the
+ * scheduler, so requesting a pattern never blocks the caller
+ */
+class StatusLed {
+ private:
+  int pinID;
+  bool isOn = false;
+  Task taskBlink;
+
+  BlinkPattern patterns[STATUS_LED_QUEUE_SIZE];
+  int patternsHead = 0;
+  int patternsCount = 0;
+
+  void step();
+
+ public:
+  StatusLed(int);
+  void begin(Scheduler &);
+  bool blink(int, int, int);
+};
+
+#endif  // STATUS_LED_H_
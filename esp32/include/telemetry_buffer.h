@@ -0,0 +1,50 @@
+#ifndef TELEMETRY_BUFFER_H_
+#define TELEMETRY_BUFFER_H_
+
+#include <Arduino.h>
+
+#include "constants.h"
+#include "running_stats.h"
+
+/**
+ * Fixed layout record of the sensors' measurements, this is the format in which
+ * measurements are stored on flash while the system is offline. A record either
+ * summarizes a window of samples that ends at the timestamp, or holds a single
+ * sample if the window's length is 0. The moisture is kept for every zone
+ */
+struct __attribute__((packed)) SensorsRecord {
+  uint32_t timestamp;
+  uint16_t window;
+  SensorSummary luxBH1750;
+  SensorSummary temperature;
+  SensorSummary humidity;
+  SensorSummary moisture[HH_ZONE_COUNT];
+};
+
+/**
+ * A bounded ring buffer of sensors' records that is backed by a file on SPIFFS.
+ * The file is allocated to its full size upon creation and the records are
+ * overwritten in place, once the buffer is full the oldest record is dropped
+ */
+class TelemetryBuffer {
+ private:
+  String path;
+  uint16_t capacity;
+  uint16_t head = 0;
+  uint16_t count = 0;
+
+  bool format();
+  bool writeRecord(uint16_t, const SensorsRecord &);
+
+ public:
+  TelemetryBuffer(const String &, uint16_t);
+  bool begin();
+
+  bool push(const SensorsRecord &);
+  bool peek(SensorsRecord &);
+  bool pop();
+  uint16_t size();
+  bool isEmpty();
+};
+
+#endif  // TELEMETRY_BUFFER_H_
@@ -0,0 +1,49 @@
+#ifndef THRESHOLD_CONTROLLER_H_
+#define THRESHOLD_CONTROLLER_H_
+
+#include <Arduino.h>
+
+/**
+ * The state of a controller that has to be kept while the MCU is in deep sleep
+ */
+struct ThresholdControllerState {
+  bool isActive;
+  float activeOffset;
+};
+
+/**
+ * Decides when an actuator that raises a measured value has to be active. The
+ * actuator becomes active when the value drops below the threshold and becomes
+ * inactive once the value rises above the threshold plus the hysteresis band,
+ * and it stays in a state for at least the minimum dwell time.
+ *
+ * If the actuator adds to the measurement, e.g. the lamp is seen by the light
+ * sensor, the controller can be compensated. The actuator's contribution is
+ * then estimated from the first sample that is taken at least the settle time
+ * after the actuator becomes active and it is subtracted while the actuator
+ * stays active
+ */
+class ThresholdController {
+ private:
+  float band;
+  unsigned long minDwell;
+  bool isCompensated;
+  unsigned long settleTime;
+  bool isActive = false;
+  bool hasSwitched = false;
+  unsigned long tsSwitched = 0;
+  bool isEstimating = false;
+  float valueAtSwitch = 0;
+  float activeOffset = 0;
+
+ public:
+  ThresholdController(float = 0, unsigned long = 0, bool = false,
+                      unsigned long = 0);
+  void reset(bool);
+  void saveState(ThresholdControllerState &);
+  void restoreState(const ThresholdControllerState &);
+  bool update(float, unsigned long, float);
+  bool active();
+};
+
+#endif  // THRESHOLD_CONTROLLER_H_
@@ -0,0 +1,31 @@
+#ifndef WIFI_FAST_CONNECT_H_
+#define WIFI_FAST_CONNECT_H_
+
+#include <Arduino.h>
+
+/**
+ * Parameters of the last successful Wi-Fi association, these are kept in RTC
+ * memory so they survive deep sleep and software resets
+ */
+struct WiFiConnectionCache {
+  uint32_t magic;
+  int32_t channel;
+  uint8_t bssid[6];
+  uint32_t localIP;
+  uint32_t gatewayIP;
+  uint32_t subnetMask;
+  uint32_t dnsIP;
+};
+
+/**
+ * Connect to the access point, reusing the cached channel, BSSID and IP
+ * configuration if there is one
+ */
+bool connectWiFi(const char *, const char *);
+
+/**
+ * Forget the cached connection parameters
+ */
+void invalidateWiFiConnectionCache();
+
+#endif  // WIFI_FAST_CONNECT_H_
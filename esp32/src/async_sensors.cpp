@@ -0,0 +1,247 @@
+#include "async_sensors.h"
+
+#include "constants.h"
+
+static const uint8_t BH1750_POWER_ON = 0x01;
+static const uint8_t BH1750_ONE_TIME_HIGH_RES_MODE = 0x20;
+
+AsyncBH1750::AsyncBH1750(uint8_t address, TwoWire &wire) {
+  this->address = address;
+  this->wire = &wire;
+}
+
+/**
+ * Check that the sensor answers on the bus
+ *
+ * @return True if the sensor acknowledged the power on command
+ */
+bool AsyncBH1750::begin() {
+  this->wire->beginTransmission(this->address);
+  this->wire->write(BH1750_POWER_ON);
+  return this->wire->endTransmission() == 0;
+}
+
+/**
+ * Make the sensor take one measurement, the result can be collected once the
+ * conversion time has passed
+ *
+ * @return True if the conversion was started or is already running
+ */
+bool AsyncBH1750::startConversion() {
+  if (this->isConverting) {
+    return true;
+  }
+  this->wire->beginTransmission(this->address);
+  this->wire->write(BH1750_ONE_TIME_HIGH_RES_MODE);
+  if (this->wire->endTransmission() != 0) {
+    return false;
+  }
+  this->isConverting = true;
+  this->tsStarted = millis();
+  return true;
+}
+
+/**
+ * Collect the result of the running conversion if the conversion time has
+ * passed
+ *
+ * @param lux Receives the light level in lux when the conversion is done
+ * @return The progress of the conversion
+ */
+ConversionStatus AsyncBH1750::pollConversion(float &lux) {
+  if (!this->isConverting) {
+    return CONVERSION_IDLE;
+  }
+  if (millis() - this->tsStarted < BH1750_CONVERSION_TIME) {
+    return CONVERSION_PENDING;
+  }
+
+  this->isConverting = false;
+  if (this->wire->requestFrom(this->address, (uint8_t)2) != 2) {
+    return CONVERSION_FAILED;
+  }
+  uint16_t raw = this->wire->read() << 8;
+  raw |= this->wire->read();
+  // the sensor counts 1.2 per lux in high resolution mode
+  lux = raw / 1.2f;
+  return CONVERSION_DONE;
+}
+
+/**
+ * Create the sensor's driver
+ *
+ * @param pin The GPIO that the sensor's data line is connected to
+ * @param channel The RMT channel that captures the sensor's reply
+ * @param type The sensor's model
+ */
+AsyncDHT::AsyncDHT(int pin, int channel, DHTType type) {
+  this->pin = (gpio_num_t)pin;
+  this->channel = (rmt_channel_t)channel;
+  this->type = type;
+}
+
+/**
+ * Configure the RMT channel to capture the data line with a resolution of 1us.
+ * The line is open-drain, so the same pin is driven for the start signal while
+ * the RMT listens to it
+ *
+ * @return True if the driver is ready
+ */
+bool AsyncDHT::begin() {
+  rmt_config_t config = {};
+  config.rmt_mode = RMT_MODE_RX;
+  config.channel = this->channel;
+  config.gpio_num = this->pin;
+  config.clk_div = 80;
+  config.mem_block_num = 1;
+  config.rx_config.filter_en = true;
+  config.rx_config.filter_ticks_thresh = 100;
+  config.rx_config.idle_threshold = DHT_IDLE_THRESHOLD;
+  if (rmt_config(&config) != ESP_OK ||
+      rmt_driver_install(this->channel, DHT_RX_BUFFER_SIZE, 0) != ESP_OK ||
+      rmt_get_ringbuf_handle(this->channel, &this->rxBuffer) != ESP_OK) {
+    return false;
+  }
+
+  gpio_set_direction(this->pin, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_pull_mode(this->pin, GPIO_PULLUP_ONLY);
+  gpio_set_level(this->pin, 1);
+  return true;
+}
+
+/**
+ * Start the start signal by pulling the data line low, the line is released
+ * by a later poll once the signal has been held long enough
+ *
+ * @return True if the conversion was started or is already running
+ */
+bool AsyncDHT::startConversion() {
+  if (this->isConverting) {
+    return true;
+  }
+  if (!this->rxBuffer) {
+    return false;
+  }
+  gpio_set_level(this->pin, 0);
+  this->isConverting = true;
+  this->isCapturing = false;
+  this->tsStarted = millis();
+  return true;
+}
+
+/**
+ * Stop capturing and drop whatever is left in the RMT's buffer
+ */
+void AsyncDHT::finishConversion() {
+  rmt_rx_stop(this->channel);
+  size_t size = 0;
+  void *items;
+  while ((items = xRingbufferReceive(this->rxBuffer, &size, 0)) != nullptr) {
+    vRingbufferReturnItem(this->rxBuffer, items);
+  }
+  gpio_set_level(this->pin, 1);
+  this->isConverting = false;
+  this->isCapturing = false;
+}
+
+/**
+ * Decode the sensor's reply. The reply starts with an 80us high response
+ * pulse, then each of the 40 bits is a high pulse that lasts 26-28us for a 0
+ * and 70us for a 1, the last byte is the checksum of the first 4 bytes
+ *
+ * @param items The RMT items of the captured reply
+ * @param nItems Number of captured items
+ * @param data Receives the 5 bytes of the reply
+ * @return True if 40 bits were decoded and the checksum matches
+ */
+static bool decodeDHTReply(const rmt_item32_t *items, size_t nItems,
+                           uint8_t data[5]) {
+  memset(data, 0, 5);
+  // -1 until the response pulse has been seen
+  int nBits = -1;
+  for (size_t i = 0; i < nItems && nBits < 40; i++) {
+    const uint32_t levels[] = {items[i].level0, items[i].level1};
+    const uint32_t durations[] = {items[i].duration0, items[i].duration1};
+    for (int j = 0; j < 2 && nBits < 40; j++) {
+      if (levels[j] != 1 || durations[j] == 0) {
+        continue;
+      }
+      if (nBits < 0) {
+        if (durations[j] > DHT_RESPONSE_MIN_DURATION) {
+          nBits = 0;
+        }
+        continue;
+      }
+      data[nBits / 8] <<= 1;
+      if (durations[j] > DHT_BIT_THRESHOLD) {
+        data[nBits / 8] |= 1;
+      }
+      nBits++;
+    }
+  }
+  return nBits == 40 &&
+         data[4] == (uint8_t)(data[0] + data[1] + data[2] + data[3]);
+}
+
+/**
+ * Advance the running conversion, the data line is released after the start
+ * signal and the reply is decoded once it has been captured
+ *
+ * @param temperature Receives the temperature in Celsius when done
+ * @param humidity Receives the relative humidity in percent when done
+ * @return The progress of the conversion
+ */
+ConversionStatus AsyncDHT::pollConversion(float &temperature,
+                                          float &humidity) {
+  if (!this->isConverting) {
+    return CONVERSION_IDLE;
+  }
+  if (!this->isCapturing) {
+    unsigned long startSignal =
+        this->type == DHT_TYPE_DHT11 ? DHT11_START_SIGNAL : DHT22_START_SIGNAL;
+    if (millis() - this->tsStarted < startSignal) {
+      return CONVERSION_PENDING;
+    }
+    // listen before releasing the line, the sensor replies within 40us
+    rmt_rx_start(this->channel, true);
+    gpio_set_level(this->pin, 1);
+    this->isCapturing = true;
+    this->tsCaptureStarted = millis();
+    return CONVERSION_PENDING;
+  }
+
+  size_t size = 0;
+  rmt_item32_t *items =
+      (rmt_item32_t *)xRingbufferReceive(this->rxBuffer, &size, 0);
+  if (!items) {
+    // timed from the release of the line, which may come late
+    if (millis() - this->tsCaptureStarted < DHT_CAPTURE_TIMEOUT) {
+      return CONVERSION_PENDING;
+    }
+    this->finishConversion();
+    return CONVERSION_FAILED;
+  }
+
+  uint8_t data[5];
+  bool isDecoded = decodeDHTReply(items, size / sizeof(rmt_item32_t), data);
+  vRingbufferReturnItem(this->rxBuffer, items);
+  this->finishConversion();
+  if (!isDecoded) {
+    return CONVERSION_FAILED;
+  }
+
+  if (this->type == DHT_TYPE_DHT11) {
+    humidity = data[0] + data[1] * 0.1f;
+    temperature = data[2] + (data[3] & 0x7f) * 0.1f;
+    if (data[3] & 0x80) {
+      temperature = -temperature;
+    }
+  } else {
+    humidity = ((data[0] << 8) | data[1]) * 0.1f;
+    temperature = (((data[2] & 0x7f) << 8) | data[3]) * 0.1f;
+    if (data[2] & 0x80) {
+      temperature = -temperature;
+    }
+  }
+  return CONVERSION_DONE;
+}
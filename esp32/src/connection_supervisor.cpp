@@ -0,0 +1,127 @@
+#include "connection_supervisor.h"
+
+#include <PubSubClient.h>
+#include <WiFi.h>
+
+#include "constants.h"
+#include "logging.h"
+
+Backoff::Backoff(unsigned long baseDelay, unsigned long maxDelay) {
+  this->baseDelay = baseDelay;
+  this->maxDelay = maxDelay;
+}
+
+/**
+ * Start over from the base delay, this is called after a success
+ */
+void Backoff::reset() { this->nFailures = 0; }
+
+/**
+ * Make the following delays as long as possible, this is called after a
+ * failure that is not expected to go away soon
+ */
+void Backoff::saturate() { this->nFailures = UINT8_MAX; }
+
+/**
+ * Record a failure and get the delay until the next attempt. The hardware RNG
+ * is used, so every device draws a different delay
+ *
+ * @return Number of milliseconds to wait before retrying
+ */
+unsigned long Backoff::next() {
+  unsigned long bound = this->baseDelay;
+  for (uint8_t i = 0; i < this->nFailures && bound < this->maxDelay; i++) {
+    bound *= 2;
+  }
+  bound = min(bound, this->maxDelay);
+  if (this->nFailures < UINT8_MAX) {
+    this->nFailures++;
+  }
+
+  unsigned long half = bound / 2;
+  return half + esp_random() % (bound - half + 1);
+}
+
+ConnectionSupervisor::ConnectionSupervisor(HappyHerbsService &hhService)
+    : wifiBackoff(WIFI_RECONNECT_BACKOFF_BASE, WIFI_RECONNECT_BACKOFF_MAX),
+      mqttBackoff(MQTT_RECONNECT_BACKOFF_BASE, MQTT_RECONNECT_BACKOFF_MAX) {
+  this->hhService = &hhService;
+}
+
+/**
+ * Set the function that is called every time the MQTT client connects
+ *
+ * @param onConnected Called right after the client has connected
+ */
+void ConnectionSupervisor::setOnConnected(std::function<void()> onConnected) {
+  this->onConnected = onConnected;
+}
+
+ConnectionState ConnectionSupervisor::getState() { return this->state; }
+
+/**
+ * Run the client while it is connected, otherwise make one connection attempt
+ * for the part of the connection that is down
+ *
+ * @return Number of milliseconds to wait before running again
+ */
+unsigned long ConnectionSupervisor::run() {
+  if (this->state == CONNECTION_UP) {
+    if (this->hhService->connected()) {
+      this->hhService->loop();
+      return 0;
+    }
+    return this->handleDisconnect();
+  }
+
+  if (WiFi.status() != WL_CONNECTED) {
+    if (this->state != CONNECTION_WIFI_DOWN) {
+      HH_LOGW("WIFI DOWN");
+      this->state = CONNECTION_WIFI_DOWN;
+    }
+    WiFi.reconnect();
+    unsigned long wait = this->wifiBackoff.next();
+    HH_LOGI("WIFI reconnecting, next check in %lums", wait);
+    return wait;
+  }
+  if (this->state == CONNECTION_WIFI_DOWN) {
+    HH_LOGI("WIFI UP");
+    this->wifiBackoff.reset();
+    this->state = CONNECTION_MQTT_DOWN;
+  }
+
+  if (this->hhService->connect()) {
+    this->state = CONNECTION_UP;
+    this->mqttBackoff.reset();
+    if (this->onConnected) {
+      this->onConnected();
+    }
+    return 0;
+  }
+
+  // an explicit refusal from the broker will not be fixed by retrying sooner
+  int mqttState = this->hhService->getMqttState();
+  if (mqttState == MQTT_CONNECT_BAD_PROTOCOL ||
+      mqttState == MQTT_CONNECT_BAD_CLIENT_ID ||
+      mqttState == MQTT_CONNECT_BAD_CREDENTIALS ||
+      mqttState == MQTT_CONNECT_UNAUTHORIZED) {
+    this->mqttBackoff.saturate();
+  }
+  unsigned long wait = this->mqttBackoff.next();
+  HH_LOGI("MQTT retrying in %lums", wait);
+  return wait;
+}
+
+/**
+ * Handle a dropped connection, the first attempt is also delayed by a jittered
+ * backoff so devices that were dropped together do not reconnect together
+ *
+ * @return Number of milliseconds to wait before reconnecting
+ */
+unsigned long ConnectionSupervisor::handleDisconnect() {
+  this->state = CONNECTION_MQTT_DOWN;
+  unsigned long wait = this->mqttBackoff.next();
+  HH_LOGW("MQTT DOWN with state %d, reconnecting in %lums",
+          this->hhService->getMqttState(), wait);
+  return wait;
+}
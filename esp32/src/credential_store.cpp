@@ -0,0 +1,90 @@
+#include "credential_store.h"
+
+#include "constants.h"
+#include "ioutils.h"
+
+// An image that embeds the credentials holds one device's private key and WiFi
+// password, it must never be distributed to other devices as an OTA image
+#if defined(__HAPPY_HERBS_EMBEDDED_CREDS) && !defined(__HAPPY_HERBS_NO_OTA)
+#error "Embedded credentials require -D__HAPPY_HERBS_NO_OTA"
+#endif
+
+#ifdef __HAPPY_HERBS_EMBEDDED_CREDS
+// Symbols that are generated for the files that are listed in the build
+// environment's `board_build.embed_txtfiles`, every file ends with a null byte
+extern const char CREDS_MISC[] asm("_binary_data_creds_misc_json_start");
+extern const char CREDS_AWS_THING_NAME[] asm(
+    "_binary_data_creds_aws_iot_thingname_txt_start");
+extern const char CREDS_AWS_IOT_ENDPOINT[] asm(
+    "_binary_data_creds_aws_iot_endpoint_txt_start");
+extern const char CREDS_AWS_ROOTCA_CERT[] asm(
+    "_binary_data_creds_aws_rootca_cert_pem_start");
+extern const char CREDS_AWS_CLIENT_CERT[] asm(
+    "_binary_data_creds_aws_device_cert_crt_start");
+extern const char CREDS_AWS_CLIENT_KEY[] asm(
+    "_binary_data_creds_aws_device_key_key_start");
+
+static const char *const EMBEDDED_CREDS[CREDENTIAL_COUNT] = {
+    CREDS_MISC,
+    CREDS_AWS_THING_NAME,
+    CREDS_AWS_IOT_ENDPOINT,
+    CREDS_AWS_ROOTCA_CERT,
+    CREDS_AWS_CLIENT_CERT,
+    CREDS_AWS_CLIENT_KEY,
+};
+#else
+static const String *const CREDS_PATHS[CREDENTIAL_COUNT] = {
+    &MISC_CREDS,      &AWS_THING_NAME,  &AWS_IOT_ENDPOINT,
+    &AWS_ROOTCA_CERT, &AWS_CLIENT_CERT, &AWS_CLIENT_KEY,
+};
+#endif
+
+CredentialStore::~CredentialStore() {
+  for (int i = 0; i < CREDENTIAL_COUNT; i++) {
+    this->release((CredentialID)i);
+  }
+}
+
+/**
+ * Make every credential available, the files are only loaded into the heap if
+ * they are not embedded in the firmware
+ *
+ * @return True if every credential is available, false otherwise
+ */
+bool CredentialStore::begin() {
+  bool isAvailable = true;
+  for (int i = 0; i < CREDENTIAL_COUNT; i++) {
+#ifdef __HAPPY_HERBS_EMBEDDED_CREDS
+    this->creds[i] = EMBEDDED_CREDS[i];
+    this->isOwned[i] = false;
+#else
+    this->creds[i] = loadFile(CREDS_PATHS[i]->c_str());
+    this->isOwned[i] = this->creds[i] != nullptr;
+#endif
+    isAvailable = isAvailable && this->creds[i] != nullptr;
+  }
+  return isAvailable;
+}
+
+/**
+ * Get the content of a credential
+ *
+ * @param id The credential
+ * @return A null-terminated string, or a null pointer if the credential is not
+ * available
+ */
+const char *CredentialStore::get(CredentialID id) { return this->creds[id]; }
+
+/**
+ * Free the memory held by a credential that is no longer used, the credential
+ * is not available after being released
+ *
+ * @param id The credential
+ */
+void CredentialStore::release(CredentialID id) {
+  if (this->isOwned[id]) {
+    free((void *)this->creds[id]);
+  }
+  this->creds[id] = nullptr;
+  this->isOwned[id] = false;
+}
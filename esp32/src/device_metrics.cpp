@@ -0,0 +1,118 @@
+#include "device_metrics.h"
+
+#include <esp_heap_caps.h>
+
+static const char *const METRIC_NAMES[METRIC_COUNT] = {
+    "taskTelemetryDrain",     "taskServiceLoop",
+    "taskStateSnapshot",      "taskSensorsMeasurements",
+    "taskDeviceMetrics",      "taskCommands",
+    "taskSensorsSampling",    "taskSensorsPolling",
+    "taskWatering",           "taskLamp",
+    "taskSensorsAggregation", "publish",
+    "handleCallback",         "mqttConnect",
+};
+
+static const char *const COUNTER_NAMES[COUNTER_COUNT] = {
+    "mqttConnects",
+    "mqttReconnects",
+    "mqttConnectFailures",
+    "publishFailures",
+    "shadowRetransmits",
+};
+
+/**
+ * Add a duration to the histogram of the given section
+ *
+ * @param metric The timed section
+ * @param micros The duration in microseconds
+ */
+void DeviceMetrics::record(DeviceMetric metric, uint32_t micros) {
+  int bucket = 0;
+  while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 &&
+         micros > METRICS_HISTOGRAM_BOUNDS[bucket]) {
+    bucket++;
+  }
+
+  portENTER_CRITICAL(&this->mux);
+  LatencyHistogram &histogram = this->histograms[metric];
+  histogram.buckets[bucket]++;
+  histogram.count++;
+  if (micros > histogram.maxMicros) {
+    histogram.maxMicros = micros;
+  }
+  portEXIT_CRITICAL(&this->mux);
+}
+
+/**
+ * Count an occurrence of the given event
+ *
+ * @param counter The counted event
+ */
+void DeviceMetrics::increment(DeviceCounter counter) {
+  portENTER_CRITICAL(&this->mux);
+  this->counters[counter]++;
+  portEXIT_CRITICAL(&this->mux);
+}
+
+/**
+ * Report the stack's high-water mark of the given FreeRTOS task
+ *
+ * @param name The name under which the task is reported
+ * @param task The handle of the task
+ * @return True if the task is watched, false if too many tasks are watched
+ */
+bool DeviceMetrics::watchTask(const char *name, TaskHandle_t task) {
+  if (!task || this->nTasks >= METRICS_MAX_WATCHED_TASKS) {
+    return false;
+  }
+  this->taskNames[this->nTasks] = name;
+  this->tasks[this->nTasks] = task;
+  this->nTasks++;
+  return true;
+}
+
+/**
+ * Write the heap's state, the counters, the stacks' high-water marks, and every
+ * non-empty histogram into the given object, then reset the histograms
+ *
+ * @param metricsObj The object that receives the metrics
+ */
+void DeviceMetrics::report(JsonObject metricsObj) {
+  LatencyHistogram histograms[METRIC_COUNT];
+  uint32_t counters[COUNTER_COUNT];
+  portENTER_CRITICAL(&this->mux);
+  memcpy(histograms, this->histograms, sizeof(histograms));
+  memcpy(counters, this->counters, sizeof(counters));
+  memset(this->histograms, 0, sizeof(this->histograms));
+  portEXIT_CRITICAL(&this->mux);
+
+  JsonObject heapObj = metricsObj.createNestedObject("heap");
+  heapObj["free"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  heapObj["minFree"] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  heapObj["largestBlock"] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+  JsonObject countersObj = metricsObj.createNestedObject("counters");
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    countersObj[COUNTER_NAMES[i]] = counters[i];
+  }
+
+  // the high-water marks are the minimum number of unused bytes of the stacks
+  JsonObject stacksObj = metricsObj.createNestedObject("stacks");
+  for (int i = 0; i < this->nTasks; i++) {
+    stacksObj[this->taskNames[i]] = uxTaskGetStackHighWaterMark(this->tasks[i]);
+  }
+
+  JsonObject latencyObj = metricsObj.createNestedObject("latency");
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (histograms[i].count == 0) {
+      continue;
+    }
+    JsonObject histogramObj = latencyObj.createNestedObject(METRIC_NAMES[i]);
+    histogramObj["n"] = histograms[i].count;
+    histogramObj["max"] = histograms[i].maxMicros;
+    JsonArray bucketsArr = histogramObj.createNestedArray("b");
+    for (int j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++) {
+      bucketsArr.add(histograms[i].buckets[j]);
+    }
+  }
+}
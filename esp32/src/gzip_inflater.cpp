@@ -0,0 +1,203 @@
+#include "gzip_inflater.h"
+
+#include <algorithm>
+
+const uint8_t GZIP_FLAG_HEADER_CRC = 0x02;
+const uint8_t GZIP_FLAG_EXTRA = 0x04;
+const uint8_t GZIP_FLAG_NAME = 0x08;
+const uint8_t GZIP_FLAG_COMMENT = 0x10;
+const uint8_t GZIP_FLAGS_RESERVED = 0xe0;
+const size_t GZIP_HEADER_SIZE = 10;
+
+GzipInflater::~GzipInflater() { this->end(); }
+
+/**
+ * Allocate the inflater and its dictionary, and wait for a gzip header
+ *
+ * @return True if the memory has been allocated
+ */
+bool GzipInflater::begin() {
+  this->end();
+  this->decompressor = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  this->dict = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+  if (!this->decompressor || !this->dict) {
+    this->end();
+    return false;
+  }
+  tinfl_init(this->decompressor);
+  this->dictOffset = 0;
+  this->fieldLength = 0;
+  this->stage = GZIP_STAGE_HEADER;
+  return true;
+}
+
+/**
+ * Pass the next bytes of the stream, the bytes that are inflated from them are
+ * passed to the handler right away
+ *
+ * @param data The stream's next bytes
+ * @param length Number of bytes
+ * @param handler Receives the inflated bytes, returns false to stop
+ * @return False if the stream is invalid or the handler has stopped
+ */
+bool GzipInflater::write(const uint8_t *data, size_t length,
+                         const ChunkHandler &handler) {
+  const uint8_t *next = data;
+  const uint8_t *end = data + length;
+  while (next < end && this->stage != GZIP_STAGE_FAILED &&
+         this->stage != GZIP_STAGE_DONE) {
+    switch (this->stage) {
+      case GZIP_STAGE_HEADER:
+        if (!this->collect(next, end, GZIP_HEADER_SIZE)) {
+          break;
+        }
+        // deflate is the only method defined by RFC 1952
+        if (this->field[0] != 0x1f || this->field[1] != 0x8b ||
+            this->field[2] != 8 || (this->field[3] & GZIP_FLAGS_RESERVED)) {
+          this->stage = GZIP_STAGE_FAILED;
+          break;
+        }
+        this->flags = this->field[3];
+        this->nextHeaderStage();
+        break;
+      case GZIP_STAGE_EXTRA_LENGTH:
+        if (!this->collect(next, end, 2)) {
+          break;
+        }
+        this->extraRemaining = this->field[0] | (this->field[1] << 8);
+        this->stage = GZIP_STAGE_EXTRA;
+        break;
+      case GZIP_STAGE_EXTRA: {
+        size_t n = std::min(this->extraRemaining, (size_t)(end - next));
+        next += n;
+        this->extraRemaining -= n;
+        if (this->extraRemaining == 0) {
+          this->nextHeaderStage();
+        }
+        break;
+      }
+      case GZIP_STAGE_NAME:
+      case GZIP_STAGE_COMMENT:
+        // both are zero-terminated
+        while (next < end && *next != 0) {
+          next++;
+        }
+        if (next < end) {
+          next++;
+          this->nextHeaderStage();
+        }
+        break;
+      case GZIP_STAGE_HEADER_CRC:
+        if (this->collect(next, end, 2)) {
+          this->nextHeaderStage();
+        }
+        break;
+      case GZIP_STAGE_DEFLATE:
+        if (!this->inflate(next, end, handler)) {
+          this->stage = GZIP_STAGE_FAILED;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return this->stage != GZIP_STAGE_FAILED;
+}
+
+/**
+ * Check if the whole deflate stream has been inflated
+ *
+ * @return True if the last block has been inflated
+ */
+bool GzipInflater::isDone() { return this->stage == GZIP_STAGE_DONE; }
+
+/**
+ * Check if the stream was found to be invalid, or if the handler has stopped
+ *
+ * @return True if nothing more can be inflated
+ */
+bool GzipInflater::hasFailed() { return this->stage == GZIP_STAGE_FAILED; }
+
+/**
+ * Release the inflater and its dictionary
+ */
+void GzipInflater::end() {
+  free(this->decompressor);
+  free(this->dict);
+  this->decompressor = nullptr;
+  this->dict = nullptr;
+  this->stage = GZIP_STAGE_FAILED;
+}
+
+/**
+ * Gather a header's field that may be split across writes
+ *
+ * @param next The next byte to read, it is moved past the gathered bytes
+ * @param end The end of the written bytes
+ * @param length The field's length, at most the size of the field's buffer
+ * @return True if the whole field has been gathered
+ */
+bool GzipInflater::collect(const uint8_t *&next, const uint8_t *end,
+                           size_t length) {
+  size_t n = std::min(length - this->fieldLength, (size_t)(end - next));
+  memcpy(this->field + this->fieldLength, next, n);
+  this->fieldLength += n;
+  next += n;
+  return this->fieldLength == length;
+}
+
+/**
+ * Move to the next part of the header that the flags say is present, or to
+ * the deflate stream once the header is over
+ */
+void GzipInflater::nextHeaderStage() {
+  this->fieldLength = 0;
+  if (this->stage < GZIP_STAGE_EXTRA_LENGTH &&
+      (this->flags & GZIP_FLAG_EXTRA)) {
+    this->stage = GZIP_STAGE_EXTRA_LENGTH;
+  } else if (this->stage < GZIP_STAGE_NAME && (this->flags & GZIP_FLAG_NAME)) {
+    this->stage = GZIP_STAGE_NAME;
+  } else if (this->stage < GZIP_STAGE_COMMENT &&
+             (this->flags & GZIP_FLAG_COMMENT)) {
+    this->stage = GZIP_STAGE_COMMENT;
+  } else if (this->stage < GZIP_STAGE_HEADER_CRC &&
+             (this->flags & GZIP_FLAG_HEADER_CRC)) {
+    this->stage = GZIP_STAGE_HEADER_CRC;
+  } else {
+    this->stage = GZIP_STAGE_DEFLATE;
+  }
+}
+
+/**
+ * Inflate the written bytes into the dictionary, which is used as a ring
+ * buffer, and pass every inflated part of the ring to the handler
+ *
+ * @param next The next byte to inflate, it is moved past the consumed bytes
+ * @param end The end of the written bytes
+ * @param handler Receives the inflated bytes
+ * @return False if the stream is invalid or the handler has stopped
+ */
+bool GzipInflater::inflate(const uint8_t *&next, const uint8_t *end,
+                           const ChunkHandler &handler) {
+  tinfl_status status;
+  do {
+    size_t inSize = end - next;
+    size_t outSize = TINFL_LZ_DICT_SIZE - this->dictOffset;
+    status = tinfl_decompress(this->decompressor, next, &inSize, this->dict,
+                              this->dict + this->dictOffset, &outSize,
+                              TINFL_FLAG_HAS_MORE_INPUT);
+    next += inSize;
+    if (outSize > 0 && !handler(this->dict + this->dictOffset, outSize)) {
+      return false;
+    }
+    this->dictOffset = (this->dictOffset + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+  } while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+  if (status == TINFL_STATUS_DONE) {
+    // the trailer is left unread
+    this->stage = GZIP_STAGE_DONE;
+    next = end;
+    return true;
+  }
+  return status == TINFL_STATUS_NEEDS_MORE_INPUT;
+}
@@ -4,24 +4,47 @@
 
 #include "constants.h"
 #include "ioutils.h"
+#include "logging.h"
 #include "time.h"
 
-HappyHerbsState::HappyHerbsState(BH1750 &lightSensorBH17150,
-                                 DHT &tempHumidSensorDHT, int lampPinID,
-                                 int pumpPinID, int moistureSensorPinId) {
+/**
+ * Create the state object
+ *
+ * @param lightSensorBH17150 The light sensor
+ * @param tempHumidSensorDHT The temperature and humidity sensor
+ * @param lampPinID The lamp's pin
+ * @param pumpPinIDs The pins of the zones' pumps, one for each zone
+ * @param moistureSensor The moisture probes of the zones, read as one reading
+ * for each zone
+ */
+HappyHerbsState::HappyHerbsState(AsyncBH1750 &lightSensorBH17150,
+                                 AsyncDHT &tempHumidSensorDHT, int lampPinID,
+                                 const int *pumpPinIDs,
+                                 MoistureSensor &moistureSensor) {
   this->lightSensorBH1750 = &lightSensorBH17150;
   this->tempHumidSensorDHT = &tempHumidSensorDHT;
   this->lampPinID = lampPinID;
-  this->pumpPinID = pumpPinID;
-  this->moistureSensorPinID = moistureSensorPinId;
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    this->pumpPinIDs[zone] = pumpPinIDs[zone];
+  }
+  this->moistureSensor = &moistureSensor;
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    this->samplesMaxAge[i] = SENSOR_SAMPLE_MAX_AGE;
+  }
+  this->sensorDeadbands[HH_SENSOR_LIGHT_BH1750] = SENSOR_DEADBAND_LUX;
+  this->sensorDeadbands[HH_SENSOR_TEMPERATURE] = SENSOR_DEADBAND_TEMPERATURE;
+  this->sensorDeadbands[HH_SENSOR_HUMIDITY] = SENSOR_DEADBAND_HUMIDITY;
+  this->setSensorDeadband(HH_SENSOR_MOISTURE, SENSOR_DEADBAND_MOISTURE);
 }
 
 bool HappyHerbsState::begin() {
+  if (!this->moistureSensor->begin(MOISTURE_SAMPLING_PERIOD)) {
+    return false;
+  }
   if (!this->lightSensorBH1750->begin()) {
     return false;
   }
-  this->tempHumidSensorDHT->begin();
-  return true;
+  return this->tempHumidSensorDHT->begin();
 }
 
 bool HappyHerbsState::readLampPinID() {
@@ -32,348 +55,2050 @@ void HappyHerbsState::writeLampPinID(bool lampState) {
   digitalWrite(this->lampPinID, lampState);
 }
 
-bool HappyHerbsState::readPumpPinID() {
-  return digitalRead(this->pumpPinID) == HIGH;
-}
+bool HappyHerbsState::readPumpPinID() { return this->readZonePumpPinID(0); }
 
 void HappyHerbsState::writePumpPinID(bool pumpState) {
-  digitalWrite(this->pumpPinID, pumpState);
+  this->writeZonePumpPinID(0, pumpState);
 }
 
-float HappyHerbsState::readLightSensorBH1750() {
-  return this->lightSensorBH1750->readLightLevel();
+bool HappyHerbsState::readZonePumpPinID(int zone) {
+  return digitalRead(this->pumpPinIDs[zone]) == HIGH;
+}
+
+void HappyHerbsState::writeZonePumpPinID(int zone, bool pumpState) {
+  digitalWrite(this->pumpPinIDs[zone], pumpState);
+}
+
+/**
+ * Set the maximum age of a sensor's cached reading, a reading that is older
+ * than this is retaken from the hardware when it is requested
+ *
+ * @param sensor The sensor's identifier
+ * @param maxAge Number of milliseconds that a reading remains valid
+ */
+void HappyHerbsState::setSensorMaxAge(HappyHerbsSensor sensor,
+                                      unsigned long maxAge) {
+  this->samplesMaxAge[sensor] = maxAge;
+}
+
+/**
+ * Get the reading of a sensor. The cached reading is returned right away, if it
+ * is no longer fresh, a conversion is started and its result is cached once it
+ * is collected by pollConversions(), so every consumer within the same window
+ * shares one conversion and no consumer waits for the hardware.
+ *
+ * NOTE: Failed conversions are not cached, a stale or NaN reading is returned
+ * until a conversion succeeds
+ *
+ * @param sensor The sensor's identifier
+ * @return The sensor's latest reading
+ */
+float HappyHerbsState::readSensor(HappyHerbsSensor sensor) {
+  return this->readSample(sensor).value;
+}
+
+/**
+ * Get the reading of a sensor along with the time at which it was taken, a
+ * conversion is started if the reading is no longer fresh
+ *
+ * @param sensor The sensor's identifier
+ * @return The sensor's latest sample
+ */
+SensorSample HappyHerbsState::readSample(HappyHerbsSensor sensor) {
+  // the moisture probes are sampled in the background, so their readings are
+  // always fresh and never wait
+  if (sensor >= HH_SENSOR_MOISTURE) {
+    this->storeSample(sensor, this->moistureSensor->readZonePercent(
+                                  sensor - HH_SENSOR_MOISTURE));
+  }
+
+  unsigned long now = millis();
+  portENTER_CRITICAL(&this->samplesMux);
+  SensorSample sample = this->samples[sensor];
+  bool isFresh =
+      sample.isValid && now - sample.tsMillis < this->samplesMaxAge[sensor];
+  portEXIT_CRITICAL(&this->samplesMux);
+  if (!isFresh) {
+    this->startConversion(sensor);
+  }
+  return sample;
+}
+
+/**
+ * Get the cached reading of a sensor regardless of its age, the hardware is
+ * never accessed so this can be called from any task
+ *
+ * @param sensor The sensor's identifier
+ * @return The last successful reading, or NaN if there is none
+ */
+float HappyHerbsState::peekSensor(HappyHerbsSensor sensor) {
+  portENTER_CRITICAL(&this->samplesMux);
+  float value = this->samples[sensor].value;
+  portEXIT_CRITICAL(&this->samplesMux);
+  return value;
+}
+
+/**
+ * Get the cached sample of a sensor regardless of its age, the hardware is
+ * never accessed so this can be called from any task
+ *
+ * @param sensor The sensor's identifier
+ * @return The last successful sample
+ */
+SensorSample HappyHerbsState::peekSample(HappyHerbsSensor sensor) {
+  portENTER_CRITICAL(&this->samplesMux);
+  SensorSample sample = this->samples[sensor];
+  portEXIT_CRITICAL(&this->samplesMux);
+  return sample;
+}
+
+/**
+ * Cache a successful reading, failed readings are dropped
+ *
+ * @param sensor The sensor's identifier
+ * @param value The sensor's reading, or NaN if the reading failed
+ */
+void HappyHerbsState::storeSample(HappyHerbsSensor sensor, float value) {
+  if (isnan(value)) {
+    return;
+  }
+  portENTER_CRITICAL(&this->samplesMux);
+  SensorSample &sample = this->samples[sensor];
+  sample.value = value;
+  sample.tsMillis = millis();
+  sample.isValid = true;
+  portEXIT_CRITICAL(&this->samplesMux);
+}
+
+/**
+ * Start a conversion of the given sensor, the temperature and the humidity are
+ * converted together
+ *
+ * @param sensor The sensor's identifier
+ */
+void HappyHerbsState::startConversion(HappyHerbsSensor sensor) {
+  switch (sensor) {
+    case HH_SENSOR_LIGHT_BH1750:
+      this->lightSensorBH1750->startConversion();
+      break;
+    case HH_SENSOR_TEMPERATURE:
+    case HH_SENSOR_HUMIDITY:
+      this->tempHumidSensorDHT->startConversion();
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Start a conversion of every sensor whose cached reading is no longer fresh
+ */
+void HappyHerbsState::startConversions() {
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    this->readSample((HappyHerbsSensor)i);
+  }
+}
+
+/**
+ * Advance the running conversions and cache the results of the finished ones,
+ * this is meant to be called periodically by a scheduled task and every call
+ * returns after a few short bus transactions at most
+ *
+ * @return True if no conversion is running anymore
+ */
+bool HappyHerbsState::pollConversions() {
+  float lux = NAN;
+  ConversionStatus lightStatus = this->lightSensorBH1750->pollConversion(lux);
+  if (lightStatus == CONVERSION_DONE) {
+    this->storeSample(HH_SENSOR_LIGHT_BH1750, lux);
+  }
+
+  float temperature = NAN;
+  float humidity = NAN;
+  ConversionStatus dhtStatus =
+      this->tempHumidSensorDHT->pollConversion(temperature, humidity);
+  if (dhtStatus == CONVERSION_DONE) {
+    this->storeSample(HH_SENSOR_TEMPERATURE, temperature);
+    this->storeSample(HH_SENSOR_HUMIDITY, humidity);
+  }
+  return lightStatus != CONVERSION_PENDING && dhtStatus != CONVERSION_PENDING;
 }
 
 /**
- * NOTE: Due to an issue related to analogRead() causing WiFi to disconnect,
- * this function does not return the real analog readings of the pin.
+ * Read every sensor whose cached reading is no longer fresh and wait for the
+ * conversions to finish.
  *
- * TODO: Implement the function when the issue on github is resolved
- * (https://github.com/espressif/arduino-esp32/issues/4844)
+ * NOTE: This blocks for the sensors' conversion times, so it is only used
+ * before the scheduler starts
  */
+void HappyHerbsState::refreshSensors() {
+  this->startConversions();
+  while (!this->pollConversions()) {
+    delay(1);
+  }
+}
+
+float HappyHerbsState::readLightSensorBH1750() {
+  return this->readSensor(HH_SENSOR_LIGHT_BH1750);
+}
+
 float HappyHerbsState::readMoistureSensor() {
-#ifdef __HAPPY_HERBS_ESP32S2
-  return 0;
-#else
-  return analogRead(this->moistureSensorPinID) / (float)(1 << 12);
-#endif
+  return this->readSensor(HH_SENSOR_MOISTURE);
 }
 
 float HappyHerbsState::readTemperatureSensor() {
-  return this->tempHumidSensorDHT->readTemperature();
+  return this->readSensor(HH_SENSOR_TEMPERATURE);
+}
+
+float HappyHerbsState::readHumiditySensor() {
+  return this->readSensor(HH_SENSOR_HUMIDITY);
+}
+
+void HappyHerbsState::setLightThreshold(float lightThreshold) {
+  this->lightThreshold = lightThreshold;
+}
+
+void HappyHerbsState::setMoistureThreshold(float moistureThreshold) {
+  this->setZoneMoistureThreshold(0, moistureThreshold);
+}
+
+void HappyHerbsState::setZoneMoistureThreshold(int zone,
+                                               float moistureThreshold) {
+  this->moistureThresholds[zone] = moistureThreshold;
+}
+
+float HappyHerbsState::getLightThreshold() { return this->lightThreshold; }
+
+float HappyHerbsState::getMoistureThreshold() {
+  return this->getZoneMoistureThreshold(0);
+}
+
+float HappyHerbsState::getZoneMoistureThreshold(int zone) {
+  return this->moistureThresholds[zone];
+}
+
+/**
+ * Set the smallest change of a sensor's value that is published, negative
+ * deadbands are taken as 0. The moisture sensors of every zone share one
+ * deadband
+ *
+ * @param sensor The sensor's identifier
+ * @param deadband The smallest change in the sensor's unit
+ */
+void HappyHerbsState::setSensorDeadband(HappyHerbsSensor sensor,
+                                        float deadband) {
+  if (sensor < HH_SENSOR_MOISTURE) {
+    this->sensorDeadbands[sensor] = fmaxf(0.0f, deadband);
+    return;
+  }
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    this->sensorDeadbands[zoneMoistureSensor(zone)] = fmaxf(0.0f, deadband);
+  }
+}
+
+float HappyHerbsState::getSensorDeadband(HappyHerbsSensor sensor) {
+  return this->sensorDeadbands[sensor];
+}
+
+/**
+ * Compute the 32-bit FNV-1a hash of a NUL-terminated string
+ *
+ * @param str The string to be hashed
+ * @return The hash value
+ */
+static uint32_t hashTopic(const char *str) {
+  uint32_t hash = 2166136261u;
+  while (*str) {
+    hash ^= (uint8_t)*str++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Keys of the telemetry payloads, each encoding has its own set of keys
+ */
+enum TelemetryKey {
+  TELEMETRY_KEY_VERSION = 0,
+  TELEMETRY_KEY_TIMESTAMP,
+  TELEMETRY_KEY_THING_NAME,
+  TELEMETRY_KEY_SENSORS,
+  TELEMETRY_KEY_LUX_BH1750,
+  TELEMETRY_KEY_MOISTURE,
+  TELEMETRY_KEY_TEMPERATURE,
+  TELEMETRY_KEY_HUMIDITY,
+  TELEMETRY_KEY_SHADOW,
+  TELEMETRY_KEY_LAMP_STATE,
+  TELEMETRY_KEY_PUMP_STATE,
+  TELEMETRY_KEY_LIGHT_THRESHOLD,
+  TELEMETRY_KEY_MOISTURE_THRESHOLD,
+  TELEMETRY_KEY_WINDOW,
+  TELEMETRY_KEY_STATS,
+  TELEMETRY_KEY_MIN,
+  TELEMETRY_KEY_MAX,
+  TELEMETRY_KEY_STDDEV,
+  TELEMETRY_KEY_N_SAMPLES,
+  TELEMETRY_KEY_ZONES,
+  TELEMETRY_KEY_COUNT,
+};
+
+static const char *const TELEMETRY_KEYS[][TELEMETRY_KEY_COUNT] = {
+    // PAYLOAD_ENCODING_JSON, the schema's version is not included
+    {nullptr, "timestamp", "thingsName", "sensors", "luxBH1750", "moisture",
+     "temperature", "humidity", "shadow", "lampState", "pumpState",
+     "lightThreshold", "moistureThreshold", "window", "stats", "min", "max",
+     "stddev", "count", "zones"},
+    // PAYLOAD_ENCODING_MSGPACK
+    {"v", "t", "id", "s", "lx", "mo", "te", "hu", "sh", "ls", "ps", "lt", "mt",
+     "w", "st", "mn", "mx", "sd", "n", "z"},
+};
+
+/**
+ * Add the fields that are common to every telemetry payload
+ *
+ * @param doc The payload's document
+ * @param keys The keys of the payload's encoding
+ * @param timestamp Time at which the payload's data was taken
+ * @param thingName The assigned name of this MCU
+ */
+static void setTelemetryHeader(JsonDocument &doc, const char *const *keys,
+                               time_t timestamp, const String &thingName) {
+  if (keys[TELEMETRY_KEY_VERSION]) {
+    doc[keys[TELEMETRY_KEY_VERSION]] = TELEMETRY_SCHEMA_VERSION;
+  }
+  doc[keys[TELEMETRY_KEY_TIMESTAMP]] = timestamp;
+  doc[keys[TELEMETRY_KEY_THING_NAME]] = thingName;
+}
+
+/**
+ * Check if a received value can be assigned to a shadow's field
+ *
+ * @param type The field's type
+ * @param value The received value
+ * @return True if the value has the field's type
+ */
+static bool isShadowFieldType(ShadowFieldType type, JsonVariantConst value) {
+  switch (type) {
+    case SHADOW_FIELD_TYPE_BOOL:
+      return value.is<bool>();
+    case SHADOW_FIELD_TYPE_FLOAT:
+      return value.is<float>();
+    default:
+      return false;
+  }
+}
+
+/**
+ * Every field of the shadow's state that is shared by the zones and is
+ * synchronized with AWS, adding a sensor or an actuator to the shadow only
+ * requires an entry in this table
+ */
+const ShadowFieldDescriptor HappyHerbsService::SHADOW_FIELDS[] = {
+    {"lampState", SHADOW_FIELD_TYPE_BOOL, SHADOW_FIELD_LAMP_STATE,
+     &HappyHerbsService::tsLampState, &HappyHerbsService::applyLampState,
+     &HappyHerbsService::readLampState},
+    {"lightThreshold", SHADOW_FIELD_TYPE_FLOAT, SHADOW_FIELD_LIGHT_THRESHOLD,
+     &HappyHerbsService::tsLightThreshold,
+     &HappyHerbsService::applyLightThreshold,
+     &HappyHerbsService::readLightThreshold},
+    {"luxDeadband", SHADOW_FIELD_TYPE_FLOAT, SHADOW_FIELD_LUX_DEADBAND,
+     &HappyHerbsService::tsLuxDeadband, &HappyHerbsService::applyLuxDeadband,
+     &HappyHerbsService::readLuxDeadband},
+    {"moistureDeadband", SHADOW_FIELD_TYPE_FLOAT,
+     SHADOW_FIELD_MOISTURE_DEADBAND, &HappyHerbsService::tsMoistureDeadband,
+     &HappyHerbsService::applyMoistureDeadband,
+     &HappyHerbsService::readMoistureDeadband},
+    {"temperatureDeadband", SHADOW_FIELD_TYPE_FLOAT,
+     SHADOW_FIELD_TEMPERATURE_DEADBAND,
+     &HappyHerbsService::tsTemperatureDeadband,
+     &HappyHerbsService::applyTemperatureDeadband,
+     &HappyHerbsService::readTemperatureDeadband},
+    {"humidityDeadband", SHADOW_FIELD_TYPE_FLOAT,
+     SHADOW_FIELD_HUMIDITY_DEADBAND, &HappyHerbsService::tsHumidityDeadband,
+     &HappyHerbsService::applyHumidityDeadband,
+     &HappyHerbsService::readHumidityDeadband},
+};
+
+const int HappyHerbsService::N_SHADOW_FIELDS =
+    sizeof(HappyHerbsService::SHADOW_FIELDS) / sizeof(ShadowFieldDescriptor);
+
+/**
+ * Every field that each zone has in the shadow, in the order of the
+ * ZoneShadowField enum. The fields of zone 0 are kept at the top level of the
+ * shadow's state, the fields of the other zones are kept in the "zones" object
+ * under the zone's index, e.g. {"zones": {"1": {"pumpState": false}}}
+ */
+const ZoneShadowFieldDescriptor HappyHerbsService::ZONE_SHADOW_FIELDS[] = {
+    {"pumpState", SHADOW_FIELD_TYPE_BOOL, &HappyHerbsService::tsPumpStates,
+     &HappyHerbsService::applyPumpState, &HappyHerbsService::readPumpState},
+    {"moistureThreshold", SHADOW_FIELD_TYPE_FLOAT,
+     &HappyHerbsService::tsMoistureThresholds,
+     &HappyHerbsService::applyMoistureThreshold,
+     &HappyHerbsService::readMoistureThreshold},
+};
+
+static_assert(sizeof(HappyHerbsService::ZONE_SHADOW_FIELDS) /
+                      sizeof(ZoneShadowFieldDescriptor) ==
+                  ZONE_SHADOW_FIELD_COUNT,
+              "Every zone's field must have a descriptor");
+
+/**
+ * Get the shadow's field that holds the deadband of a sensor
+ *
+ * @param sensor The sensor's identifier
+ * @return The field's flag
+ */
+static ShadowFieldMask deadbandShadowField(HappyHerbsSensor sensor) {
+  switch (sensor) {
+    case HH_SENSOR_LIGHT_BH1750:
+      return SHADOW_FIELD_LUX_DEADBAND;
+    case HH_SENSOR_TEMPERATURE:
+      return SHADOW_FIELD_TEMPERATURE_DEADBAND;
+    case HH_SENSOR_HUMIDITY:
+      return SHADOW_FIELD_HUMIDITY_DEADBAND;
+    default:
+      return SHADOW_FIELD_MOISTURE_DEADBAND;
+  }
+}
+
+/**
+ * Get the flags of every field of a zone
+ *
+ * @param zone The zone's index
+ * @return The fields' flags
+ */
+static ShadowFieldMask zoneShadowFields(int zone) {
+  ShadowFieldMask fields = 0;
+  for (int i = 0; i < ZONE_SHADOW_FIELD_COUNT; i++) {
+    fields |= zoneShadowField(zone, i);
+  }
+  return fields;
+}
+
+/**
+ * Definition and usages of MQTT payload, and how to interact with the broker is
+ * documented by AWS at
+ * https://docs.aws.amazon.com/iot/latest/developerguide/iot-device-shadows.html
+ */
+HappyHerbsService::HappyHerbsService(HappyHerbsState &hhState,
+                                     PubSubClient &pubsub)
+    : shadowInflight(SHADOW_ACK_TIMEOUT) {
+  this->hhState = &hhState;
+  this->pubsub = &pubsub;
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    this->reportedSensors[i] = NAN;
+  }
+  // the reported and desired states of a fetched shadow are not used, only the
+  // difference between them is applied
+  this->shadowGetFilter["version"] = true;
+  this->shadowGetFilter["timestamp"] = true;
+  this->shadowGetFilter["state"]["delta"] = true;
+  this->shadowGetFilter["metadata"]["desired"] = true;
+  // only the reported values of an accepted update are reconciled
+  this->shadowUpdateFilter["clientToken"] = true;
+  this->shadowUpdateFilter["version"] = true;
+  this->shadowUpdateFilter["state"]["reported"] = true;
+}
+
+/**
+ * Lease a JSON document from the service's pools, the smallest document that
+ * has the requested capacity is used if there is one available
+ *
+ * @param capacity Number of bytes required by the document
+ * @return The lease of the document, it is empty if no document is available
+ */
+JsonDocumentLease HappyHerbsService::leaseJsonDocument(size_t capacity) {
+  if (capacity <= JSON_SMALL_DOCUMENT_CAPACITY) {
+    JsonDocumentLease lease(this->smallJsonDocs);
+    if (lease) {
+      return lease;
+    }
+  }
+  if (capacity > JSON_LARGE_DOCUMENT_CAPACITY) {
+    return JsonDocumentLease();
+  }
+  return JsonDocumentLease(this->largeJsonDocs);
+}
+
+JsonPoolStats HappyHerbsService::getSmallJsonPoolStats() {
+  return this->smallJsonDocs.stats();
+}
+
+JsonPoolStats HappyHerbsService::getLargeJsonPoolStats() {
+  return this->largeJsonDocs.stats();
+}
+
+/**
+ * Create the queue that passes the commands received from AWS to the control
+ * task.
+ *
+ * NOTE: This must be called before the network task is started
+ *
+ * @return True if the queue is created
+ */
+bool HappyHerbsService::begin() {
+  // tokens start at a random value so the responses to the updates sent before
+  // a reboot are not taken for the responses to the new updates
+  this->nextClientToken = esp_random();
+  this->commandQueue =
+      xQueueCreate(COMMAND_QUEUE_SIZE, sizeof(HappyHerbsCommand));
+  return this->commandQueue != nullptr;
+}
+
+/**
+ * Apply every command that has been received from AWS, this must be called
+ * from the control task which owns the actuators and the plant watering task
+ */
+void HappyHerbsService::processCommands() {
+  HappyHerbsCommand command;
+  while (xQueueReceive(this->commandQueue, &command, 0) == pdTRUE) {
+    if (command.zone < 0) {
+      (this->*SHADOW_FIELDS[command.field].apply)(command.value);
+    } else {
+      (this->*ZONE_SHADOW_FIELDS[command.field].apply)(command.zone,
+                                                       command.value);
+    }
+  }
+}
+
+/**
+ * Set up the one-shot hardware timers that end the zones' plant watering
+ * routines, a zone's pump is turned on when its routine starts and its timer
+ * turns it off after `wateringDuration` milliseconds. The timers' callback
+ * drives the pins directly, so the watering duration never depends on the
+ * network.
+ *
+ * NOTE: The timers' callback runs on the esp_timer task
+ *
+ * @param wateringDuration Number of milliseconds that a pump is turned on
+ * @return True if every timer is created
+ */
+bool HappyHerbsService::setupPlantWatering(long wateringDuration) {
+  this->wateringDuration = (uint64_t)wateringDuration * 1000;
+
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    WateringZone &watering = this->wateringZones[zone];
+    watering.service = this;
+    watering.zone = zone;
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = [](void *arg) {
+      WateringZone *routine = static_cast<WateringZone *>(arg);
+      routine->service->stopWatering(routine->zone);
+    };
+    timerArgs.arg = &watering;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = "watering";
+    if (esp_timer_create(&timerArgs, &watering.timer) != ESP_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Start the plant watering routine of a zone, the zone's pump is turned on
+ * right away and the routine is restarted if it is already running
+ *
+ * @param zone The zone's index
+ */
+void HappyHerbsService::startWatering(int zone) {
+  HH_LOGI("START WATERING zone %d", zone);
+  WateringZone &watering = this->wateringZones[zone];
+  esp_timer_stop(watering.timer);
+  watering.isWatering = true;
+  this->writeZonePumpPinID(zone, true);
+  esp_timer_start_once(watering.timer, this->wateringDuration);
+}
+
+/**
+ * Stop the plant watering routine of a zone and turn off its pump, the change
+ * is reported to AWS asynchronously by the network task
+ *
+ * @param zone The zone's index
+ */
+void HappyHerbsService::stopWatering(int zone) {
+  WateringZone &watering = this->wateringZones[zone];
+  esp_timer_stop(watering.timer);
+  this->writeZonePumpPinID(zone, false);
+  watering.isWatering = false;
+}
+
+/**
+ * Set the name of this MCU designated by AWS, then setup of the MQTT topics
+ * that are used to communicate with AWS and register their handlers.
+ *
+ * NOTE: This clears the topic dispatch table, handlers of other features must
+ * be registered after calling this method
+ *
+ * @param thingName The assigned name
+ */
+void HappyHerbsService::setThingName(String thingName) {
+  this->thingName = thingName;
+
+  String shadowPrefix = "$aws/things/" + thingName + "/shadow";
+
+  this->topicShadowGet = shadowPrefix + "/get";
+  this->topicShadowGetAccepted = this->topicShadowGet + "/accepted";
+  this->topicShadowGetRejected = this->topicShadowGet + "/rejected";
+
+  this->topicShadowUpdate = shadowPrefix + "/update";
+  this->topicShadowUpdateAccepted = this->topicShadowUpdate + "/accepted";
+  this->topicShadowUpdateRejected = this->topicShadowUpdate + "/rejected";
+  this->topicShadowUpdateDelta = this->topicShadowUpdate + "/delta";
+
+  this->nTopicRoutes = 0;
+  this->registerShadowHandler(this->topicShadowGetAccepted,
+                              &HappyHerbsService::handleShadowGetAccepted,
+                              SHADOW_GET_DOCUMENT_CAPACITY,
+                              &this->shadowGetFilter);
+  this->registerShadowHandler(this->topicShadowGetRejected,
+                              &HappyHerbsService::handleShadowGetRejected,
+                              SHADOW_ERROR_DOCUMENT_CAPACITY);
+  this->registerShadowHandler(this->topicShadowUpdateAccepted,
+                              &HappyHerbsService::handleShadowUpdateAccepted,
+                              SHADOW_UPDATE_DOCUMENT_CAPACITY,
+                              &this->shadowUpdateFilter);
+  this->registerShadowHandler(this->topicShadowUpdateRejected,
+                              &HappyHerbsService::handleShadowUpdateRejected,
+                              SHADOW_ERROR_DOCUMENT_CAPACITY);
+  this->registerShadowHandler(this->topicShadowUpdateDelta,
+                              &HappyHerbsService::handleShadowUpdateDelta,
+                              SHADOW_UPDATE_DOCUMENT_CAPACITY);
+}
+
+/**
+ * Register a handler for a shadow's topic, the received payload is parsed as a
+ * JSON document before being passed to the handler. The payload is parsed in
+ * place, so the document's strings point into the client's buffer.
+ *
+ * NOTE: Publishing overwrites the client's buffer, so a handler must not
+ * publish while it still reads the document
+ *
+ * @param topic MQTT topic
+ * @param handler Method that processes the JSON document
+ * @param capacity Number of bytes required by the topic's documents
+ * @param filter Only the fields of the filter are parsed, every field is parsed
+ * if this is null
+ */
+void HappyHerbsService::registerShadowHandler(
+    const String &topic,
+    void (HappyHerbsService::*handler)(const JsonDocument &), size_t capacity,
+    const JsonDocument *filter) {
+  this->registerTopicHandler(topic, [this, handler, capacity, filter](
+                                        const char *, byte *payload,
+                                        unsigned int length) {
+    JsonDocumentLease jsonDoc = this->leaseJsonDocument(capacity);
+    if (!jsonDoc) {
+      HH_LOGW("DROPPED message, no JSON document available");
+      return;
+    }
+    DeserializationError err =
+        filter ? deserializeJson(*jsonDoc, (char *)payload, length,
+                                 DeserializationOption::Filter(*filter))
+               : deserializeJson(*jsonDoc, (char *)payload, length);
+    if (err) {
+      HH_LOGW("DROPPED message, %s", err.c_str());
+      return;
+    }
+    (this->*handler)(*jsonDoc);
+  });
+}
+
+/**
+ * Set the LED that indicates sent and received messages
+ *
+ * @param statusLed The LED's driver
+ */
+void HappyHerbsService::setStatusLed(StatusLed &statusLed) {
+  this->statusLed = &statusLed;
+}
+
+/**
+ * Set the buffer that stores the sensors' measurements while the client is not
+ * connected
+ *
+ * @param telemetryBuffer The flash-backed buffer
+ */
+void HappyHerbsService::setTelemetryBuffer(TelemetryBuffer &telemetryBuffer) {
+  this->telemetryBuffer = &telemetryBuffer;
+}
+
+/**
+ * Set the metrics that record the latencies of the MQTT client and that are
+ * published on the device metrics topic
+ *
+ * @param deviceMetrics The metrics' aggregator
+ */
+void HappyHerbsService::setDeviceMetrics(DeviceMetrics &deviceMetrics) {
+  this->deviceMetrics = &deviceMetrics;
+}
+
+/**
+ * Set the bench that follows the commands received from AWS, this is only set
+ * in the bench mode
+ *
+ * @param soakBench The soak's measurements
+ */
+void HappyHerbsService::setSoakBench(SoakBench &soakBench) {
+  this->soakBench = &soakBench;
+}
+
+/**
+ * Copy the shadow's state and its timestamps so they can be kept while the MCU
+ * is in deep sleep
+ *
+ * @param rtcState Destination of the state
+ */
+void HappyHerbsService::saveRtcState(HappyHerbsRtcState &rtcState) {
+  rtcState.tsLampState = this->tsLampState;
+  rtcState.tsLightThreshold = this->tsLightThreshold;
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    rtcState.tsPumpStates[zone] = this->tsPumpStates[zone];
+    rtcState.tsMoistureThresholds[zone] = this->tsMoistureThresholds[zone];
+    rtcState.moistureThresholds[zone] =
+        this->hhState->getZoneMoistureThreshold(zone);
+  }
+  rtcState.tsLuxDeadband = this->tsLuxDeadband;
+  rtcState.tsMoistureDeadband = this->tsMoistureDeadband;
+  rtcState.tsTemperatureDeadband = this->tsTemperatureDeadband;
+  rtcState.tsHumidityDeadband = this->tsHumidityDeadband;
+  rtcState.tsShadowGetResponse = this->tsShadowGetResponse;
+  rtcState.shadowVersion = this->shadowVersion;
+  rtcState.tsShadowUpdateDelta = this->tsShadowUpdateDelta;
+  rtcState.lightThreshold = this->hhState->getLightThreshold();
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    rtcState.sensorDeadbands[i] =
+        this->hhState->getSensorDeadband((HappyHerbsSensor)i);
+    rtcState.reportedSensors[i] = this->reportedSensors[i];
+  }
+  rtcState.tsSensorsReported = this->tsSensorsReported;
+  rtcState.lampState = this->hhState->readLampPinID();
+}
+
+/**
+ * Restore the shadow's state and its timestamps after waking up from deep
+ * sleep. Nothing is reported to AWS since the state has not changed
+ *
+ * @param rtcState The saved state
+ */
+void HappyHerbsService::restoreRtcState(const HappyHerbsRtcState &rtcState) {
+  this->tsLampState = rtcState.tsLampState;
+  this->tsLightThreshold = rtcState.tsLightThreshold;
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    this->tsPumpStates[zone] = rtcState.tsPumpStates[zone];
+    this->tsMoistureThresholds[zone] = rtcState.tsMoistureThresholds[zone];
+    this->hhState->setZoneMoistureThreshold(
+        zone, rtcState.moistureThresholds[zone]);
+  }
+  this->tsLuxDeadband = rtcState.tsLuxDeadband;
+  this->tsMoistureDeadband = rtcState.tsMoistureDeadband;
+  this->tsTemperatureDeadband = rtcState.tsTemperatureDeadband;
+  this->tsHumidityDeadband = rtcState.tsHumidityDeadband;
+  this->tsShadowGetResponse = rtcState.tsShadowGetResponse;
+  this->shadowVersion = rtcState.shadowVersion;
+  this->tsShadowUpdateDelta = rtcState.tsShadowUpdateDelta;
+  this->hhState->setLightThreshold(rtcState.lightThreshold);
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    this->hhState->setSensorDeadband((HappyHerbsSensor)i,
+                                     rtcState.sensorDeadbands[i]);
+    this->reportedSensors[i] = rtcState.reportedSensors[i];
+  }
+  this->tsSensorsReported = rtcState.tsSensorsReported;
+  this->hhState->writeLampPinID(rtcState.lampState);
+}
+
+/**
+ * Check if the service has no pending work, i.e. every change has been
+ * reported, no pump is running and no message has been sent or received during
+ * the last `window` milliseconds
+ *
+ * @param window Number of milliseconds without any activity
+ * @return True if the service is idle
+ */
+bool HappyHerbsService::isIdle(unsigned long window) {
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    if (this->wateringZones[zone].isWatering) {
+      return false;
+    }
+  }
+  return this->shadowDirtyFields == 0 && this->shadowInflight.isEmpty() &&
+         millis() - this->tsLastActivity >= window;
+}
+
+/**
+ * Set whether the sensors' measurements are published as summaries of windows
+ * or as single samples
+ *
+ * @param aggregation The aggregation of the measurements
+ */
+void HappyHerbsService::setSensorsAggregation(SensorsAggregation aggregation) {
+  this->sensorsAggregation = aggregation;
+}
+
+/**
+ * Set the longest time without publishing the sensors' measurements, the
+ * measurements are published once this has passed even if no value has moved
+ * beyond its deadband
+ *
+ * @param heartbeat Number of milliseconds between two publishes at most
+ */
+void HappyHerbsService::setSensorsHeartbeat(unsigned long heartbeat) {
+  this->sensorsHeartbeat = heartbeat;
+}
+
+/**
+ * Set the encoding of the payloads that are published to
+ * TOPIC_SENSORS_MEASUREMENTS
+ *
+ * @param encoding The payload's encoding
+ */
+void HappyHerbsService::setSensorsMeasurementsEncoding(
+    PayloadEncoding encoding) {
+  this->sensorsMeasurementsEncoding = encoding;
+}
+
+/**
+ * Set the encoding of the payloads that are published to TOPIC_STATE_SNAPSHOT
+ *
+ * @param encoding The payload's encoding
+ */
+void HappyHerbsService::setStateSnapshotEncoding(PayloadEncoding encoding) {
+  this->stateSnapshotEncoding = encoding;
+}
+
+/**
+ * Set the number of milliseconds that local changes to the shadow are gathered
+ * before being reported to AWS as a single update message. With a window of 0,
+ * changes made during one scheduler pass are reported together
+ *
+ * @param window Number of milliseconds to wait before flushing the changes
+ */
+void HappyHerbsService::setShadowFlushWindow(unsigned long window) {
+  this->shadowFlushWindow = window;
+}
+
+/**
+ * Mark the given shadow's fields as changed so they are included in the next
+ * update message. The flush window starts when the first field is marked. This
+ * can be called from any task
+ *
+ * @param fields Bit flags of the changed fields
+ */
+void HappyHerbsService::markShadowDirty(ShadowFieldMask fields) {
+  portENTER_CRITICAL(&this->shadowDirtyMux);
+  if (this->shadowDirtyFields == 0) {
+    this->tsShadowDirty = millis();
+  }
+  this->shadowDirtyFields |= fields;
+  portEXIT_CRITICAL(&this->shadowDirtyMux);
+}
+
+/**
+ * Get and clear the changed shadow's fields
+ *
+ * @return Bit flags of the changed fields
+ */
+ShadowFieldMask HappyHerbsService::takeShadowDirty() {
+  portENTER_CRITICAL(&this->shadowDirtyMux);
+  ShadowFieldMask fields = this->shadowDirtyFields;
+  this->shadowDirtyFields = 0;
+  portEXIT_CRITICAL(&this->shadowDirtyMux);
+  return fields;
+}
+
+void HappyHerbsService::applyLampState(float value) {
+  this->writeLampPinID(value != 0);
+}
+
+/**
+ * Turning on a zone's pump starts the zone's plant watering routine, so the
+ * pump is always turned off after the watering duration
+ */
+void HappyHerbsService::applyPumpState(int zone, float value) {
+  if (value != 0) {
+    this->startWatering(zone);
+  } else {
+    this->stopWatering(zone);
+  }
+}
+
+void HappyHerbsService::applyLightThreshold(float value) {
+  this->setLightThreshold(value);
+}
+
+void HappyHerbsService::applyMoistureThreshold(int zone, float value) {
+  this->setZoneMoistureThreshold(zone, value);
+}
+
+void HappyHerbsService::applyLuxDeadband(float value) {
+  this->setSensorDeadband(HH_SENSOR_LIGHT_BH1750, value);
+}
+
+void HappyHerbsService::applyMoistureDeadband(float value) {
+  this->setSensorDeadband(HH_SENSOR_MOISTURE, value);
+}
+
+void HappyHerbsService::applyTemperatureDeadband(float value) {
+  this->setSensorDeadband(HH_SENSOR_TEMPERATURE, value);
+}
+
+void HappyHerbsService::applyHumidityDeadband(float value) {
+  this->setSensorDeadband(HH_SENSOR_HUMIDITY, value);
+}
+
+float HappyHerbsService::readLampState() {
+  return this->hhState->readLampPinID();
+}
+
+float HappyHerbsService::readPumpState(int zone) {
+  return this->hhState->readZonePumpPinID(zone);
+}
+
+float HappyHerbsService::readLightThreshold() {
+  return this->hhState->getLightThreshold();
+}
+
+float HappyHerbsService::readMoistureThreshold(int zone) {
+  return this->hhState->getZoneMoistureThreshold(zone);
+}
+
+float HappyHerbsService::readLuxDeadband() {
+  return this->hhState->getSensorDeadband(HH_SENSOR_LIGHT_BH1750);
+}
+
+float HappyHerbsService::readMoistureDeadband() {
+  return this->hhState->getSensorDeadband(HH_SENSOR_MOISTURE);
+}
+
+float HappyHerbsService::readTemperatureDeadband() {
+  return this->hhState->getSensorDeadband(HH_SENSOR_TEMPERATURE);
+}
+
+float HappyHerbsService::readHumidityDeadband() {
+  return this->hhState->getSensorDeadband(HH_SENSOR_HUMIDITY);
+}
+
+/**
+ * Convert a received value of a shadow's field to a command's value, booleans
+ * are taken as 0 or 1
+ *
+ * @param type The field's type
+ * @param value The received value
+ * @return The command's value
+ */
+static float toCommandValue(ShadowFieldType type, JsonVariantConst value) {
+  if (type == SHADOW_FIELD_TYPE_BOOL) {
+    return value.as<bool>() ? 1 : 0;
+  }
+  return value.as<float>();
+}
+
+/**
+ * Write the value of a shadow's field to an object
+ *
+ * @param obj Destination object
+ * @param name The field's name
+ * @param type The field's type
+ * @param value The field's value, booleans are given as 0 or 1
+ */
+static void setShadowFieldValue(JsonObject obj, const char *name,
+                                ShadowFieldType type, float value) {
+  if (type == SHADOW_FIELD_TYPE_BOOL) {
+    obj[name] = value != 0;
+  } else {
+    obj[name] = value;
+  }
+}
+
+/**
+ * Apply the fields of a delta state, the shared fields and the zones are
+ * applied in a single pass over the delta object. A field is only applied if
+ * its type is correct and its timestamp is newer than the one of the last
+ * applied value. The changes are passed as commands to the control task
+ *
+ * @param delta Object that maps the fields' names to their desired values
+ * @param metadata Object that maps the fields' names to their metadata
+ */
+void HappyHerbsService::applyShadowDelta(JsonObjectConst delta,
+                                         JsonObjectConst metadata) {
+  for (JsonPairConst kv : delta) {
+    const char *name = kv.key().c_str();
+    if (strcmp(name, "zones") == 0) {
+      for (JsonPairConst zoneKv : kv.value().as<JsonObjectConst>()) {
+        int zone = atoi(zoneKv.key().c_str());
+        if (zone < 1 || zone >= HH_ZONE_COUNT) {
+          continue;
+        }
+        this->applyZoneDelta(
+            zone, zoneKv.value().as<JsonObjectConst>(),
+            metadata["zones"][zoneKv.key().c_str()].as<JsonObjectConst>());
+      }
+      continue;
+    }
+    for (int i = 0; i < N_SHADOW_FIELDS; i++) {
+      const ShadowFieldDescriptor &field = SHADOW_FIELDS[i];
+      if (strcmp(name, field.name) != 0) {
+        continue;
+      }
+      HappyHerbsCommand command;
+      command.field = i;
+      command.zone = -1;
+      this->queueCommand(command, field.type, kv.value(),
+                         metadata[name]["timestamp"] | 0,
+                         this->*field.timestamp);
+      break;
+    }
+  }
+  // the fields of zone 0 are kept at the top level
+  this->applyZoneDelta(0, delta, metadata);
+}
+
+/**
+ * Apply the fields of a zone that are in a delta state
+ *
+ * @param zone The zone's index
+ * @param delta Object that maps the zone's fields to their desired values
+ * @param metadata Object that maps the zone's fields to their metadata
+ */
+void HappyHerbsService::applyZoneDelta(int zone, JsonObjectConst delta,
+                                       JsonObjectConst metadata) {
+  for (int i = 0; i < ZONE_SHADOW_FIELD_COUNT; i++) {
+    const ZoneShadowFieldDescriptor &field = ZONE_SHADOW_FIELDS[i];
+    JsonVariantConst value = delta[field.name];
+    if (value.isNull()) {
+      continue;
+    }
+    HappyHerbsCommand command;
+    command.field = i;
+    command.zone = zone;
+    this->queueCommand(command, field.type, value,
+                       metadata[field.name]["timestamp"] | 0,
+                       (this->*field.timestamps)[zone]);
+  }
+}
+
+/**
+ * Pass a received value of a shadow's field to the control task, the value is
+ * only passed if it has the field's type and it is newer than the last applied
+ * value
+ *
+ * @param command The command's field and zone
+ * @param type The field's type
+ * @param value The received value
+ * @param ts The timestamp of the received value
+ * @param tsApplied The timestamp of the last applied value, it is updated once
+ * the command is passed
+ */
+void HappyHerbsService::queueCommand(HappyHerbsCommand command,
+                                     ShadowFieldType type,
+                                     JsonVariantConst value, int ts,
+                                     int &tsApplied) {
+  if (!isShadowFieldType(type, value) || ts <= tsApplied) {
+    return;
+  }
+  command.value = toCommandValue(type, value);
+  if (xQueueSend(this->commandQueue, &command, 0) == pdTRUE) {
+    tsApplied = ts;
+  } else {
+    HH_LOGW("DROPPED command for field %d of zone %d", command.field,
+            command.zone);
+  }
+}
+
+/**
+ * Write the current values of the selected shadow's fields to an object, the
+ * fields of the zones other than zone 0 are written to the "zones" object
+ *
+ * @param obj Destination object
+ * @param fields Bit flags of the selected fields
+ */
+void HappyHerbsService::reportShadowFields(JsonObject obj,
+                                           ShadowFieldMask fields) {
+  for (int i = 0; i < N_SHADOW_FIELDS; i++) {
+    const ShadowFieldDescriptor &field = SHADOW_FIELDS[i];
+    if (fields & field.flag) {
+      setShadowFieldValue(obj, field.name, field.type, (this->*field.read)());
+    }
+  }
+  this->reportZoneFields(obj, 0, fields);
+  for (int zone = 1; zone < HH_ZONE_COUNT; zone++) {
+    if (!(fields & zoneShadowFields(zone))) {
+      continue;
+    }
+    char key[4];
+    snprintf(key, sizeof(key), "%d", zone);
+    JsonObject zonesObj = obj["zones"];
+    if (zonesObj.isNull()) {
+      zonesObj = obj.createNestedObject("zones");
+    }
+    this->reportZoneFields(zonesObj.createNestedObject(key), zone, fields);
+  }
+}
+
+/**
+ * Write the current values of the selected fields of a zone to an object
+ *
+ * @param obj Destination object
+ * @param zone The zone's index
+ * @param fields Bit flags of the selected fields
+ */
+void HappyHerbsService::reportZoneFields(JsonObject obj, int zone,
+                                         ShadowFieldMask fields) {
+  for (int i = 0; i < ZONE_SHADOW_FIELD_COUNT; i++) {
+    const ZoneShadowFieldDescriptor &field = ZONE_SHADOW_FIELDS[i];
+    if (fields & zoneShadowField(zone, i)) {
+      setShadowFieldValue(obj, field.name, field.type,
+                          (this->*field.read)(zone));
+    }
+  }
+}
+
+/**
+ * Compare the selected fields of a reported state with the current values
+ *
+ * @param reported Object that maps the fields' names to their reported values
+ * @param fields Bit flags of the selected fields
+ * @return Bit flags of the fields whose reported value is not the current one
+ */
+ShadowFieldMask HappyHerbsService::findMismatchedFields(
+    JsonObjectConst reported, ShadowFieldMask fields) {
+  ShadowFieldMask mismatched = 0;
+  for (int i = 0; i < N_SHADOW_FIELDS; i++) {
+    const ShadowFieldDescriptor &field = SHADOW_FIELDS[i];
+    JsonVariantConst value = reported[field.name];
+    if (!(fields & field.flag) || !isShadowFieldType(field.type, value)) {
+      continue;
+    }
+    if (toCommandValue(field.type, value) != (this->*field.read)()) {
+      mismatched |= field.flag;
+    }
+  }
+  mismatched |= this->findMismatchedZoneFields(reported, 0, fields);
+  for (int zone = 1; zone < HH_ZONE_COUNT; zone++) {
+    if (!(fields & zoneShadowFields(zone))) {
+      continue;
+    }
+    char key[4];
+    snprintf(key, sizeof(key), "%d", zone);
+    mismatched |= this->findMismatchedZoneFields(
+        reported["zones"][key].as<JsonObjectConst>(), zone, fields);
+  }
+  return mismatched;
+}
+
+/**
+ * Compare the selected fields of a zone's reported state with the current
+ * values
+ *
+ * @param reported Object that maps the zone's fields to their reported values
+ * @param zone The zone's index
+ * @param fields Bit flags of the selected fields
+ * @return Bit flags of the fields whose reported value is not the current one
+ */
+ShadowFieldMask HappyHerbsService::findMismatchedZoneFields(
+    JsonObjectConst reported, int zone, ShadowFieldMask fields) {
+  ShadowFieldMask mismatched = 0;
+  for (int i = 0; i < ZONE_SHADOW_FIELD_COUNT; i++) {
+    const ZoneShadowFieldDescriptor &field = ZONE_SHADOW_FIELDS[i];
+    ShadowFieldMask flag = zoneShadowField(zone, i);
+    JsonVariantConst value = reported[field.name];
+    if (!(fields & flag) || !isShadowFieldType(field.type, value)) {
+      continue;
+    }
+    if (toCommandValue(field.type, value) != (this->*field.read)(zone)) {
+      mismatched |= flag;
+    }
+  }
+  return mismatched;
+}
+
+/**
+ * Set the lamp's state using the underlying state object and schedule a
+ * message to indicate state changes to AWS
+ *
+ * @param state Desired lamp's state
+ */
+void HappyHerbsService::writeLampPinID(bool state) {
+  this->hhState->writeLampPinID(state);
+  if (this->soakBench) {
+    this->soakBench->recordActuation(SHADOW_FIELD_LAMP_STATE);
+  }
+  this->markShadowDirty(SHADOW_FIELD_LAMP_STATE);
+}
+
+/**
+ * Set the pump's state of zone 0 using the underlying state object and schedule
+ * a message to indicate state changes to AWS
+ *
+ * @param state Desired pump's state
+ */
+void HappyHerbsService::writePumpPinID(bool state) {
+  this->writeZonePumpPinID(0, state);
+}
+
+/**
+ * Set the pump's state of a zone using the underlying state object and
+ * schedule a message to indicate state changes to AWS
+ *
+ * @param zone The zone's index
+ * @param state Desired pump's state
+ */
+void HappyHerbsService::writeZonePumpPinID(int zone, bool state) {
+  this->hhState->writeZonePumpPinID(zone, state);
+  if (this->soakBench) {
+    this->soakBench->recordActuation(
+        zoneShadowField(zone, ZONE_SHADOW_FIELD_PUMP_STATE));
+  }
+  this->markShadowDirty(zoneShadowField(zone, ZONE_SHADOW_FIELD_PUMP_STATE));
+}
+
+/**
+ * Set the light threshold using the underlying state object and schedule a
+ * message to indicate state changes to AWS
+ *
+ * @param threshold Desired light threshold
+ */
+void HappyHerbsService::setLightThreshold(float threshold) {
+  this->hhState->setLightThreshold(threshold);
+  this->markShadowDirty(SHADOW_FIELD_LIGHT_THRESHOLD);
+}
+
+/**
+ * Set the moisture threshold of zone 0 using the underlying state object and
+ * schedule a message to indicate state changes to AWS
+ *
+ * @param threshold Desired moisture threshold
+ */
+void HappyHerbsService::setMoistureThreshold(float threshold) {
+  this->setZoneMoistureThreshold(0, threshold);
+}
+
+/**
+ * Set the moisture threshold of a zone using the underlying state object and
+ * schedule a message to indicate state changes to AWS
+ *
+ * @param zone The zone's index
+ * @param threshold Desired moisture threshold
+ */
+void HappyHerbsService::setZoneMoistureThreshold(int zone, float threshold) {
+  this->hhState->setZoneMoistureThreshold(zone, threshold);
+  this->markShadowDirty(
+      zoneShadowField(zone, ZONE_SHADOW_FIELD_MOISTURE_THRESHOLD));
+}
+
+/**
+ * Set a sensor's deadband using the underlying state object and schedule a
+ * message to indicate state changes to AWS
+ *
+ * @param sensor The sensor's identifier
+ * @param deadband Desired deadband in the sensor's unit
+ */
+void HappyHerbsService::setSensorDeadband(HappyHerbsSensor sensor,
+                                          float deadband) {
+  this->hhState->setSensorDeadband(sensor, deadband);
+  this->markShadowDirty(deadbandShadowField(sensor));
+}
+
+/**
+ * Calls the underlying PubSubClient loop method, retransmits the shadow
+ * updates that have not been answered, then reports the shadow's changes once
+ * the flush window has passed
+ */
+void HappyHerbsService::loop() {
+  this->pubsub->loop();
+  this->retransmitShadowUpdates();
+  if (this->isShadowGetRequested) {
+    this->isShadowGetRequested = false;
+    if (!this->isShadowGetPending ||
+        millis() - this->tsShadowGet >= SHADOW_GET_TIMEOUT) {
+      this->publishShadowGet();
+    }
+  }
+  if (this->shadowDirtyFields != 0 &&
+      millis() - this->tsShadowDirty >= this->shadowFlushWindow) {
+    this->flushShadowUpdate();
+  }
+}
+
+/**
+ * Try to connect to AWS IoT. If a connection is successfully initiated, the
+ * system will subscribe to all the necessary MQTT topics, and the desired
+ * values carried by the updates that were in flight are sent again
+ *
+ * @return True if a connection is made
+ */
+bool HappyHerbsService::connect() {
+  HH_LOGI("Connecting to AWS IoT @%s", this->thingName.c_str());
+
+  // the TLS handshake can take seconds, so it is timed with esp_timer instead
+  // of the cycle counter
+  int64_t tsStart = esp_timer_get_time();
+  bool isConnected = this->pubsub->connect(this->thingName.c_str());
+  if (this->deviceMetrics) {
+    this->deviceMetrics->record(METRIC_MQTT_CONNECT,
+                                esp_timer_get_time() - tsStart);
+    if (!isConnected) {
+      this->deviceMetrics->increment(COUNTER_MQTT_CONNECT_FAILURES);
+    } else {
+      this->deviceMetrics->increment(this->hasConnected
+                                         ? COUNTER_MQTT_RECONNECTS
+                                         : COUNTER_MQTT_CONNECTS);
+    }
+  }
+  if (isConnected) {
+    this->hasConnected = true;
+    HH_LOGI("-- connected!");
+    // the responses to the updates sent over the previous connection are lost,
+    // so the changes that were sent as the desired state are sent again
+    ShadowFieldMask fields = this->shadowInflight.clear();
+    if (fields != 0) {
+      this->markShadowDirty(fields);
+    }
+    for (int i = 0; i < this->nTopicRoutes; i++) {
+      this->subscribe(this->topicRoutes[i].topic.c_str(),
+                      this->topicRoutes[i].qos);
+    }
+  } else {
+    HH_LOGW("-- failed with state %d!", this->pubsub->state());
+  }
+
+  return isConnected;
+}
+
+/**
+ * Check if the client is still connected
+ *
+ * @return True if a connection is still maintained
+ */
+bool HappyHerbsService::connected() { return this->pubsub->connected(); }
+
+/**
+ * Get the state of the MQTT client, this tells why the last connection attempt
+ * failed or why the connection was dropped
+ *
+ * @return One of PubSubClient's MQTT_* state codes
+ */
+int HappyHerbsService::getMqttState() { return this->pubsub->state(); }
+
+/**
+ * Get the number of milliseconds since boot until the first message was
+ * published
+ *
+ * @return Time to first publish, 0 if nothing has been published
+ */
+unsigned long HappyHerbsService::getTimeToFirstPublish() {
+  return this->tsFirstPublish;
+}
+
+/**
+ * Indicate that a message was published, the time of the first publish since
+ * boot and the time of the last activity are recorded
+ */
+void HappyHerbsService::recordPublish() {
+  this->tsLastActivity = millis();
+  if (this->tsFirstPublish == 0) {
+    this->tsFirstPublish = millis();
+    HH_LOGI("FIRST PUBLISH after %lums", this->tsFirstPublish);
+  }
+  if (this->statusLed) {
+    this->statusLed->blink(100, 100, 1);
+  }
+}
+
+/**
+ * Publish a given payload to the given topic, this is a proxy to the underlying
+ * MQTT client and provides logging for debug.
+ *
+ * NOTE: The payload size must not exceeds MQTT_MESSAGE_BUFFER_SIZE
+ *
+ * @param topic MQTT topic
+ * @param payload Data to be sent
+ * @return True if published successfully
+ */
+bool HappyHerbsService::publish(const char *topic, const char *payload) {
+  MetricTimer timer(this->deviceMetrics, METRIC_PUBLISH);
+  bool isSent = this->pubsub->publish(topic, payload);
+  if (!isSent && this->deviceMetrics) {
+    this->deviceMetrics->increment(COUNTER_PUBLISH_FAILURES);
+  }
+  if (isSent) {
+    HH_LOGD("SENT [%s] : %s", topic, payload);
+    this->recordPublish();
+  }
+  return isSent;
+}
+
+/**
+ * Serialize the JSON document and publish the serialized data to the given
+ * topic
+ *
+ * @param topic MQTT topic
+ * @param doc JSON document to be sent
+ * @return True if published successfully
+ */
+bool HappyHerbsService::publishJson(const char *topic,
+                                    const JsonDocument &doc) {
+  return this->publishDocument(topic, doc, PAYLOAD_ENCODING_JSON);
+}
+
+/**
+ * Serialize the document directly into the MQTT client using the given encoding
+ * and publish the serialized data to the given topic. The document is written
+ * out in chunks of MQTT_PUBLISH_CHUNK_SIZE bytes so it is never serialized into
+ * a full sized intermediate buffer
+ *
+ * @param topic MQTT topic
+ * @param doc Document to be sent
+ * @param encoding Encoding of the published data
+ * @return True if published successfully
+ */
+bool HappyHerbsService::publishDocument(const char *topic,
+                                        const JsonDocument &doc,
+                                        PayloadEncoding encoding) {
+  MetricTimer timer(this->deviceMetrics, METRIC_PUBLISH);
+  bool isMsgPack = encoding == PAYLOAD_ENCODING_MSGPACK;
+  size_t length = isMsgPack ? measureMsgPack(doc) : measureJson(doc);
+  if (!this->pubsub->beginPublish(topic, length, false)) {
+    if (this->deviceMetrics) {
+      this->deviceMetrics->increment(COUNTER_PUBLISH_FAILURES);
+    }
+    return false;
+  }
+  BufferedPrint<MQTT_PUBLISH_CHUNK_SIZE> pubsubWriter(*this->pubsub);
+  if (isMsgPack) {
+    serializeMsgPack(doc, pubsubWriter);
+  } else {
+    serializeJson(doc, pubsubWriter);
+  }
+  pubsubWriter.flush();
+
+  // endPublish() always reports success, so the message is only sent if every
+  // byte has reached the client while it is still connected
+  bool isSent = pubsubWriter.bytesWritten() == length &&
+                !pubsubWriter.getWriteError() && this->pubsub->connected();
+  this->pubsub->endPublish();
+  if (!isSent && this->deviceMetrics) {
+    this->deviceMetrics->increment(COUNTER_PUBLISH_FAILURES);
+  }
+  if (isSent) {
+    if (HH_LOG_ENABLED(DEBUG)) {
+      // the logged payload is always JSON and it is truncated to a line
+      char payload[LOG_LINE_SIZE];
+      serializeJson(doc, payload, sizeof(payload));
+      HH_LOGD("SENT [%s]%s : %s", topic, isMsgPack ? " (msgpack)" : "",
+              payload);
+    }
+    this->recordPublish();
+  }
+  return isSent;
+}
+
+/**
+ * Publish an empty message to "$aws/things/{thing_name}/shadow/get" to query
+ * the shadow.
+ */
+void HappyHerbsService::publishShadowGet() {
+  if (this->publish(this->topicShadowGet.c_str(), "")) {
+    this->isShadowGetPending = true;
+    this->tsShadowGet = millis();
+  }
 }
 
-float HappyHerbsState::readHumiditySensor() {
-  return this->tempHumidSensorDHT->readHumidity();
+/**
+ * Ask for the shadow to be queried by the next loop, so this can be called from
+ * the shadow's handlers. Nothing is sent if a query is already waiting for its
+ * response, a query that has not been answered within SHADOW_GET_TIMEOUT is
+ * sent again
+ */
+void HappyHerbsService::requestShadowGet() {
+  this->isShadowGetRequested = true;
 }
 
-void HappyHerbsState::setLightThreshold(float lightThreshold) {
-  this->lightThreshold = lightThreshold;
+/**
+ * Publish a message to the topic "$aws/things/{thing_name}/shadow/update" that
+ * contains the current values of the selected fields. The message carries a
+ * client token so its response from AWS can be told apart from the responses
+ * to other updates
+ *
+ * @param fields Bit flags of the selected fields
+ * @param hasDesired True if the fields are also sent as the desired state
+ * @param clientToken The message's client token
+ * @return True if published successfully
+ */
+bool HappyHerbsService::publishShadowFields(ShadowFieldMask fields,
+                                            bool hasDesired,
+                                            uint32_t clientToken) {
+  JsonDocumentLease shadowUpdateJson =
+      this->leaseJsonDocument(SHADOW_UPDATE_DOCUMENT_CAPACITY);
+  if (!shadowUpdateJson) {
+    return false;
+  }
+  char token[9];
+  snprintf(token, sizeof(token), "%08x", (unsigned int)clientToken);
+  JsonObject stateObj = shadowUpdateJson->createNestedObject("state");
+  JsonObject reportedObj = stateObj.createNestedObject("reported");
+  this->reportShadowFields(reportedObj, fields);
+  if (hasDesired) {
+    JsonObject desiredObj = stateObj.createNestedObject("desired");
+    this->reportShadowFields(desiredObj, fields);
+  }
+  (*shadowUpdateJson)["clientToken"] = token;
+  return this->publishJson(this->topicShadowUpdate.c_str(), *shadowUpdateJson);
 }
 
-void HappyHerbsState::setMoistureThreshold(float moistureThreshold) {
-  this->moistureThreshold = moistureThreshold;
+/**
+ * Publishes a message to the topic "$aws/things/{thing_name}/shadow/update" to
+ * announce the client current state. Every existing state will be included in
+ * the message. The update is only tracked if there is room in the window of
+ * updates in flight
+ */
+void HappyHerbsService::publishShadowUpdate() {
+  uint32_t clientToken = this->nextClientToken++;
+  if (this->publishShadowFields(SHADOW_FIELDS_ALL, false, clientToken) &&
+      !this->shadowInflight.add(clientToken, SHADOW_FIELDS_ALL, false)) {
+    HH_LOGD("UNTRACKED shadow update %08x", (unsigned int)clientToken);
+  }
 }
 
-float HappyHerbsState::getLightThreshold() { return this->lightThreshold; }
+/**
+ * Publishes a single message to the topic
+ * "$aws/things/{thing_name}/shadow/update" that contains every field that has
+ * been changed since the last flush, both as the reported and the desired
+ * state. Changes are kept if the client is not connected or if too many
+ * updates are waiting for a response
+ *
+ * @return True if the changes are published or there is no change
+ */
+bool HappyHerbsService::flushShadowUpdate() {
+  if (!this->connected() || this->shadowInflight.isFull()) {
+    return this->shadowDirtyFields == 0;
+  }
+  ShadowFieldMask fields = this->takeShadowDirty();
+  if (fields == 0) {
+    return true;
+  }
 
-float HappyHerbsState::getMoistureThreshold() {
-  return this->moistureThreshold;
+  uint32_t clientToken = this->nextClientToken++;
+  if (!this->publishShadowFields(fields, true, clientToken)) {
+    this->markShadowDirty(fields);
+    return false;
+  }
+  this->shadowInflight.add(clientToken, fields, true);
+  return true;
 }
 
 /**
- * Definition and usages of MQTT payload, and how to interact with the broker is
- * documented by AWS at
- * https://docs.aws.amazon.com/iot/latest/developerguide/iot-device-shadows.html
+ * Publish again the shadow updates that have not been answered in time, the
+ * current values of their fields are sent with a new client token. An update
+ * is dropped once it has been retransmitted SHADOW_MAX_RETRANSMITS times
  */
-HappyHerbsService::HappyHerbsService(HappyHerbsState &hhState,
-                                     PubSubClient &pubsub) {
-  this->hhState = &hhState;
-  this->pubsub = &pubsub;
+void HappyHerbsService::retransmitShadowUpdates() {
+  if (!this->connected()) {
+    return;
+  }
+  InflightUpdate *update;
+  while ((update = this->shadowInflight.nextExpired()) != nullptr) {
+    if (update->nRetransmits >= SHADOW_MAX_RETRANSMITS) {
+      HH_LOGE("DROPPED shadow update %08x",
+              (unsigned int)update->clientToken);
+      this->shadowInflight.acknowledge(update->clientToken);
+      continue;
+    }
+    uint32_t clientToken = this->nextClientToken++;
+    if (!this->publishShadowFields(update->fields, update->hasDesired,
+                                   clientToken)) {
+      return;
+    }
+    HH_LOGW("RETRANSMITTED shadow update %08x as %08x",
+            (unsigned int)update->clientToken, (unsigned int)clientToken);
+    update->clientToken = clientToken;
+    update->tsSent = millis();
+    update->nRetransmits++;
+    if (this->deviceMetrics) {
+      this->deviceMetrics->increment(COUNTER_SHADOW_RETRANSMITS);
+    }
+  }
 }
 
 /**
- * Set up a task that start the plant watering routine, the pump will be turn
- * on for `wateringDuration` milliseconds when this task starts and finishes.
- * The task is disabled by default
- *
- * NOTE: The task is owned by this class so it can be used in some internal MQTT
- * messages handlers
+ * Stop tracking the shadow update that a response from AWS answers
  *
- * @param scheduler The scheduler that will run this task
- * @param wateringDuration Number of milliseconds that the pump is turned on
+ * @param responseDoc The accepted or rejected document
+ * @return True if the response answers an update in flight
  */
-void HappyHerbsService::setupTaskPlantWatering(Scheduler &scheduler,
-                                               long wateringDuration) {
-  this->taskPlantWatering.setInterval(wateringDuration);
-  this->taskPlantWatering.setIterations(TASK_ONCE);
-  this->taskPlantWatering.setOnEnable([&]() {
-    Serial.println("START WATERING");
-    this->writePumpPinID(true);
-    return true;
-  });
-  this->taskPlantWatering.setOnDisable([&]() {
-    Serial.println("STOP WATERING");
-    this->writePumpPinID(false);
-  });
-
-  scheduler.addTask(this->taskPlantWatering);
+bool HappyHerbsService::acknowledgeShadowUpdate(
+    const JsonDocument &responseDoc, InflightUpdate *acknowledged) {
+  const char *token = responseDoc["clientToken"];
+  if (!token) {
+    return false;
+  }
+  return this->shadowInflight.acknowledge(strtoul(token, nullptr, 16),
+                                          acknowledged);
 }
 
 /**
- * Get the task that control the plant watering routine
+ * Keep the newest version of the shadow that has been seen in a response from
+ * AWS. Every update of the shadow increments its version and is echoed on the
+ * update's accepted topic, so skipping a version means that a message has been
+ * missed and the shadow is fetched to catch up
  *
- * @return The task for plant watering
+ * @param responseDoc A document that holds the shadow's version
+ * @return True if the document's version is newer than every version seen
  */
-Task &HappyHerbsService::getTaskPlantWatering() {
-  return this->taskPlantWatering;
+bool HappyHerbsService::trackShadowVersion(const JsonDocument &responseDoc) {
+  int version = responseDoc["version"] | 0;
+  if (version <= this->shadowVersion) {
+    return false;
+  }
+  if (this->shadowVersion > 0 && version > this->shadowVersion + 1) {
+    HH_LOGI("MISSED shadow versions %d to %d", this->shadowVersion + 1,
+            version - 1);
+    this->requestShadowGet();
+  }
+  this->shadowVersion = version;
+  return true;
 }
 
 /**
- * Set the name of this MCU designated by AWS, then setup of the MQTT topics
- * that are used to communicate with AWS
- *
- * @param thingName The assigned name
+ * Flush the pending changes of the shadow right away, telemetry publishes call
+ * this first so the shadow's changes always go out before telemetry
  */
-void HappyHerbsService::setThingName(String thingName) {
-  this->thingName = thingName;
-
-  String shadowPrefix = "$aws/things/" + thingName + "/shadow";
+void HappyHerbsService::yieldToShadow() {
+  if (this->shadowDirtyFields != 0) {
+    this->flushShadowUpdate();
+  }
+}
 
-  this->topicShadowGet = shadowPrefix + "/get";
-  this->topicShadowGetAccepted = this->topicShadowGet + "/accepted";
-  this->topicShadowGetRejected = this->topicShadowGet + "/rejected";
+/**
+ * Get the summary of a sensor in a record of measurements
+ *
+ * @param record The measurements
+ * @param sensor The sensor's identifier
+ * @return The sensor's summary
+ */
+static SensorSummary &recordSummary(SensorsRecord &record,
+                                    HappyHerbsSensor sensor) {
+  switch (sensor) {
+    case HH_SENSOR_LIGHT_BH1750:
+      return record.luxBH1750;
+    case HH_SENSOR_TEMPERATURE:
+      return record.temperature;
+    case HH_SENSOR_HUMIDITY:
+      return record.humidity;
+    default:
+      return record.moisture[sensor - HH_SENSOR_MOISTURE];
+  }
+}
 
-  this->topicShadowUpdate = shadowPrefix + "/update";
-  this->topicShadowUpdateAccepted = this->topicShadowUpdate + "/accepted";
-  this->topicShadowUpdateRejected = this->topicShadowUpdate + "/rejected";
-  this->topicShadowUpdateDelta = this->topicShadowUpdate + "/delta";
+static const SensorSummary &recordSummary(const SensorsRecord &record,
+                                          HappyHerbsSensor sensor) {
+  return recordSummary(const_cast<SensorsRecord &>(record), sensor);
 }
 
 /**
- * Set the lamp's state using the underlying state object and send a message to
- * indicate state changes to AWS
- *
- * @param state Desired lamp's state
+ * Publish the latest measurements of every sensor to AWS, the data will be
+ * stored inside a DynamoDB table with each corresponds with a table column. If
+ * the measurements could not be published, they are stored in the telemetry
+ * buffer to be sent once the connection is restored. The window of samples is
+ * only started over once the measurements are published or buffered
  */
-void HappyHerbsService::writeLampPinID(bool state) {
-  this->hhState->writeLampPinID(state);
-  StaticJsonDocument<256> shadowUpdateJson;
-  JsonObject stateObj = shadowUpdateJson.createNestedObject("state");
-  JsonObject reportedObj = stateObj.createNestedObject("reported");
-  reportedObj["lampState"] = state;
-  JsonObject desiredObj = stateObj.createNestedObject("desired");
-  desiredObj["lampState"] = state;
-  this->publishJson(this->topicShadowUpdate.c_str(), shadowUpdateJson);
+void HappyHerbsService::publishSensorsMeasurements() {
+  time_t now;
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo)) {
+    return;
+  }
+  time(&now);
+
+  SensorsRecord record;
+  record.timestamp = now;
+  bool isWindowed = this->sensorsAggregation == SENSORS_AGGREGATION_WINDOW;
+  if (isWindowed) {
+    time_t window = this->tsWindowStart > 0 ? now - this->tsWindowStart : 0;
+    record.window = window > UINT16_MAX ? UINT16_MAX : window;
+  } else {
+    record.window = 0;
+  }
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    HappyHerbsSensor sensor = (HappyHerbsSensor)i;
+    recordSummary(record, sensor) =
+        isWindowed ? this->sensorsWindow[i].summary()
+                   : RunningStats::single(this->hhState->peekSensor(sensor));
+  }
+
+  // the window keeps growing while nothing changes, so the next summary still
+  // covers every sample taken since the last publish
+  if (!this->shouldReportSensors(record, now)) {
+    HH_LOGD("SKIPPED measurements within deadbands");
+    return;
+  }
+
+  if (this->connected() && this->publishSensorsRecord(record)) {
+    this->recordSensorsReported(record);
+  } else if (this->telemetryBuffer && this->telemetryBuffer->push(record)) {
+    this->recordSensorsReported(record);
+    HH_LOGI("BUFFERED %d measurements", this->telemetryBuffer->size());
+  } else {
+    // the window keeps its samples, so they are in the next attempt's summary
+    HH_LOGW("KEPT measurements, could not publish or buffer them");
+    return;
+  }
+  if (isWindowed) {
+    for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+      this->sensorsWindow[i].reset();
+    }
+    this->tsWindowStart = now;
+  }
 }
 
 /**
- * Set the pump's state using the underlying state object and send a message to
- * indicate state changes to AWS
+ * Check if a sample of a summary has moved beyond the deadband from the last
+ * reported value, a sensor that starts or stops giving readings is a change
  *
- * @param state Desired pump's state
+ * @param summary The sensor's summary
+ * @param reported The sensor's last reported value
+ * @param deadband The smallest change that is reported
+ * @return True if the sensor's value has changed
  */
-void HappyHerbsService::writePumpPinID(bool state) {
-  this->hhState->writePumpPinID(state);
-  StaticJsonDocument<256> shadowUpdateJson;
-  JsonObject stateObj = shadowUpdateJson.createNestedObject("state");
-  JsonObject reportedObj = stateObj.createNestedObject("reported");
-  reportedObj["pumpState"] = state;
-  JsonObject desiredObj = stateObj.createNestedObject("desired");
-  desiredObj["pumpState"] = state;
-  this->publishJson(this->topicShadowUpdate.c_str(), shadowUpdateJson);
+static bool isBeyondDeadband(const SensorSummary &summary, float reported,
+                             float deadband) {
+  if (isnan(summary.mean) || isnan(reported)) {
+    return isnan(summary.mean) != isnan(reported);
+  }
+  return fabsf(summary.max - reported) >= deadband ||
+         fabsf(summary.min - reported) >= deadband;
 }
 
 /**
- * Set the light threshold using the underlying state object and send a message
- * to indicate state changes to AWS
+ * Check if a record of measurements has to be published, either because a
+ * value has moved beyond its deadband or the heartbeat has expired. The
+ * extremes of a window are compared so short excursions are never hidden
  *
- * @param threshold Desired light threshold
+ * @param record The measurements
+ * @param now The current time
+ * @return True if the record has to be published
  */
-void HappyHerbsService::setLightThreshold(float threshold) {
-  this->hhState->setLightThreshold(threshold);
-  StaticJsonDocument<256> shadowUpdateJson;
-  JsonObject stateObj = shadowUpdateJson.createNestedObject("state");
-  JsonObject reportedObj = stateObj.createNestedObject("reported");
-  reportedObj["lightThreshold"] = threshold;
-  JsonObject desiredObj = stateObj.createNestedObject("desired");
-  desiredObj["lightThreshold"] = threshold;
-  this->publishJson(this->topicShadowUpdate.c_str(), shadowUpdateJson);
+bool HappyHerbsService::shouldReportSensors(const SensorsRecord &record,
+                                            time_t now) {
+  if (this->tsSensorsReported == 0 ||
+      (unsigned long)(now - this->tsSensorsReported) >=
+          this->sensorsHeartbeat / 1000) {
+    return true;
+  }
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    HappyHerbsSensor sensor = (HappyHerbsSensor)i;
+    float deadband = this->hhState->getSensorDeadband(sensor);
+    if (isBeyondDeadband(recordSummary(record, sensor),
+                         this->reportedSensors[i], deadband)) {
+      return true;
+    }
+  }
+  return false;
 }
 
 /**
- * Set the moisture threshold using the underlying state object and send a
- * message to indicate state changes to AWS
+ * Keep the values of a record that has been published or buffered, the next
+ * measurements are compared against them
  *
- * @param threshold Desired moisture threshold
+ * @param record The measurements
  */
-void HappyHerbsService::setMoistureThreshold(float threshold) {
-  this->hhState->setMoistureThreshold(threshold);
-  StaticJsonDocument<256> shadowUpdateJson;
-  JsonObject stateObj = shadowUpdateJson.createNestedObject("state");
-  JsonObject reportedObj = stateObj.createNestedObject("reported");
-  reportedObj["moistureThreshold"] = threshold;
-  JsonObject desiredObj = stateObj.createNestedObject("desired");
-  desiredObj["moistureThreshold"] = threshold;
-  this->publishJson(this->topicShadowUpdate.c_str(), shadowUpdateJson);
+void HappyHerbsService::recordSensorsReported(const SensorsRecord &record) {
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    this->reportedSensors[i] = recordSummary(record, (HappyHerbsSensor)i).mean;
+  }
+  this->tsSensorsReported = record.timestamp;
 }
 
 /**
- * Calls the underlying PubSubClient loop method
+ * Add every new sample of the sensors to the current window, a sample is only
+ * added once even if the sensor's cache has not been refreshed since the last
+ * call. This only reads the sensors' cache
  */
-void HappyHerbsService::loop() { this->pubsub->loop(); }
+void HappyHerbsService::aggregateSensors() {
+  if (this->sensorsAggregation != SENSORS_AGGREGATION_WINDOW) {
+    return;
+  }
+  if (this->tsWindowStart == 0) {
+    time(&this->tsWindowStart);
+  }
+  for (int i = 0; i < HH_SENSOR_COUNT; i++) {
+    SensorSample sample = this->hhState->peekSample((HappyHerbsSensor)i);
+    if (!sample.isValid || sample.tsMillis == this->tsAggregated[i]) {
+      continue;
+    }
+    this->sensorsWindow[i].add(sample.value);
+    this->tsAggregated[i] = sample.tsMillis;
+  }
+}
 
 /**
- * Try to connect to AWS IoT. If a connection is successfully initiated, the
- * system will subscribe to all the necessary MQTT topics
+ * Add a sensor's summary to the given object
  *
- * @return True if a connection is made
+ * @param statsObj The object that holds the summaries of every sensor
+ * @param keys The keys of the payload's encoding
+ * @param sensorKey The sensor's key
+ * @param summary The sensor's summary
  */
-bool HappyHerbsService::connect() {
-  Serial.print("Connecting to AWS IoT @");
-  Serial.println(this->thingName);
-
-  bool isConnected = this->pubsub->connect(this->thingName.c_str());
-  if (isConnected) {
-    Serial.println("-- connected!");
-
-    this->subscribe(this->topicShadowUpdateAccepted.c_str(), 1);
-    this->subscribe(this->topicShadowUpdateRejected.c_str(), 1);
-    this->subscribe(this->topicShadowUpdateDelta.c_str(), 1);
-
-    this->subscribe(this->topicShadowGetAccepted.c_str(), 1);
-    this->subscribe(this->topicShadowGetRejected.c_str(), 1);
-  } else {
-    Serial.println("-- failed!");
-  }
-
-  return isConnected;
+static void setSensorSummary(JsonObject statsObj, const char *const *keys,
+                             TelemetryKey sensorKey,
+                             const SensorSummary &summary) {
+  JsonObject summaryObj = statsObj.createNestedObject(keys[sensorKey]);
+  summaryObj[keys[TELEMETRY_KEY_MIN]] = summary.min;
+  summaryObj[keys[TELEMETRY_KEY_MAX]] = summary.max;
+  summaryObj[keys[TELEMETRY_KEY_STDDEV]] = summary.stddev;
+  summaryObj[keys[TELEMETRY_KEY_N_SAMPLES]] = summary.count;
 }
 
 /**
- * Check if the client is still connected
+ * Get the object that holds the values of a zone other than zone 0, the object
+ * is created if it does not exist yet
  *
- * @return True if a connection is still maintained
+ * @param obj The object that holds the "zones" object
+ * @param keys The keys of the payload's encoding
+ * @param zone The zone's index
+ * @return The zone's object
  */
-bool HappyHerbsService::connected() { return this->pubsub->connected(); }
+static JsonObject getZoneObject(JsonObject obj, const char *const *keys,
+                                int zone) {
+  JsonObject zonesObj = obj[keys[TELEMETRY_KEY_ZONES]];
+  if (zonesObj.isNull()) {
+    zonesObj = obj.createNestedObject(keys[TELEMETRY_KEY_ZONES]);
+  }
+  char key[4];
+  snprintf(key, sizeof(key), "%d", zone);
+  return zonesObj.createNestedObject(key);
+}
 
 /**
- * Publish a given payload to the given topic, this is a proxy to the underlying
- * MQTT client and provides serial logging for debug.
- *
- * NOTE: The payload size must not exceeds MQTT_MESSAGE_BUFFER_SIZE
+ * Publish a record of sensors' measurements to AWS. Every sensor's value is the
+ * mean of the record's window, and the other statistics of the window are
+ * included if the record summarizes a window. The moisture of zone 0 is kept at
+ * the top level and the other zones are kept in the "zones" object
  *
- * @param topic MQTT topic
- * @param payload Data to be sent
+ * @param record The sensors' measurements
  * @return True if published successfully
  */
-bool HappyHerbsService::publish(const char *topic, const char *payload) {
-  bool isSent = this->pubsub->publish(topic, payload);
-  if (isSent) {
-    Serial.print("SENT [");
-    Serial.print(topic);
-    Serial.print("]");
-    Serial.print(" : ");
-    Serial.printf("%s\n\n", payload);
-    ledBlink(LED_BUILTIN, 100, 100, 1);
+bool HappyHerbsService::publishSensorsRecord(const SensorsRecord &record) {
+  this->yieldToShadow();
+  const char *const *keys = TELEMETRY_KEYS[this->sensorsMeasurementsEncoding];
+  JsonDocumentLease sensorsJson =
+      this->leaseJsonDocument(record.window > 0 ? SENSORS_SUMMARY_CAPACITY
+                                                : JSON_SMALL_DOCUMENT_CAPACITY);
+  if (!sensorsJson) {
+    return false;
   }
-  return isSent;
+  setTelemetryHeader(*sensorsJson, keys, record.timestamp, this->thingName);
+  (*sensorsJson)[keys[TELEMETRY_KEY_LUX_BH1750]] = record.luxBH1750.mean;
+  (*sensorsJson)[keys[TELEMETRY_KEY_MOISTURE]] = record.moisture[0].mean;
+  (*sensorsJson)[keys[TELEMETRY_KEY_TEMPERATURE]] = record.temperature.mean;
+  (*sensorsJson)[keys[TELEMETRY_KEY_HUMIDITY]] = record.humidity.mean;
+  if (record.window > 0) {
+    (*sensorsJson)[keys[TELEMETRY_KEY_WINDOW]] = record.window;
+    JsonObject statsObj =
+        sensorsJson->createNestedObject(keys[TELEMETRY_KEY_STATS]);
+    setSensorSummary(statsObj, keys, TELEMETRY_KEY_LUX_BH1750,
+                     record.luxBH1750);
+    setSensorSummary(statsObj, keys, TELEMETRY_KEY_MOISTURE,
+                     record.moisture[0]);
+    setSensorSummary(statsObj, keys, TELEMETRY_KEY_TEMPERATURE,
+                     record.temperature);
+    setSensorSummary(statsObj, keys, TELEMETRY_KEY_HUMIDITY, record.humidity);
+  }
+  for (int zone = 1; zone < HH_ZONE_COUNT; zone++) {
+    JsonObject zoneObj =
+        getZoneObject(sensorsJson->as<JsonObject>(), keys, zone);
+    zoneObj[keys[TELEMETRY_KEY_MOISTURE]] = record.moisture[zone].mean;
+    if (record.window > 0) {
+      setSensorSummary(zoneObj.createNestedObject(keys[TELEMETRY_KEY_STATS]),
+                       keys, TELEMETRY_KEY_MOISTURE, record.moisture[zone]);
+    }
+  }
+  return this->publishDocument(TOPIC_SENSORS_MEASUREMENTS.c_str(),
+                               *sensorsJson, this->sensorsMeasurementsEncoding);
 }
 
 /**
- * Serialize the JSON document and publish the serialized data to the given
- * topic
- *
- * NOTE: The payload size must not exceeds MQTT_MESSAGE_BUFFER_SIZE
+ * Publish at most `maxRecords` of the oldest measurements stored in the
+ * telemetry buffer, a record is only removed from the buffer after it has been
+ * published
  *
- * @param topic MQTT topic
- * @param doc JSON document to be sent
- * @return True if published successfully
+ * @param maxRecords Maximum number of records to be published
+ * @return Number of records that are published
  */
-void HappyHerbsService::publishJson(const char *topic,
-                                    const JsonDocument &doc) {
-  char buf[MQTT_MESSAGE_BUFFER_SIZE];
-  serializeJson(doc, buf);
-  this->publish(topic, buf);
+int HappyHerbsService::drainTelemetryBuffer(int maxRecords) {
+  if (!this->telemetryBuffer) {
+    return 0;
+  }
+
+  int nPublished = 0;
+  SensorsRecord record;
+  while (nPublished < maxRecords && this->connected() &&
+         this->telemetryBuffer->peek(record)) {
+    if (!this->publishSensorsRecord(record)) {
+      break;
+    }
+    this->telemetryBuffer->pop();
+    nPublished++;
+  }
+  return nPublished;
 }
 
 /**
- * Publish an empty message to "$aws/things/{thing_name}/shadow/get" to query
- * the shadow.
+ * Publish the latest measurements of every sensor along with the shadow's state
+ * to AWS, the data will be stored inside a DynamoDB table with each corresponds
+ * with a table column
  */
-void HappyHerbsService::publishShadowGet() {
-  this->publish(this->topicShadowGet.c_str(), "");
+void HappyHerbsService::publishStateSnapshot() {
+  time_t now;
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo)) {
+    return;
+  }
+  time(&now);
+  this->yieldToShadow();
+
+  const char *const *keys = TELEMETRY_KEYS[this->stateSnapshotEncoding];
+  JsonDocumentLease stateJson =
+      this->leaseJsonDocument(STATE_SNAPSHOT_CAPACITY);
+  if (!stateJson) {
+    return;
+  }
+  setTelemetryHeader(*stateJson, keys, now, this->thingName);
+  JsonObject sensorsObj =
+      stateJson->createNestedObject(keys[TELEMETRY_KEY_SENSORS]);
+  sensorsObj[keys[TELEMETRY_KEY_LUX_BH1750]] =
+      this->hhState->peekSensor(HH_SENSOR_LIGHT_BH1750);
+  sensorsObj[keys[TELEMETRY_KEY_MOISTURE]] =
+      this->hhState->peekSensor(HH_SENSOR_MOISTURE);
+  sensorsObj[keys[TELEMETRY_KEY_TEMPERATURE]] =
+      this->hhState->peekSensor(HH_SENSOR_TEMPERATURE);
+  sensorsObj[keys[TELEMETRY_KEY_HUMIDITY]] =
+      this->hhState->peekSensor(HH_SENSOR_HUMIDITY);
+  JsonObject shadowObj =
+      stateJson->createNestedObject(keys[TELEMETRY_KEY_SHADOW]);
+  shadowObj[keys[TELEMETRY_KEY_LAMP_STATE]] = this->hhState->readLampPinID();
+  shadowObj[keys[TELEMETRY_KEY_PUMP_STATE]] = this->hhState->readPumpPinID();
+  shadowObj[keys[TELEMETRY_KEY_LIGHT_THRESHOLD]] =
+      this->hhState->getLightThreshold();
+  shadowObj[keys[TELEMETRY_KEY_MOISTURE_THRESHOLD]] =
+      this->hhState->getMoistureThreshold();
+  for (int zone = 1; zone < HH_ZONE_COUNT; zone++) {
+    getZoneObject(sensorsObj, keys, zone)[keys[TELEMETRY_KEY_MOISTURE]] =
+        this->hhState->peekSensor(zoneMoistureSensor(zone));
+    JsonObject zoneObj = getZoneObject(shadowObj, keys, zone);
+    zoneObj[keys[TELEMETRY_KEY_PUMP_STATE]] =
+        this->hhState->readZonePumpPinID(zone);
+    zoneObj[keys[TELEMETRY_KEY_MOISTURE_THRESHOLD]] =
+        this->hhState->getZoneMoistureThreshold(zone);
+  }
+  this->publishDocument(TOPIC_STATE_SNAPSHOT.c_str(), *stateJson,
+                        this->stateSnapshotEncoding);
 }
 
 /**
- * Publishes a message to the topic "$aws/things/{thing_name}/shadow/update" to
- * announce the client current state. Every existing state will be included in
- * the message
+ * Write the high-water marks of a pool of JSON documents into the given object
+ *
+ * @param poolObj The object that receives the statistics
+ * @param stats The pool's statistics
  */
-void HappyHerbsService::publishShadowUpdate() {
-  StaticJsonDocument<512> shadowUpdateJson;
-  JsonObject stateObj = shadowUpdateJson.createNestedObject("state");
-  JsonObject reportedObj = stateObj.createNestedObject("reported");
-  reportedObj["lampState"] = this->hhState->readLampPinID();
-  reportedObj["pumpState"] = this->hhState->readPumpPinID();
-  reportedObj["lightThreshold"] = this->hhState->getLightThreshold();
-  reportedObj["moistureThreshold"] = this->hhState->getMoistureThreshold();
-  this->publishJson(this->topicShadowUpdate.c_str(), shadowUpdateJson);
+static void reportJsonPoolStats(JsonObject poolObj,
+                                const JsonPoolStats &stats) {
+  poolObj["maxLeased"] = stats.maxLeased;
+  poolObj["maxMemoryUsage"] = stats.maxMemoryUsage;
 }
 
 /**
- * Take measurements for every sensor and publish them to AWS, the data will be
- * stored inside a DynamoDB table with each corresponds with a table column
+ * Publish the aggregated device metrics to the device metrics topic, the
+ * latency histograms are reset after being published
  */
-void HappyHerbsService::publishSensorsMeasurements() {
+void HappyHerbsService::publishDeviceMetrics() {
+  if (!this->deviceMetrics) {
+    return;
+  }
   time_t now;
   struct tm timeinfo;
   if (!getLocalTime(&timeinfo)) {
     return;
   }
   time(&now);
+  this->yieldToShadow();
+
+  JsonDocumentLease metricsJson =
+      this->leaseJsonDocument(JSON_LARGE_DOCUMENT_CAPACITY);
+  if (!metricsJson) {
+    return;
+  }
+  setTelemetryHeader(*metricsJson, TELEMETRY_KEYS[PAYLOAD_ENCODING_JSON], now,
+                     this->thingName);
+  (*metricsJson)["uptime"] = millis();
+  this->deviceMetrics->report(metricsJson->as<JsonObject>());
 
-  StaticJsonDocument<512> sensorsJson;
-  sensorsJson["timestamp"] = now;
-  sensorsJson["thingsName"] = this->thingName;
-  sensorsJson["luxBH1750"] = this->hhState->readLightSensorBH1750();
-  sensorsJson["moisture"] = this->hhState->readMoistureSensor();
-  sensorsJson["temperature"] = this->hhState->readTemperatureSensor();
-  sensorsJson["humidity"] = this->hhState->readHumiditySensor();
-  this->publishJson(TOPIC_SENSORS_MEASUREMENTS.c_str(), sensorsJson);
+  JsonObject poolsObj = metricsJson->createNestedObject("jsonPools");
+  reportJsonPoolStats(poolsObj.createNestedObject("small"),
+                      this->smallJsonDocs.stats());
+  reportJsonPoolStats(poolsObj.createNestedObject("large"),
+                      this->largeJsonDocs.stats());
+  this->publishJson(TOPIC_DEVICE_METRICS.c_str(), *metricsJson);
 }
 
 /**
- * Take measurements for every sensor and publish them to AWS, the data will be
- * stored inside a DynamoDB table with each corresponds with a table column
+ * Publish one message of the bench's load to the bench load topic, the
+ * messages are numbered so their loss can be measured by the subscriber
  */
-void HappyHerbsService::publishStateSnapshot() {
+void HappyHerbsService::publishBenchLoad() {
+  if (!this->soakBench) {
+    return;
+  }
+  time_t now;
+  time(&now);
+  this->yieldToShadow();
+
+  JsonDocumentLease loadJson =
+      this->leaseJsonDocument(JSON_SMALL_DOCUMENT_CAPACITY);
+  if (!loadJson) {
+    this->soakBench->recordLoadPublish(false, 0);
+    return;
+  }
+  setTelemetryHeader(*loadJson, TELEMETRY_KEYS[PAYLOAD_ENCODING_JSON], now,
+                     this->thingName);
+  (*loadJson)["seq"] = this->nBenchLoadMessages++;
+  (*loadJson)["rate"] = 1000 / this->soakBench->loadInterval();
+  bool isSent = this->publishJson(TOPIC_BENCH_LOAD.c_str(), *loadJson);
+  this->soakBench->recordLoadPublish(isSent, measureJson(*loadJson));
+}
+
+/**
+ * Publish the latencies of the commands, the throughput of the load, and the
+ * heap's fragmentation to the bench report topic, the latencies are reset after
+ * being published
+ */
+void HappyHerbsService::publishBenchReport() {
+  if (!this->soakBench) {
+    return;
+  }
   time_t now;
   struct tm timeinfo;
   if (!getLocalTime(&timeinfo)) {
     return;
   }
   time(&now);
+  this->yieldToShadow();
 
-  StaticJsonDocument<512> stateJson;
-  stateJson["timestamp"] = now;
-  stateJson["thingsName"] = this->thingName;
-  JsonObject sensorsObj = stateJson.createNestedObject("sensors");
-  sensorsObj["luxBH1750"] = this->hhState->readLightSensorBH1750();
-  sensorsObj["moisture"] = this->hhState->readMoistureSensor();
-  sensorsObj["temperature"] = this->hhState->readTemperatureSensor();
-  sensorsObj["humidity"] = this->hhState->readHumiditySensor();
-  JsonObject shadowObj = stateJson.createNestedObject("shadow");
-  shadowObj["lampState"] = this->hhState->readLampPinID();
-  shadowObj["pumpState"] = this->hhState->readPumpPinID();
-  shadowObj["lightThreshold"] = this->hhState->getLightThreshold();
-  shadowObj["moistureThreshold"] = this->hhState->getMoistureThreshold();
-  this->publishJson(TOPIC_STATE_SNAPSHOT.c_str(), stateJson);
+  JsonDocumentLease benchJson =
+      this->leaseJsonDocument(JSON_LARGE_DOCUMENT_CAPACITY);
+  if (!benchJson) {
+    return;
+  }
+  setTelemetryHeader(*benchJson, TELEMETRY_KEYS[PAYLOAD_ENCODING_JSON], now,
+                     this->thingName);
+  (*benchJson)["uptime"] = millis();
+  this->soakBench->report(benchJson->as<JsonObject>());
+  this->publishJson(TOPIC_BENCH_REPORT.c_str(), *benchJson);
 }
 
 /**
  * Subscribe to the given topic with the specified QoS, this is a proxy to the
- * underlying MQTT client and provides serial logging for debug.
+ * underlying MQTT client and provides logging for debug.
  *
  * @param topic MQTT topic
  * @param qos Quality of service, AWS only support level 0 and level 1
@@ -381,15 +2106,42 @@ void HappyHerbsService::publishStateSnapshot() {
 bool HappyHerbsService::subscribe(const char *topic, unsigned int qos) {
   bool isSubscribed = this->pubsub->subscribe(topic, qos);
   if (isSubscribed) {
-    Serial.print("SUBSCRIBED ");
-    Serial.println(topic);
+    HH_LOGI("SUBSCRIBED %s", topic);
   }
   return isSubscribed;
 }
 
+/**
+ * Add a handler to the topic dispatch table, the topic is subscribed upon every
+ * connection, or right away if the client is already connected
+ *
+ * NOTE: At most MAX_TOPIC_ROUTES handlers can be registered
+ *
+ * @param topic MQTT topic
+ * @param handler Function that processes the messages of the topic
+ * @param qos Quality of service, AWS only support level 0 and level 1
+ * @return True if the handler is registered
+ */
+bool HappyHerbsService::registerTopicHandler(const String &topic,
+                                             TopicHandler handler,
+                                             unsigned int qos) {
+  if (this->nTopicRoutes >= MAX_TOPIC_ROUTES) {
+    return false;
+  }
+  TopicRoute &route = this->topicRoutes[this->nTopicRoutes++];
+  route.topic = topic;
+  route.hash = hashTopic(topic.c_str());
+  route.qos = qos;
+  route.handler = handler;
+  if (this->connected()) {
+    this->subscribe(route.topic.c_str(), route.qos);
+  }
+  return true;
+}
+
 /**
  * Receives messages from all topics; this method acts as a controller that
- * routes messages to other handlers that can process the message
+ * routes messages to the handler registered for the topic
  *
  * @param topic The topic on which the payload is published
  * @param payload The published data
@@ -397,34 +2149,24 @@ bool HappyHerbsService::subscribe(const char *topic, unsigned int qos) {
  */
 void HappyHerbsService::handleCallback(const char *topic, byte *payload,
                                        unsigned int length) {
-  Serial.print("RECV [");
-  Serial.print(topic);
-  Serial.print("]");
-  Serial.print(" : ");
-  Serial.printf("%s\n\n", payload);
-  ledBlink(LED_BUILTIN, 100, 100, 1);
-
-  StaticJsonDocument<MQTT_MESSAGE_BUFFER_SIZE> jsonDoc;
-
-  if (strcmp(topic, this->topicShadowGetAccepted.c_str()) == 0) {
-    deserializeJson(jsonDoc, payload, length);
-    this->handleShadowGetAccepted(jsonDoc);
+  MetricTimer timer(this->deviceMetrics, METRIC_HANDLE_CALLBACK);
+  this->tsLastActivity = millis();
+  if (this->soakBench) {
+    this->tsMessageReceived = esp_timer_get_time();
   }
-  if (strcmp(topic, this->topicShadowGetRejected.c_str()) == 0) {
-    deserializeJson(jsonDoc, payload, length);
-    this->handleShadowGetRejected(jsonDoc);
+  // the payload is not null-terminated
+  HH_LOGD("RECV [%s] : %.*s", topic, (int)length, (const char *)payload);
+  if (this->statusLed) {
+    this->statusLed->blink(100, 100, 1);
   }
-  if (strcmp(topic, this->topicShadowUpdateAccepted.c_str()) == 0) {
-    deserializeJson(jsonDoc, payload, length);
-    this->handleShadowUpdateAccepted(jsonDoc);
-  }
-  if (strcmp(topic, this->topicShadowUpdateRejected.c_str()) == 0) {
-    deserializeJson(jsonDoc, payload, length);
-    this->handleShadowUpdateRejected(jsonDoc);
-  }
-  if (strcmp(topic, this->topicShadowUpdateDelta.c_str()) == 0) {
-    deserializeJson(jsonDoc, payload, length);
-    this->handleShadowUpdateDelta(jsonDoc);
+
+  uint32_t hash = hashTopic(topic);
+  for (int i = 0; i < this->nTopicRoutes; i++) {
+    TopicRoute &route = this->topicRoutes[i];
+    if (route.hash == hash && strcmp(topic, route.topic.c_str()) == 0) {
+      route.handler(topic, payload, length);
+      return;
+    }
   }
 };
 
@@ -441,49 +2183,18 @@ void HappyHerbsService::handleShadowGetAccepted(
     return;
   }
   this->tsShadowGetResponse = ts;
+  // the fetched shadow is the latest one, so its version is taken even if it
+  // is older, which happens when the shadow was deleted and created again
+  this->isShadowGetPending = false;
+  this->shadowVersion = acceptedDoc["version"] | this->shadowVersion;
 
-  if (!acceptedDoc["state"].containsKey("delta")) {
+  JsonObjectConst delta = acceptedDoc["state"]["delta"].as<JsonObjectConst>();
+  if (delta.isNull()) {
     return;
   }
-
-  if (acceptedDoc["state"]["delta"].containsKey("lampState")) {
-    int tsLampState =
-        acceptedDoc["metadata"]["delta"]["lampState"]["timestamp"];
-    if (tsLampState > this->tsLampState) {
-      bool lampState = acceptedDoc["state"]["delta"]["lampState"];
-      this->writeLampPinID(lampState);
-      this->tsLampState = tsLampState;
-    }
-  }
-  if (acceptedDoc["state"]["delta"].containsKey("pumpState")) {
-    int tsPumpState =
-        acceptedDoc["metadata"]["delta"]["pumpState"]["timestamp"];
-    if (tsPumpState > this->tsPumpState) {
-      bool pumpState = acceptedDoc["state"]["delta"]["pumpState"];
-      this->writePumpPinID(pumpState);
-      this->tsPumpState = tsPumpState;
-    }
-  }
-  if (acceptedDoc["state"]["delta"].containsKey("lightThreshold")) {
-    int tsLightThreshold =
-        acceptedDoc["metadata"]["delta"]["lightThreshold"]["timestamp"];
-    if (tsLightThreshold > this->tsLightThreshold) {
-      float lightThreshold = acceptedDoc["state"]["delta"]["lightThreshold"];
-      this->setLightThreshold(lightThreshold);
-      this->tsLightThreshold = tsLightThreshold;
-    }
-  }
-
-  if (acceptedDoc["state"].containsKey("moistureThreshold")) {
-    int tsMoistureThreshold =
-        acceptedDoc["metadata"]["delta"]["moistureThreshold"]["timestamp"];
-    if (tsMoistureThreshold > this->tsMoistureThreshold) {
-      float moistureThreshold =
-          acceptedDoc["state"]["delta"]["moistureThreshold"];
-      this->setMoistureThreshold(moistureThreshold);
-      this->tsMoistureThreshold = tsMoistureThreshold;
-    }
-  }
+  // the timestamps of the delta's fields are the ones of the desired state
+  this->applyShadowDelta(
+      delta, acceptedDoc["metadata"]["desired"].as<JsonObjectConst>());
 }
 
 /**
@@ -498,76 +2209,66 @@ void HappyHerbsService::handleShadowGetRejected(const JsonDocument &errorDoc) {
     return;
   }
   this->tsShadowGetResponse = ts;
+  this->isShadowGetPending = false;
 
   int errCode = errorDoc["code"];
-  String errMsg = errorDoc["message"];
+  HH_LOGW("ERR%d : %s", errCode, errorDoc["message"] | "");
   if (errCode == 500) {
-    this->publishShadowGet();
+    this->requestShadowGet();
   }
-  Serial.printf("ERR%d : %s", errCode, errMsg);
 }
 
 /**
- * Handle shadow update accepted document. Check if the returned "reported
- * state" matches with the system, if not, resend an update message
+ * Handle shadow update accepted document. Only the responses to the updates
+ * sent by this device are reconciled, the echoes of the other clients' updates
+ * and the responses that have been overtaken by a newer version of the shadow
+ * are ignored. The fields whose accepted value is no longer the current one are
+ * reported again with the next update
  *
  * @param accepted The accepted update document
  */
 void HappyHerbsService::handleShadowUpdateAccepted(
     const JsonDocument &acceptedDoc) {
-  int ts = acceptedDoc["timestamp"];
-  if (ts < this->tsShadowUpdateResponse) {
-    return;
+  InflightUpdate update;
+  bool isOwnUpdate = this->acknowledgeShadowUpdate(acceptedDoc, &update);
+  bool isNewest = this->trackShadowVersion(acceptedDoc);
+  if (isOwnUpdate && this->soakBench) {
+    this->soakBench->recordAccepted(update.fields, update.tsSent);
   }
-  this->tsShadowUpdateResponse = ts;
-
-  bool isMismatched = false;
-  if (!acceptedDoc["state"].containsKey("reported")) {
+  if (!isOwnUpdate || !isNewest) {
     return;
   }
-  if (acceptedDoc["state"]["reported"].containsKey("lampState")) {
-    bool lampState = acceptedDoc["state"]["reported"]["lampState"];
-    isMismatched = lampState != this->hhState->readLampPinID();
-  }
-  if (acceptedDoc["state"]["reported"].containsKey("lampState")) {
-    bool pumpState = acceptedDoc["state"]["reported"]["pumpState"];
-    isMismatched = pumpState != this->hhState->readPumpPinID();
-  }
-  if (acceptedDoc["state"]["reported"].containsKey("lampState")) {
-    float lightThreshold = acceptedDoc["state"]["reported"]["lightThreshold"];
-    isMismatched = lightThreshold != this->hhState->getLightThreshold();
-  }
-  if (acceptedDoc["state"]["reported"].containsKey("lampState")) {
-    float moistureThreshold =
-        acceptedDoc["state"]["reported"]["moistureThreshold"];
-    isMismatched = moistureThreshold != this->hhState->getMoistureThreshold();
-  }
 
-  if (isMismatched) {
-    this->publishShadowUpdate();
+  ShadowFieldMask mismatched = this->findMismatchedFields(
+      acceptedDoc["state"]["reported"].as<JsonObjectConst>(), update.fields);
+  if (mismatched != 0) {
+    this->markShadowDirty(mismatched);
   }
 }
 
 /**
- * Handle shadow update rejected document. Resend a get message if receive error
- * code 500
+ * Handle shadow update rejected document. Only the rejections of the updates
+ * sent by this device are handled, an update that is rejected with error code
+ * 500 is sent again
  *
  * @param errorDoc Error document
  */
 void HappyHerbsService::handleShadowUpdateRejected(
     const JsonDocument &errorDoc) {
-  int ts = errorDoc["timestamp"];
-  if (ts < this->tsShadowUpdateResponse) {
+  InflightUpdate update;
+  if (!this->acknowledgeShadowUpdate(errorDoc, &update)) {
     return;
   }
-  this->tsShadowUpdateResponse = ts;
 
   int errCode = errorDoc["code"];
-  String errMsg = errorDoc["message"];
+  HH_LOGW("ERR%d : %s", errCode, errorDoc["message"] | "");
   if (errCode == 500) {
-    this->publishShadowUpdate();
+    if (update.hasDesired) {
+      this->markShadowDirty(update.fields);
+    } else {
+      this->publishShadowUpdate();
+    }
   }
-  Serial.printf("ERR%d : %s", errCode, errMsg);
 }
 
 /**
@@ -582,45 +2283,11 @@ void HappyHerbsService::handleShadowUpdateDelta(const JsonDocument &deltaDoc) {
     return;
   }
   this->tsShadowUpdateDelta = ts;
-
-  if (deltaDoc["state"].containsKey("lampState")) {
-    int tsLampState = deltaDoc["metadata"]["lampState"]["timestamp"];
-    if (tsLampState > this->tsLampState) {
-      bool lampState = deltaDoc["state"]["lampState"];
-      this->writeLampPinID(lampState);
-      this->tsLampState = tsLampState;
-    }
-  }
-
-  if (deltaDoc["state"].containsKey("pumpState")) {
-    int tsPumpState = deltaDoc["metadata"]["pumpState"]["timestamp"];
-    if (tsPumpState > this->tsPumpState) {
-      bool pumpState = deltaDoc["state"]["pumpState"];
-      if (pumpState) {
-        this->taskPlantWatering.restartDelayed();
-      } else {
-        this->writePumpPinID(false);
-      }
-      this->tsPumpState = tsPumpState;
-    }
-  }
-
-  if (deltaDoc["state"].containsKey("lightThreshold")) {
-    int tsLightThreshold = deltaDoc["metadata"]["lightThreshold"]["timestamp"];
-    if (tsLightThreshold > this->tsLightThreshold) {
-      float lightThreshold = deltaDoc["state"]["lightThreshold"];
-      this->setLightThreshold(lightThreshold);
-      this->tsLightThreshold = tsLightThreshold;
-    }
+  this->trackShadowVersion(deltaDoc);
+  if (this->soakBench) {
+    this->soakBench->recordDeltaArrival(this->tsMessageReceived);
   }
 
-  if (deltaDoc["state"].containsKey("moistureThreshold")) {
-    int tsMoistureThreshold =
-        deltaDoc["metadata"]["moistureThreshold"]["timestamp"];
-    if (tsMoistureThreshold > this->tsMoistureThreshold) {
-      float moistureThreshold = deltaDoc["state"]["moistureThreshold"];
-      this->setMoistureThreshold(moistureThreshold);
-      this->tsMoistureThreshold = tsMoistureThreshold;
-    }
-  }
-}
\ No newline at end of file
+  this->applyShadowDelta(deltaDoc["state"].as<JsonObjectConst>(),
+                         deltaDoc["metadata"].as<JsonObjectConst>());
+}
@@ -0,0 +1,98 @@
+#include "inflight_window.h"
+
+InflightWindow::InflightWindow(unsigned long timeout) {
+  this->timeout = timeout;
+}
+
+bool InflightWindow::isFull() {
+  return this->nUpdates == SHADOW_INFLIGHT_WINDOW;
+}
+
+bool InflightWindow::isEmpty() { return this->nUpdates == 0; }
+
+/**
+ * Track a shadow update that has just been published
+ *
+ * @param clientToken The update's client token
+ * @param fields Bit flags of the fields included in the update
+ * @param hasDesired True if the fields are also included as the desired state
+ * @return True if the update is tracked, false if the window is full
+ */
+bool InflightWindow::add(uint32_t clientToken, uint32_t fields,
+                         bool hasDesired) {
+  for (int i = 0; i < SHADOW_INFLIGHT_WINDOW; i++) {
+    InflightUpdate &update = this->updates[i];
+    if (update.isUsed) {
+      continue;
+    }
+    update.clientToken = clientToken;
+    update.fields = fields;
+    update.hasDesired = hasDesired;
+    update.tsSent = millis();
+    update.nRetransmits = 0;
+    update.isUsed = true;
+    this->nUpdates++;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Stop tracking the update that has been answered by AWS
+ *
+ * @param clientToken The client token of the response
+ * @param acknowledged Receives the answered update, may be null
+ * @return True if the token belongs to a tracked update
+ */
+bool InflightWindow::acknowledge(uint32_t clientToken,
+                                 InflightUpdate *acknowledged) {
+  for (int i = 0; i < SHADOW_INFLIGHT_WINDOW; i++) {
+    InflightUpdate &update = this->updates[i];
+    if (!update.isUsed || update.clientToken != clientToken) {
+      continue;
+    }
+    if (acknowledged) {
+      *acknowledged = update;
+    }
+    update.isUsed = false;
+    this->nUpdates--;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Find an update that has not been answered before the timeout, the caller
+ * retransmits it and gives it a new client token and send time
+ *
+ * @return The expired update, or null if there is none
+ */
+InflightUpdate *InflightWindow::nextExpired() {
+  unsigned long now = millis();
+  for (int i = 0; i < SHADOW_INFLIGHT_WINDOW; i++) {
+    InflightUpdate &update = this->updates[i];
+    if (update.isUsed && now - update.tsSent >= this->timeout) {
+      return &update;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Stop tracking every update, this is used when the connection is lost since
+ * no response will arrive anymore
+ *
+ * @return Bit flags of the fields that were sent as the desired state
+ */
+uint32_t InflightWindow::clear() {
+  uint32_t desiredFields = 0;
+  for (int i = 0; i < SHADOW_INFLIGHT_WINDOW; i++) {
+    InflightUpdate &update = this->updates[i];
+    if (update.isUsed && update.hasDesired) {
+      desiredFields |= update.fields;
+    }
+    update.isUsed = false;
+  }
+  this->nUpdates = 0;
+  return desiredFields;
+}
@@ -26,6 +26,32 @@ char* loadStream(Stream& stream, int n) {
   return dest;
 }
 
+/**
+ * Read n bytes from the stream into a buffer, one chunk at a time, so that
+ * large files can be processed with a small fixed amount of memory. Reading
+ * stops early if the stream times out or if the handler returns false
+ *
+ * @param stream The input stream
+ * @param n Number of bytes to be read
+ * @param buf The buffer that holds one chunk
+ * @param bufSize Size of the buffer in bytes
+ * @param handler Called with every chunk, returns false to stop reading
+ * @return Number of bytes that were read and handled
+ */
+size_t loadStream(Stream& stream, size_t n, uint8_t* buf, size_t bufSize,
+                  const ChunkHandler& handler) {
+  size_t nRead = 0;
+  while (nRead < n) {
+    size_t chunkSize = min(bufSize, n - nRead);
+    size_t len = stream.readBytes(buf, chunkSize);
+    if (len == 0 || !handler(buf, len)) {
+      break;
+    }
+    nRead += len;
+  }
+  return nRead;
+}
+
 /**
  * Open a file and load the entire file as bytes array into memory. Then return
  * the pointer to the first byte.
@@ -47,21 +73,24 @@ char* loadFile(const char* path) {
 }
 
 /**
- * Cycle the state of the given pin `n` times through HIGH for
- * `onDuration` * milliseconds and LOW for `offDuration` milliseconds
+ * Open a file and pass its content to the handler in chunks that fit the given
+ * buffer.
  *
- * @param pin The pin id
- * @param onDuration Number of milliseconds that the pin is put on HIGH
- * @param offDuration Number of milliseconds that the pin is put on LOW
- * @param n Number of cycles
+ * @param path The path of the file
+ * @param buf The buffer that holds one chunk
+ * @param bufSize Size of the buffer in bytes
+ * @param handler Called with every chunk, returns false to stop reading
+ * @return True if the entire file was read and handled, false otherwise
  */
-void ledBlink(int pin, int onDuration, int offDuration, int n) {
-  while (n--) {
-    digitalWrite(pin, HIGH);
-    delay(onDuration);
-    digitalWrite(pin, LOW);
-    if (n - 1 != 0) {
-      delay(offDuration);
-    }
+bool loadFile(const char* path, uint8_t* buf, size_t bufSize,
+              const ChunkHandler& handler) {
+  File f = SPIFFS.open(path);
+  if (!f) {
+    return false;
   }
-}
\ No newline at end of file
+
+  size_t size = f.size();
+  bool isLoaded = loadStream(f, size, buf, bufSize, handler) == size;
+  f.close();
+  return isLoaded;
+}
@@ -0,0 +1,101 @@
+#include "logging.h"
+
+#include <stdarg.h>
+
+#include "constants.h"
+
+#ifdef __HAPPY_HERBS_ASYNC_LOG
+#include <freertos/FreeRTOS.h>
+#include <freertos/ringbuf.h>
+#include <freertos/task.h>
+
+static RingbufHandle_t logRingBuffer = nullptr;
+static volatile uint32_t nDroppedLines = 0;
+
+/**
+ * Write the queued messages to Serial, this runs on its own task so that the
+ * callers never wait for the UART
+ */
+static void logTask(void *) {
+  for (;;) {
+    size_t size = 0;
+    void *data = xRingbufferReceiveUpTo(logRingBuffer, &size, portMAX_DELAY,
+                                        LOG_LINE_SIZE);
+    if (data) {
+      Serial.write((const uint8_t *)data, size);
+      vRingbufferReturnItem(logRingBuffer, data);
+    }
+    if (nDroppedLines > 0) {
+      Serial.printf("... %u log lines dropped\n", nDroppedLines);
+      nDroppedLines = 0;
+    }
+  }
+}
+#endif
+
+/**
+ * Start the logger's task and its ring buffer if the asynchronous logger is
+ * used. Until the logger is started, messages are written directly to Serial
+ *
+ * @return True if the logger was started
+ */
+bool logBegin() {
+#ifdef __HAPPY_HERBS_ASYNC_LOG
+  logRingBuffer = xRingbufferCreate(LOG_RING_BUFFER_SIZE, RINGBUF_TYPE_BYTEBUF);
+  if (!logRingBuffer) {
+    return false;
+  }
+  return xTaskCreate(logTask, "log", LOG_TASK_STACK_SIZE, NULL,
+                     LOG_TASK_PRIORITY, NULL) == pdPASS;
+#else
+  return true;
+#endif
+}
+
+/**
+ * Write a line that is prefixed with the level and the time since boot. With
+ * the asynchronous logger, the line is dropped instead of blocking the caller
+ * if the ring buffer is full
+ *
+ * @param level The level's letter
+ * @param fmt The printf format of the message
+ */
+void logPrintf(char level, const char *fmt, ...) {
+  char line[LOG_LINE_SIZE];
+  int len = snprintf(line, sizeof(line), "[%c %lu] ", level, millis());
+  va_list args;
+  va_start(args, fmt);
+  len += vsnprintf(line + len, sizeof(line) - len, fmt, args);
+  va_end(args);
+  // keep room for the line break if the message was truncated
+  if (len > (int)sizeof(line) - 2) {
+    len = sizeof(line) - 2;
+  }
+  line[len++] = '\n';
+  line[len] = '\0';
+
+#ifdef __HAPPY_HERBS_ASYNC_LOG
+  if (logRingBuffer) {
+    if (xRingbufferSend(logRingBuffer, line, len, 0) != pdTRUE) {
+      nDroppedLines++;
+    }
+    return;
+  }
+#endif
+  Serial.write((const uint8_t *)line, len);
+}
+
+/**
+ * Block until the queued messages and the UART's buffer have been written out,
+ * this is used before the MCU stops, e.g. when entering deep sleep
+ */
+void logFlush() {
+#ifdef __HAPPY_HERBS_ASYNC_LOG
+  // the buffer is empty once all of its space is free again
+  while (logRingBuffer && xRingbufferGetCurFreeSize(logRingBuffer) <
+                              xRingbufferGetMaxItemSize(logRingBuffer)) {
+    vTaskDelay(1);
+  }
+#endif
+  Serial.flush();
+}
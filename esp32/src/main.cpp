@@ -1,7 +1,5 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
-#include <BH1750.h>
-#include <DHT.h>
 #include <FS.h>
 #include <PubSubClient.h>
 #include <SPIFFS.h>
@@ -13,49 +11,116 @@
 #include <TaskScheduler.h>
 
 #include "constants.h"
+#include "async_sensors.h"
+#include "connection_supervisor.h"
+#include "credential_store.h"
+#include "device_metrics.h"
 #include "happy_herbs.h"
 #include "ioutils.h"
+#include "logging.h"
+#include "moisture_sensor.h"
+#ifndef __HAPPY_HERBS_NO_OTA
+#include "ota_updater.h"
+#endif
+#include "soak_bench.h"
+#include "status_led.h"
+#include "telemetry_buffer.h"
+#include "threshold_controller.h"
+#include "wifi_fast_connect.h"
 #include "time.h"
 
-char* awsEndpoint;
-char* awsRootCACert;
-char* awsClientCert;
-char* awsClientKey;
+#ifdef __HAPPY_HERBS_LOW_POWER
+#include <driver/gpio.h>
+#include <esp_sleep.h>
+#include <sys/time.h>
+#endif
+
+// Keeps the certificates and keys for as long as the clients use them
+CredentialStore credentialStore;
 
 // Create an object to interact with the light sensor driver
-BH1750 lightSensorBH1750(HH_I2C_BH1750_ADDR);
-DHT tempHumidSensorDHT(HH_GPIO_DHT, DHT11);
+AsyncBH1750 lightSensorBH1750(HH_I2C_BH1750_ADDR);
+AsyncDHT tempHumidSensorDHT(HH_GPIO_DHT, HH_RMT_CHANNEL_DHT, DHT_TYPE_DHT11);
 
 // Create a wifi client that uses SSL client authentication
 WiFiClientSecure wifiClient;
 // Create a wifi client that communicates with AWS
 PubSubClient pubsubClient(wifiClient);
 
-Scheduler scheduler;
+// Runs the tasks that communicate with AWS on the network task
+Scheduler networkScheduler;
+// Runs the tasks that read the sensors and drive the actuators on the control
+// task, i.e. the Arduino loop task
+Scheduler controlScheduler;
+
+// Indicates the system's activities without blocking the scheduler
+StatusLed statusLed(LED_BUILTIN);
+
+// Stores the sensors' measurements on flash while the system is offline
+TelemetryBuffer telemetryBuffer(TELEMETRY_BUFFER_PATH,
+                                TELEMETRY_BUFFER_CAPACITY);
+
+// Decide when the lamp and the watering of each zone are needed, the lamp is
+// seen by the light sensor so its contribution is compensated
+ThresholdController lampController(LIGHT_HYSTERESIS_BAND, LAMP_MIN_DWELL, true,
+                                   BH1750_CONVERSION_TIME);
+ThresholdController moistureControllers[HH_ZONE_COUNT];
+// When the last watering of each zone was started, 0 if there was none since
+// boot
+unsigned long tsLastWatering[HH_ZONE_COUNT] = {};
+
+// Aggregates the timings of the tasks and the MQTT client
+DeviceMetrics deviceMetrics;
+
+// Samples the moisture probes of every zone through ADC1 in the background,
+// the readings of the probes that share a zone are averaged
+MoistureSensor moistureSensor(HH_ADC1_CHANNELS_MOISTURE,
+                              HH_MOISTURE_PROBE_ZONES, HH_MOISTURE_PROBE_COUNT,
+                              MOISTURE_RAW_DRY, MOISTURE_RAW_WET);
 
 // State manager and hardware controller
 HappyHerbsState hhState(lightSensorBH1750, tempHumidSensorDHT, HH_GPIO_LAMP,
-                        HH_GPIO_PUMP, HH_GPIO_MOISTURE);
+                        HH_GPIO_PUMPS, moistureSensor);
 // Service for managing statea and communication with server
 HappyHerbsService hhService(hhState, pubsubClient);
+#ifndef __HAPPY_HERBS_NO_OTA
+// Applies the firmware updates received through AWS IoT Jobs
+OtaUpdater otaUpdater(hhService);
+#endif
+// Reconnects the service with backoff whenever the connection is dropped
+ConnectionSupervisor connectionSupervisor(hhService);
+
+/**
+ * This task sends the measurements that were stored while the system was
+ * offline in small batches, so the backlog does not flood the connection. The
+ * task disables itself once the buffer is empty
+ */
+Task tTelemetryBufferDrain(
+    TELEMETRY_DRAIN_INTERVAL, TASK_FOREVER,
+    []() {
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_TELEMETRY_DRAIN);
+      if (hhService.drainTelemetryBuffer(TELEMETRY_DRAIN_BATCH_SIZE) == 0) {
+        tTelemetryBufferDrain.disable();
+      }
+    },
+    &networkScheduler, false);
 
 /**
  * This task run constantly and keep the connection with AWS alive, if the
- * connection is dropped the system will try to reconnect and sync its state
- * with AWS upon reconnection.
+ * connection is dropped the system will try to reconnect with backoff and sync
+ * its state with AWS upon reconnection. The task is delayed in between attempts
+ * so the other tasks keep running.
  */
 Task tHappyHerbsServiceLoop(
     TASK_IMMEDIATE, TASK_FOREVER,
     []() {
-      if (hhService.connected()) {
-        hhService.loop();
-        return;
-      }
-      if (hhService.connect()) {
-        hhService.publishShadowUpdate();
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_SERVICE_LOOP);
+      unsigned long wait = connectionSupervisor.run();
+      if (wait > 0) {
+        tHappyHerbsServiceLoop.delay(wait);
       }
     },
-    &scheduler, true);
+    &networkScheduler, true);
 
 /**
  * This task takes measurements from every sensor and publish it to AWS, along
@@ -64,10 +129,11 @@ Task tHappyHerbsServiceLoop(
 Task tPeriodicStateSnapshotPublish(
     10 * TASK_MINUTE, TASK_FOREVER,
     []() {
-      ledBlink(LED_BUILTIN, 100, 100, 2);
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_STATE_SNAPSHOT);
+      statusLed.blink(100, 100, 2);
       hhService.publishStateSnapshot();
     },
-    &scheduler, true);
+    &networkScheduler, true);
 
 /**
  * This task takes measurements from every sensor and publish it to AWS for
@@ -76,149 +142,458 @@ Task tPeriodicStateSnapshotPublish(
 Task tPeriodicSensorsMeasurementsPublish(
     10 * TASK_MINUTE, TASK_FOREVER,
     []() {
-      ledBlink(LED_BUILTIN, 100, 100, 2);
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_SENSORS_MEASUREMENTS);
+      statusLed.blink(100, 100, 2);
       hhService.publishSensorsMeasurements();
     },
-    &scheduler, true);
+    &networkScheduler, true);
+
+/**
+ * This task adds the latest samples of every sensor to the window that is
+ * summarized by the next publish of the sensors' measurements
+ */
+Task tSensorsAggregation(
+    SENSORS_AGGREGATION_INTERVAL, TASK_FOREVER,
+    []() {
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_SENSORS_AGGREGATION);
+      hhService.aggregateSensors();
+    },
+    &networkScheduler, true);
+
+/**
+ * Publish the aggregated timings, counters, and memory usage of the device for
+ * every 10 minutes
+ */
+Task tDeviceMetricsPublish(
+    DEVICE_METRICS_INTERVAL, TASK_FOREVER,
+    []() {
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_DEVICE_METRICS);
+      hhService.publishDeviceMetrics();
+    },
+    &networkScheduler, true);
+
+/**
+ * This task reports the outcome of a firmware update and reboots into the new
+ * image once it has been written
+ */
+#ifndef __HAPPY_HERBS_NO_OTA
+Task tOtaUpdater(
+    OTA_POLL_INTERVAL, TASK_FOREVER, []() { otaUpdater.loop(); },
+    &networkScheduler, true);
+#endif
+
+/**
+ * This task applies the commands received from AWS, the commands are queued by
+ * the network task and applied here since the control task owns the actuators
+ */
+Task tHappyHerbsCommands(
+    COMMAND_POLL_INTERVAL, TASK_FOREVER,
+    []() {
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_COMMANDS);
+      hhService.processCommands();
+    },
+    &controlScheduler, true);
+
+/**
+ * This task periodically starts conversions of the sensors whose cached
+ * readings are stale, so the network task can publish the measurements without
+ * accessing the sensors
+ */
+Task tSensorsSampling(
+    SENSOR_SAMPLING_INTERVAL, TASK_FOREVER,
+    []() {
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_SENSORS_SAMPLING);
+      hhState.startConversions();
+    },
+    &controlScheduler, true);
 
 /**
- * Publish a message every 5 minutes to query AWS for the latest shadow
+ * This task collects the results of the sensors' conversions, the conversions
+ * are started by the sampling task and by any task that reads a stale value
  */
-Task tPeriodicShadowGetPublish(
-    5 * TASK_MINUTE, TASK_FOREVER,
+Task tSensorsPolling(
+    SENSOR_POLL_INTERVAL, TASK_FOREVER,
     []() {
-      ledBlink(LED_BUILTIN, 100, 100, 2);
-      hhService.publishShadowGet();
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_SENSORS_POLLING);
+      hhState.pollConversions();
     },
-    &scheduler, true);
+    &controlScheduler, true);
 
 /**
- * This task periodically take measurement on the moisture sensor and compare
- * the result with the user's threshold, if the moisture is not high enough,
- * restart the task that starts the pump
+ * This task compares the moisture of every zone with the zone's threshold in
+ * one pass, a zone's soil is dry once its moisture drops below the threshold
+ * and stays dry until the moisture rises above the hysteresis band. While the
+ * soil is dry, the zone is watered and given time to soak before being watered
+ * again
  */
 Task taskStartWateringBaseOnMoisture(
-    15 * TASK_MINUTE, TASK_FOREVER,
+    THRESHOLD_CONTROL_INTERVAL, TASK_FOREVER,
     []() {
-      ledBlink(LED_BUILTIN, 100, 100, 2);
-      float moisture = hhState.readMoistureSensor();
-      if (moisture < hhState.getMoistureThreshold()) {
-        Serial.printf("MOISTURE IS LOW %f.2 < %f.2\n", moisture,
-                      hhState.getMoistureThreshold());
-        hhService.getTaskPlantWatering().restartDelayed();
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_WATERING);
+      for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+        ThresholdController &controller = moistureControllers[zone];
+        float threshold = hhState.getZoneMoistureThreshold(zone);
+        SensorSample moisture = hhState.readSample(zoneMoistureSensor(zone));
+        if (controller.update(moisture.value, moisture.tsMillis, threshold)) {
+          HH_LOGI("ZONE %d MOISTURE IS %s %.2f, threshold %.2f", zone,
+                  controller.active() ? "LOW" : "OK", moisture.value,
+                  threshold);
+        }
+        if (controller.active() &&
+            (tsLastWatering[zone] == 0 ||
+             millis() - tsLastWatering[zone] >= WATERING_SOAK_TIME)) {
+          tsLastWatering[zone] = millis();
+          hhService.startWatering(zone);
+        }
       }
     },
-    &scheduler, false);
+    &controlScheduler, false);
 
 /**
- * This task periodically take measurement on the light sensor and compare
- * the result with the user's threshold, if the light level is not high enough,
- * turn on the connected lamp
+ * This task compares the light level with the user's threshold, the lamp is
+ * only switched when the controller changes its decision, so the shadow is
+ * only updated when the lamp's state actually changes
  */
 Task taskTurnOnLampBaseOnLightMeter(
-    30 * TASK_MINUTE, TASK_FOREVER,
+    THRESHOLD_CONTROL_INTERVAL, TASK_FOREVER,
     []() {
-      ledBlink(LED_BUILTIN, 100, 100, 2);
-      hhService.writeLampPinID(false);
-      float lightLevel = hhState.readLightSensorBH1750();
-      if (lightLevel < hhState.getLightThreshold()) {
-        Serial.printf("LIGHT LEVEL IS LOW %f.2 < %f.2\n", lightLevel,
-                      hhState.getLightThreshold());
-        Serial.println("TURN ON LAMP");
-        hhService.writeLampPinID(true);
+      MetricTimer timer(&deviceMetrics, METRIC_TASK_LAMP);
+      SensorSample light = hhState.readSample(HH_SENSOR_LIGHT_BH1750);
+      if (lampController.update(light.value, light.tsMillis,
+                                hhState.getLightThreshold())) {
+        HH_LOGI("LIGHT LEVEL %.2f, threshold %.2f, TURN %s LAMP", light.value,
+                hhState.getLightThreshold(),
+                lampController.active() ? "ON" : "OFF");
+        hhService.writeLampPinID(lampController.active());
       }
     },
-    &scheduler, false);
+    &controlScheduler, false);
+
+#ifdef __HAPPY_HERBS_LOW_POWER
+
+// Every task that decides when the system has to be awake
+Task* const dutyCycleTasks[] = {
+    &tPeriodicStateSnapshotPublish, &tPeriodicSensorsMeasurementsPublish,
+    &tDeviceMetricsPublish, &taskStartWateringBaseOnMoisture,
+    &taskTurnOnLampBaseOnLightMeter};
+const int N_DUTY_CYCLE_TASKS = sizeof(dutyCycleTasks) / sizeof(Task*);
+
+const uint32_t DUTY_CYCLE_STATE_MAGIC = 0x48484453;  // "HHDS"
+
+/**
+ * Everything that is needed to resume the system after waking up from deep
+ * sleep. The tasks' due times are kept as wall-clock milliseconds, since the
+ * RTC keeps the system time running during deep sleep
+ */
+struct DutyCycleState {
+  uint32_t magic;
+  HappyHerbsRtcState service;
+  ThresholdControllerState lampController;
+  int64_t tsTasksDue[N_DUTY_CYCLE_TASKS];
+};
+
+RTC_DATA_ATTR DutyCycleState dutyCycleState;
+
+/**
+ * Get the system time in milliseconds, this keeps counting during deep sleep
+ */
+int64_t rtcMillis() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Restore the state that was saved before entering deep sleep, then schedule
+ * every task at the time it was due
+ *
+ * @return True if the system has resumed from deep sleep
+ */
+bool resumeFromDeepSleep() {
+  gpio_hold_dis((gpio_num_t)HH_GPIO_LAMP);
+  gpio_deep_sleep_hold_dis();
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER ||
+      dutyCycleState.magic != DUTY_CYCLE_STATE_MAGIC) {
+    hhState.writeLampPinID(false);
+    return false;
+  }
+  dutyCycleState.magic = 0;
+
+  hhService.restoreRtcState(dutyCycleState.service);
+  lampController.restoreState(dutyCycleState.lampController);
+  int64_t now = rtcMillis();
+  for (int i = 0; i < N_DUTY_CYCLE_TASKS; i++) {
+    int64_t tsDue = dutyCycleState.tsTasksDue[i];
+    if (tsDue < 0) {
+      dutyCycleTasks[i]->disable();
+      continue;
+    }
+    dutyCycleTasks[i]->enableDelayed(tsDue > now ? tsDue - now : 0);
+  }
+  return true;
+}
+
+/**
+ * Enter deep sleep until the next task is due if the system is idle and the
+ * next task is not due within LOW_POWER_MIN_SLEEP milliseconds. The lamp's pin
+ * is held at its current level while sleeping
+ */
+void sleepUntilNextTask() {
+  if (!hhService.isIdle(LOW_POWER_AWAKE_WINDOW) ||
+      tTelemetryBufferDrain.isEnabled()) {
+    return;
+  }
+#ifndef __HAPPY_HERBS_NO_OTA
+  if (!otaUpdater.isIdle()) {
+    return;
+  }
+#endif
+
+  // the due time only depends on the task, so any scheduler can compute it
+  long sleepDuration = -1;
+  for (int i = 0; i < N_DUTY_CYCLE_TASKS; i++) {
+    long timeUntilDue =
+        networkScheduler.timeUntilNextIteration(*dutyCycleTasks[i]);
+    if (timeUntilDue >= 0 &&
+        (sleepDuration < 0 || timeUntilDue < sleepDuration)) {
+      sleepDuration = timeUntilDue;
+    }
+  }
+  if (sleepDuration < (long)LOW_POWER_MIN_SLEEP) {
+    return;
+  }
+
+  int64_t now = rtcMillis();
+  for (int i = 0; i < N_DUTY_CYCLE_TASKS; i++) {
+    long timeUntilDue =
+        networkScheduler.timeUntilNextIteration(*dutyCycleTasks[i]);
+    dutyCycleState.tsTasksDue[i] = timeUntilDue < 0 ? -1 : now + timeUntilDue;
+  }
+  hhService.saveRtcState(dutyCycleState.service);
+  lampController.saveState(dutyCycleState.lampController);
+  dutyCycleState.magic = DUTY_CYCLE_STATE_MAGIC;
+
+  gpio_hold_en((gpio_num_t)HH_GPIO_LAMP);
+  gpio_deep_sleep_hold_en();
+
+  HH_LOGI("DEEP SLEEP for %ldms", sleepDuration);
+  logFlush();
+  pubsubClient.disconnect();
+  esp_sleep_enable_timer_wakeup((uint64_t)sleepDuration * 1000);
+  esp_deep_sleep_start();
+}
+
+#endif
+
+#ifdef __HAPPY_HERBS_BENCH
+
+#ifdef __HAPPY_HERBS_LOW_POWER
+#error "The bench mode can not be combined with the low power mode"
+#endif
+
+// Follows the commands sent by the bench's driver and measures the soak
+SoakBench soakBench;
+
+/**
+ * This task publishes the bench's load, its interval follows the rate of the
+ * load's current step
+ */
+Task tBenchLoad(
+    1000 / BENCH_PUBLISH_RATES[0], TASK_FOREVER,
+    []() {
+      hhService.publishBenchLoad();
+      if (soakBench.advanceLoad()) {
+        HH_LOGI("BENCH load at %lu messages/s",
+                1000 / soakBench.loadInterval());
+        tBenchLoad.setInterval(soakBench.loadInterval());
+      }
+    },
+    &networkScheduler, true);
+
+/**
+ * This task publishes the bench's results for every minute
+ */
+Task tBenchReport(
+    BENCH_REPORT_INTERVAL, TASK_FOREVER,
+    []() { hhService.publishBenchReport(); }, &networkScheduler, true);
+
+#endif
+
+/**
+ * The network task runs the tasks that communicate with AWS, so slow sensors'
+ * readings on the control task never delay the MQTT client's keepalive, and a
+ * slow TLS write never delays the actuators
+ */
+void networkTask(void*) {
+  for (;;) {
+    networkScheduler.execute();
+#ifdef __HAPPY_HERBS_LOW_POWER
+    sleepUntilNextTask();
+#endif
+    // let the lower priority tasks and the idle task run
+    vTaskDelay(1);
+  }
+}
 
 void setup() {
-  pinMode(LED_BUILTIN, OUTPUT);      // digital
-  pinMode(HH_GPIO_LAMP, OUTPUT);     // digital
-  pinMode(HH_GPIO_PUMP, OUTPUT);     // digital
-  pinMode(HH_GPIO_MOISTURE, INPUT);  // analog
+  pinMode(LED_BUILTIN, OUTPUT);   // digital
+  pinMode(HH_GPIO_LAMP, OUTPUT);  // digital
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    pinMode(HH_GPIO_PUMPS[zone], OUTPUT);  // digital
+    moistureControllers[zone] =
+        ThresholdController(MOISTURE_HYSTERESIS_BAND, MOISTURE_MIN_DWELL);
+  }
 
   Serial.begin(SERIAL_BAUD_RATE);
   while (!Serial)
     ;
+  if (!logBegin()) {
+    HH_LOGE("Could not start the logger");
+  }
+#ifndef __HAPPY_HERBS_NO_OTA
+  // an image on trial that keeps crashing is rolled back before it runs again
+  otaUpdater.begin();
+#endif
   Wire.begin(I2C_SDA0, I2C_SCL0);
+  // shortens the sensors' transactions, the BH1750 supports the fast mode
+  Wire.setClock(400000);
+  statusLed.begin(networkScheduler);
 
   if (!SPIFFS.begin()) {
-    Serial.println("Could not start file system");
+    HH_LOGE("Could not start file system");
     return;
   }
 
-  // ================ CONNECT TO WIFI ================
-  char* miscCreds = loadFile(MISC_CREDS.c_str());
-  StaticJsonDocument<MQTT_MESSAGE_BUFFER_SIZE> miscCredsJson;
-  deserializeJson(miscCredsJson, miscCreds);
-  free(miscCreds);
+  if (!telemetryBuffer.begin()) {
+    HH_LOGE("Could not open the telemetry buffer");
+  }
+
+  if (!credentialStore.begin()) {
+    HH_LOGE("Could not read all credentials");
+    return;
+  }
 
-  Serial.print("Connecting to wifi");
-  const String ssid = miscCredsJson["wifiSSID"];
-  const String password = miscCredsJson["wifiPass"];
-  WiFi.begin(ssid.c_str(), password.c_str());
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    delay(500);
+  // ================ READ THE MISC CREDENTIALS ================
+  String ssid;
+  String password;
+  int ntpTimezoneOffset;
+  int ntpDaylightOffset;
+  {
+    // the document is the only large one of the pool, so it is released
+    // before the network task starts parsing the shadow's messages
+    JsonDocumentLease miscCredsJson =
+        hhService.leaseJsonDocument(MQTT_MESSAGE_BUFFER_SIZE);
+    if (!miscCredsJson) {
+      HH_LOGE("Could not allocate the misc credentials document");
+      return;
+    }
+    // the values are copied into the document because the embedded
+    // credentials are read-only, so the credential can be released right away
+    deserializeJson(*miscCredsJson, credentialStore.get(CREDENTIAL_MISC));
+    credentialStore.release(CREDENTIAL_MISC);
+    ssid = (*miscCredsJson)["wifiSSID"].as<String>();
+    password = (*miscCredsJson)["wifiPass"].as<String>();
+    ntpTimezoneOffset = (*miscCredsJson)["ntpTimezoneOffset"];
+    ntpDaylightOffset = (*miscCredsJson)["ntpDaylightOffset"];
   }
-  Serial.println("connected!");
+
+  // ================ CONNECT TO WIFI ================
+  HH_LOGI("Connecting to wifi...");
+  bool isFastConnected = connectWiFi(ssid.c_str(), password.c_str());
+  HH_LOGI("-- connected after %lums%s!", millis(),
+          isFastConnected ? " (cached)" : "");
 
   // ================ SYNC WITH NTP SERVER ================
-  int ntpTimezoneOffset = miscCredsJson["ntpTimezoneOffset"];
-  int ntpDaylightOffset = miscCredsJson["ntpDaylightOffset"];
   configTime(ntpTimezoneOffset, ntpDaylightOffset, NTP_SERVER.c_str());
 
   // ======== SETUP KEY AND CERTIFICATES FOR CLIENT AUTH ========
-  awsEndpoint = loadFile(AWS_IOT_ENDPOINT.c_str());
-  if (!awsEndpoint) {
-    Serial.println("Could not read AWS endpoint from file");
-    return;
-  }
-  awsRootCACert = loadFile(AWS_ROOTCA_CERT.c_str());
-  if (!awsRootCACert) {
-    Serial.println("Could not read root CA certificate from file");
-    return;
-  }
-  awsClientCert = loadFile(AWS_CLIENT_CERT.c_str());
-  if (!awsClientCert) {
-    Serial.println("Could not read client certificate from file");
-    return;
-  }
-  awsClientKey = loadFile(AWS_CLIENT_KEY.c_str());
-  if (!awsClientKey) {
-    Serial.println("Could not read client key from file");
-    return;
-  }
-
-  wifiClient.setCACert(awsRootCACert);
-  wifiClient.setCertificate(awsClientCert);
-  wifiClient.setPrivateKey(awsClientKey);
+  wifiClient.setCACert(credentialStore.get(CREDENTIAL_AWS_ROOTCA_CERT));
+  wifiClient.setCertificate(credentialStore.get(CREDENTIAL_AWS_CLIENT_CERT));
+  wifiClient.setPrivateKey(credentialStore.get(CREDENTIAL_AWS_CLIENT_KEY));
 
   // ================ SETUP MQTT CLIENT ================
-  pubsubClient.setServer(awsEndpoint, 8883);
+  pubsubClient.setServer(credentialStore.get(CREDENTIAL_AWS_IOT_ENDPOINT),
+                         8883);
   pubsubClient.setBufferSize(MQTT_MESSAGE_BUFFER_SIZE);
   pubsubClient.setCallback([](char* topic, byte* payload, unsigned int length) {
     hhService.handleCallback(topic, payload, length);
   });
 
   // ================ SETUP STATE AND SERVICE ================
-  String awsThingName = loadFile(AWS_THING_NAME.c_str());
-  if (!awsThingName) {
-    Serial.println("Could not read AWS thing's name from file");
+  hhService.setThingName(credentialStore.get(CREDENTIAL_AWS_THING_NAME));
+#ifndef __HAPPY_HERBS_NO_OTA
+  otaUpdater.setThingName(credentialStore.get(CREDENTIAL_AWS_THING_NAME));
+  // the images are served from S3, which shares the root CA of AWS IoT
+  otaUpdater.setRootCA(credentialStore.get(CREDENTIAL_AWS_ROOTCA_CERT));
+#endif
+  credentialStore.release(CREDENTIAL_AWS_THING_NAME);
+  hhService.setShadowFlushWindow(SHADOW_UPDATE_FLUSH_WINDOW);
+  hhService.setStatusLed(statusLed);
+  hhService.setTelemetryBuffer(telemetryBuffer);
+  hhService.setDeviceMetrics(deviceMetrics);
+#ifdef __HAPPY_HERBS_BENCH
+  hhService.setSoakBench(soakBench);
+#endif
+  // the deltas that were pushed while disconnected are lost, so the shadow is
+  // fetched once every time the connection is made
+  connectionSupervisor.setOnConnected([]() {
+    hhService.publishShadowUpdate();
+    hhService.publishShadowGet();
+#ifndef __HAPPY_HERBS_NO_OTA
+    otaUpdater.requestNextJob();
+#endif
+    tTelemetryBufferDrain.enableIfNot();
+  });
+  if (!hhService.setupPlantWatering(5 * TASK_SECOND)) {
+    HH_LOGE("Could not create the plant watering timer");
+  }
+  if (!hhService.begin()) {
+    HH_LOGE("Could not create the commands queue");
+    return;
   }
-  hhService.setThingName(awsThingName);
-  hhService.setupTaskPlantWatering(scheduler, 5 * TASK_SECOND);
 
   if (!hhState.begin()) {
-    Serial.println("Could not initialize all sensors");
+    HH_LOGE("Could not initialize all sensors");
   }
   hhState.writeLampPinID(false);
-  hhState.writePumpPinID(false);
   hhState.setLightThreshold(DEFAULT_LIGHT_THRESHOLD);
-  hhState.setMoistureThreshold(DEFAULT_MOISTURE_THRESHOLD);
+  for (int zone = 0; zone < HH_ZONE_COUNT; zone++) {
+    hhState.writeZonePumpPinID(zone, false);
+    hhState.setZoneMoistureThreshold(zone, DEFAULT_MOISTURE_THRESHOLD);
+  }
 
-  // enable tasks after all necessary states have been initialized
-  taskTurnOnLampBaseOnLightMeter.enable();
-  taskStartWateringBaseOnMoisture.enable();
+  bool isResumed = false;
+#ifdef __HAPPY_HERBS_LOW_POWER
+  isResumed = resumeFromDeepSleep();
+  if (isResumed) {
+    HH_LOGI("RESUMED from deep sleep");
+  }
+#endif
+  if (!isResumed) {
+    lampController.reset(hhState.readLampPinID());
+#ifndef __HAPPY_HERBS_BENCH
+    // enable tasks after all necessary states have been initialized, in the
+    // bench mode the actuators are only driven by the bench's commands
+    taskTurnOnLampBaseOnLightMeter.enable();
+    taskStartWateringBaseOnMoisture.enable();
+#endif
+  }
+  hhState.refreshSensors();
+
+#if CONFIG_FREERTOS_UNICORE
+  vTaskPrioritySet(NULL, CONTROL_TASK_PRIORITY);
+#endif
+  TaskHandle_t networkTaskHandle = nullptr;
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK_SIZE,
+                          NULL, NETWORK_TASK_PRIORITY, &networkTaskHandle,
+                          NETWORK_TASK_CORE);
+  deviceMetrics.watchTask("control", xTaskGetCurrentTaskHandle());
+  deviceMetrics.watchTask("network", networkTaskHandle);
 }
 
-void loop() { scheduler.execute(); }
\ No newline at end of file
+void loop() {
+  // wait when no task was run so the network task can run
+  if (controlScheduler.execute()) {
+    vTaskDelay(1);
+  }
+}
\ No newline at end of file
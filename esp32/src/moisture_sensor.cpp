@@ -0,0 +1,179 @@
+#include "moisture_sensor.h"
+
+/**
+ * Create the probes' driver
+ *
+ * @param channels The ADC1 channels that the probes are connected to
+ * @param zones The zone of each probe, a probe outside of the zones is sampled
+ * but never read as part of a zone
+ * @param nChannels Number of probes, at most HH_MOISTURE_PROBE_COUNT
+ * @param rawDry Raw counts of a probe in dry air
+ * @param rawWet Raw counts of a probe in water
+ */
+MoistureSensor::MoistureSensor(const int *channels, const int *zones,
+                               int nChannels, int rawDry, int rawWet) {
+  this->nChannels = constrain(nChannels, 0, HH_MOISTURE_PROBE_COUNT);
+  for (int i = 0; i < this->nChannels; i++) {
+    this->channels[i] = (adc1_channel_t)channels[i];
+    this->zones[i] = zones[i];
+  }
+  this->setCalibration(rawDry, rawWet);
+}
+
+/**
+ * Configure ADC1 and start sampling in the background. Only ADC1 is used since
+ * ADC2 is shared with the Wi-Fi driver
+ *
+ * @param period Number of milliseconds between two samples
+ * @return True if the sampling has started
+ */
+bool MoistureSensor::begin(unsigned long period) {
+#ifdef __HAPPY_HERBS_ESP32S2
+  adc1_config_width(ADC_WIDTH_BIT_13);
+#else
+  adc1_config_width(ADC_WIDTH_BIT_12);
+#endif
+  for (int i = 0; i < this->nChannels; i++) {
+    if (adc1_config_channel_atten(this->channels[i], ADC_ATTEN_DB_11) !=
+        ESP_OK) {
+      return false;
+    }
+  }
+
+  esp_timer_create_args_t timerArgs = {};
+  timerArgs.callback = &MoistureSensor::onSamplingTimer;
+  timerArgs.arg = this;
+  timerArgs.name = "moisture";
+  if (esp_timer_create(&timerArgs, &this->samplingTimer) != ESP_OK) {
+    return false;
+  }
+  // take the first sample right away so the probes are readable at once
+  this->sample();
+  return esp_timer_start_periodic(this->samplingTimer,
+                                  (uint64_t)period * 1000) == ESP_OK;
+}
+
+/**
+ * Set the raw counts that map to 0% and to 100%
+ *
+ * @param rawDry Raw counts of the sensor in dry air
+ * @param rawWet Raw counts of the sensor in water
+ */
+void MoistureSensor::setCalibration(int rawDry, int rawWet) {
+  this->rawDry = rawDry;
+  this->rawWet = rawWet;
+}
+
+void MoistureSensor::onSamplingTimer(void *arg) {
+  static_cast<MoistureSensor *>(arg)->sample();
+}
+
+/**
+ * Take a burst of conversions on every probe and push their means into the ring
+ * buffers, this runs on the esp_timer task
+ */
+void MoistureSensor::sample() {
+  uint16_t means[HH_MOISTURE_PROBE_COUNT];
+  for (int c = 0; c < this->nChannels; c++) {
+    uint32_t sum = 0;
+    int nConversions = 0;
+    for (int i = 0; i < MOISTURE_OVERSAMPLING; i++) {
+      int raw = adc1_get_raw(this->channels[c]);
+      if (raw >= 0) {
+        sum += raw;
+        nConversions++;
+      }
+    }
+    // all probes share one head, so a failed burst repeats the last sample
+    if (nConversions > 0) {
+      means[c] = sum / nConversions;
+    } else if (this->count > 0) {
+      int last = (this->head + MOISTURE_RING_SIZE - 1) % MOISTURE_RING_SIZE;
+      means[c] = this->samples[c][last];
+    } else {
+      return;
+    }
+  }
+
+  portENTER_CRITICAL(&this->samplesMux);
+  for (int c = 0; c < this->nChannels; c++) {
+    this->samples[c][this->head] = means[c];
+  }
+  this->head = (this->head + 1) % MOISTURE_RING_SIZE;
+  if (this->count < MOISTURE_RING_SIZE) {
+    this->count++;
+  }
+  portEXIT_CRITICAL(&this->samplesMux);
+}
+
+/**
+ * Get the median of the samples in a probe's ring buffer
+ *
+ * @param channel Index of the probe
+ * @return The raw counts, or -1 if there is no sample yet
+ */
+int MoistureSensor::readRaw(int channel) {
+  if (channel < 0 || channel >= this->nChannels) {
+    return -1;
+  }
+  uint16_t sorted[MOISTURE_RING_SIZE];
+  portENTER_CRITICAL(&this->samplesMux);
+  int n = this->count;
+  memcpy(sorted, this->samples[channel], sizeof(sorted));
+  portEXIT_CRITICAL(&this->samplesMux);
+  if (n == 0) {
+    return -1;
+  }
+
+  // the ring is small, so insertion sort is enough
+  for (int i = 1; i < n; i++) {
+    uint16_t value = sorted[i];
+    int j = i - 1;
+    for (; j >= 0 && sorted[j] > value; j--) {
+      sorted[j + 1] = sorted[j];
+    }
+    sorted[j + 1] = value;
+  }
+  return sorted[n / 2];
+}
+
+/**
+ * Get the calibrated moisture of a probe
+ *
+ * @param channel Index of the probe
+ * @return The moisture in percent between 0 and 100, or NaN if there is no
+ * sample yet
+ */
+float MoistureSensor::readPercent(int channel) {
+  int raw = this->readRaw(channel);
+  if (raw < 0 || this->rawDry == this->rawWet) {
+    return NAN;
+  }
+  float percent =
+      100.0f * (this->rawDry - raw) / (float)(this->rawDry - this->rawWet);
+  return constrain(percent, 0.0f, 100.0f);
+}
+
+/**
+ * Get the calibrated moisture of a zone, the mean of its probes that have a
+ * sample
+ *
+ * @param zone Index of the zone
+ * @return The moisture in percent between 0 and 100, or NaN if none of the
+ * zone's probes has a sample yet
+ */
+float MoistureSensor::readZonePercent(int zone) {
+  float sum = 0;
+  int nProbes = 0;
+  for (int i = 0; i < this->nChannels; i++) {
+    if (this->zones[i] != zone) {
+      continue;
+    }
+    float percent = this->readPercent(i);
+    if (!isnan(percent)) {
+      sum += percent;
+      nProbes++;
+    }
+  }
+  return nProbes > 0 ? sum / nProbes : NAN;
+}
@@ -0,0 +1,464 @@
+#ifndef __HAPPY_HERBS_NO_OTA
+
+#include "ota_updater.h"
+
+#include <HTTPClient.h>
+#include <Preferences.h>
+#include <Update.h>
+#include <WiFiClientSecure.h>
+#include <esp_ota_ops.h>
+
+#include <algorithm>
+
+#include "logging.h"
+
+const uint32_t OTA_TRIAL_STATE_MAGIC = 0x48484f54;  // "HHOT"
+static const char *const OTA_TRIAL_NAMESPACE = "ota";
+static const char *const OTA_TRIAL_KEY = "trial";
+
+static OtaTrialState otaTrialState;
+
+/**
+ * Read the trial state from NVS into otaTrialState
+ *
+ * @return True if an update has left a trial state
+ */
+static bool loadTrialState() {
+  Preferences prefs;
+  otaTrialState = {};
+  if (prefs.begin(OTA_TRIAL_NAMESPACE, true)) {
+    prefs.getBytes(OTA_TRIAL_KEY, &otaTrialState, sizeof(otaTrialState));
+    prefs.end();
+  }
+  return otaTrialState.magic == OTA_TRIAL_STATE_MAGIC;
+}
+
+/**
+ * Write otaTrialState to NVS
+ *
+ * @return True if the trial state has been written
+ */
+static bool storeTrialState() {
+  Preferences prefs;
+  if (!prefs.begin(OTA_TRIAL_NAMESPACE, false)) {
+    return false;
+  }
+  size_t n = prefs.putBytes(OTA_TRIAL_KEY, &otaTrialState,
+                            sizeof(otaTrialState));
+  prefs.end();
+  return n == sizeof(otaTrialState);
+}
+
+/**
+ * Forget the trial state, once the update's outcome is known
+ */
+static void clearTrialState() {
+  otaTrialState = {};
+  Preferences prefs;
+  if (prefs.begin(OTA_TRIAL_NAMESPACE, false)) {
+    prefs.remove(OTA_TRIAL_KEY);
+    prefs.end();
+  }
+}
+
+OtaUpdater::OtaUpdater(HappyHerbsService &hhService) {
+  this->hhService = &hhService;
+}
+
+/**
+ * Count the boots of an image that is on trial, the image is rolled back once
+ * it has booted more than OTA_MAX_TRIAL_BOOTS times without reaching AWS. This
+ * must be called early in setup, so an image that crashes before connecting is
+ * rolled back too. The count is kept in NVS, so it survives the crashes, the
+ * resets, and the losses of power
+ */
+void OtaUpdater::begin() {
+  if (!loadTrialState() || otaTrialState.isRolledBack) {
+    return;
+  }
+  if (esp_ota_get_running_partition()->subtype ==
+      otaTrialState.previousSubtype) {
+    // the reset came before the new image was made bootable, or the bootloader
+    // could not start it and fell back to this one
+    HH_LOGW("OTA image was never started");
+    otaTrialState.isRolledBack = true;
+    storeTrialState();
+    return;
+  }
+  this->isTrial = true;
+  otaTrialState.nBoots++;
+  // counted before anything else runs, so a crash loop reaches the limit
+  if (!storeTrialState()) {
+    HH_LOGE("Could not count the OTA trial boot");
+  }
+  HH_LOGI("OTA image %s on trial, boot %d", HH_FIRMWARE_VERSION,
+          otaTrialState.nBoots);
+  if (otaTrialState.nBoots > OTA_MAX_TRIAL_BOOTS) {
+    this->rollBack();
+  }
+}
+
+/**
+ * Set the thing's name that is used to build the jobs' topics and register the
+ * jobs' handlers with the service
+ *
+ * NOTE: The service's thing name must be set first, since it clears every
+ * registered handler
+ *
+ * @param thingName The assigned name
+ */
+void OtaUpdater::setThingName(String thingName) {
+  String jobsPrefix = "$aws/things/" + thingName + "/jobs";
+  this->topicJobsPrefix = jobsPrefix + "/";
+  this->topicJobNotifyNext = jobsPrefix + "/notify-next";
+  this->topicJobGetNext = jobsPrefix + "/$next/get";
+  this->topicJobGetNextAccepted = this->topicJobGetNext + "/accepted";
+
+  // both topics carry the next pending job execution
+  TopicHandler handler = [this](const char *, byte *payload,
+                                unsigned int length) {
+    JsonDocumentLease jobJson =
+        this->hhService->leaseJsonDocument(OTA_JOB_DOCUMENT_CAPACITY);
+    if (!jobJson) {
+      HH_LOGW("DROPPED job, no JSON document available");
+      return;
+    }
+    DeserializationError err =
+        deserializeJson(*jobJson, (char *)payload, length);
+    if (err) {
+      HH_LOGW("DROPPED job, %s", err.c_str());
+      return;
+    }
+    this->handleJobExecution((*jobJson)["execution"].as<JsonObjectConst>());
+  };
+  this->hhService->registerTopicHandler(this->topicJobNotifyNext, handler);
+  this->hhService->registerTopicHandler(this->topicJobGetNextAccepted,
+                                        handler);
+}
+
+/**
+ * Set the root CA of the host that serves the images
+ *
+ * @param rootCA The PEM encoded certificate, it must outlive the updater
+ */
+void OtaUpdater::setRootCA(const char *rootCA) { this->rootCA = rootCA; }
+
+/**
+ * Keep the image that is on trial, this is called once the image has reached
+ * AWS
+ */
+void OtaUpdater::confirm() {
+  if (!this->isTrial) {
+    return;
+  }
+  this->isTrial = false;
+  clearTrialState();
+  // the rollback is driven by the trial state, this only matters for a
+  // bootloader that is built with rollback enabled, which would otherwise
+  // revert the image on its next reset
+  esp_ota_mark_app_valid_cancel_rollback();
+  HH_LOGI("OTA image %s confirmed", HH_FIRMWARE_VERSION);
+}
+
+/**
+ * Confirm the running image and ask for the next pending job, this must be
+ * called every time the connection is made since the notifications that were
+ * sent while disconnected are lost
+ */
+void OtaUpdater::requestNextJob() {
+  this->confirm();
+  if (this->state != OTA_STATE_IDLE) {
+    return;
+  }
+  this->hhService->publish(this->topicJobGetNext.c_str(), "{}");
+}
+
+/**
+ * Check if no update is being applied
+ *
+ * @return True if no update is being applied
+ */
+bool OtaUpdater::isIdle() { return this->state == OTA_STATE_IDLE; }
+
+/**
+ * Report the outcome of the download, the system reboots into the new image
+ * once it has been written. The image on trial is rolled back if it has not
+ * reached AWS within OTA_TRIAL_TIMEOUT
+ */
+void OtaUpdater::loop() {
+  if (this->isTrial && millis() >= OTA_TRIAL_TIMEOUT) {
+    HH_LOGW("OTA image did not reach AWS in time");
+    this->rollBack();
+  }
+
+  if (this->state == OTA_STATE_FAILED) {
+    HH_LOGW("OTA job %s failed, %s", this->jobId.c_str(), this->failure);
+    // reported again on the next call if the client is disconnected
+    if (this->publishJobStatus("FAILED", this->failure)) {
+      this->state = OTA_STATE_IDLE;
+    }
+  } else if (this->state == OTA_STATE_DOWNLOADED) {
+    // the job is reported as succeeded by the new image, once it is running
+    HH_LOGI("OTA image %s written, rebooting", this->version.c_str());
+    logFlush();
+    ESP.restart();
+  }
+}
+
+/**
+ * Start applying a job execution if no update is being applied. A job whose
+ * version is running has succeeded, and a job that is still in progress while
+ * another version is running has been interrupted or rolled back
+ *
+ * @param execution The job execution, null if no job is pending
+ */
+void OtaUpdater::handleJobExecution(JsonObjectConst execution) {
+  const char *jobId = execution["jobId"];
+  if (!jobId || this->state != OTA_STATE_IDLE) {
+    return;
+  }
+  // the strings point into the client's buffer, so they are copied before
+  // anything is published
+  JsonObjectConst jobDoc = execution["jobDocument"];
+  bool isOta = strcmp(jobDoc["operation"] | "", "ota") == 0;
+  const char *compression = jobDoc["compression"] | "";
+  bool isCompressionSupported =
+      compression[0] == '\0' || strcmp(compression, "gzip") == 0;
+  bool isInProgress = strcmp(execution["status"] | "", "IN_PROGRESS") == 0;
+  this->jobId = jobId;
+  this->version = jobDoc["version"] | "";
+  this->url = jobDoc["url"] | "";
+  this->md5 = jobDoc["md5"] | "";
+  this->size = jobDoc["size"] | 0;
+  this->isGzip = strcmp(compression, "gzip") == 0;
+
+  if (!isOta) {
+    this->publishJobStatus("REJECTED", "unsupported operation");
+    return;
+  }
+  if (!isCompressionSupported) {
+    this->publishJobStatus("REJECTED", "unsupported compression");
+    return;
+  }
+  if (this->version == HH_FIRMWARE_VERSION) {
+    this->publishJobStatus("SUCCEEDED", nullptr);
+    return;
+  }
+  if (isInProgress) {
+    bool isRolledBack = otaTrialState.magic == OTA_TRIAL_STATE_MAGIC &&
+                        otaTrialState.isRolledBack;
+    clearTrialState();
+    this->publishJobStatus("FAILED", isRolledBack ? "rolled back"
+                                                  : "interrupted by a reboot");
+    return;
+  }
+
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  // the gzip trailer is not checked, so the inflated image needs its MD5
+  if (this->url.length() == 0 || this->size == 0 || !partition ||
+      this->size > partition->size ||
+      (this->isGzip && this->md5.length() == 0)) {
+    this->publishJobStatus("REJECTED", "invalid image");
+    return;
+  }
+  // the job stays queued and is fetched again on the next connection
+  if (!this->publishJobStatus("IN_PROGRESS", nullptr)) {
+    return;
+  }
+
+  HH_LOGI("OTA job %s, downloading %u bytes", this->jobId.c_str(),
+          (unsigned int)this->size);
+  this->state = OTA_STATE_DOWNLOADING;
+  if (xTaskCreatePinnedToCore(downloadTask, "ota", OTA_TASK_STACK_SIZE, this,
+                              OTA_TASK_PRIORITY, NULL,
+                              NETWORK_TASK_CORE) != pdPASS) {
+    this->failure = "could not start the download";
+    this->state = OTA_STATE_FAILED;
+  }
+}
+
+/**
+ * Update the status of the current job execution
+ *
+ * @param status The execution's new status
+ * @param reason Why the status is reported, may be null
+ * @return True if published successfully
+ */
+bool OtaUpdater::publishJobStatus(const char *status, const char *reason) {
+  JsonDocumentLease statusJson =
+      this->hhService->leaseJsonDocument(JSON_SMALL_DOCUMENT_CAPACITY);
+  if (!statusJson) {
+    return false;
+  }
+  (*statusJson)["status"] = status;
+  JsonObject detailsObj = statusJson->createNestedObject("statusDetails");
+  detailsObj["runningVersion"] = HH_FIRMWARE_VERSION;
+  if (reason) {
+    detailsObj["reason"] = reason;
+  }
+  String topic = this->topicJobsPrefix + this->jobId + "/update";
+  bool isSent = this->hhService->publishJson(topic.c_str(), *statusJson);
+  if (isSent) {
+    HH_LOGI("OTA job %s %s", this->jobId.c_str(), status);
+  }
+  return isSent;
+}
+
+/**
+ * Stream the image from its URL into the inactive OTA partition, the image is
+ * read and written in chunks of OTA_CHUNK_SIZE bytes and its MD5 is checked
+ * before the partition is made bootable. A gzip image is inflated as it is
+ * read, the inflated chunks are written straight from the inflater's
+ * dictionary. The trial state is stored before the partition is made bootable
+ *
+ * NOTE: This runs on the download task
+ *
+ * @return True if the image has been written and verified
+ */
+bool OtaUpdater::download() {
+  WiFiClientSecure client;
+  client.setCACert(this->rootCA);
+  HTTPClient http;
+  http.setTimeout(OTA_HTTP_TIMEOUT);
+  if (!http.begin(client, this->url)) {
+    this->failure = "invalid URL";
+    return false;
+  }
+  int code = http.GET();
+  if (code != HTTP_CODE_OK) {
+    HH_LOGW("OTA download failed, HTTP %d", code);
+    this->failure = "download failed";
+    http.end();
+    return false;
+  }
+  // the served length of a gzip image is the compressed one, or unknown
+  if (!this->isGzip && http.getSize() != (int)this->size) {
+    this->failure = "size mismatch";
+    http.end();
+    return false;
+  }
+  if (this->isGzip && !this->inflater.begin()) {
+    this->failure = "not enough memory to inflate";
+    http.end();
+    return false;
+  }
+  if (!Update.begin(this->size) ||
+      (this->md5.length() > 0 && !Update.setMD5(this->md5.c_str()))) {
+    HH_LOGW("OTA could not start, %s", Update.errorString());
+    this->failure = "could not start the update";
+    Update.abort();
+    this->inflater.end();
+    http.end();
+    return false;
+  }
+
+  WiFiClient *stream = http.getStreamPtr();
+  size_t written = 0;
+  ChunkHandler writeImage = [this, &written](const uint8_t *data,
+                                             size_t length) {
+    if (length > this->size - written ||
+        Update.write((uint8_t *)data, length) != length) {
+      return false;
+    }
+    written += length;
+    return true;
+  };
+  unsigned long tsLastRead = millis();
+  while (this->isGzip ? !this->inflater.isDone() : written < this->size) {
+    size_t available = stream->available();
+    if (available == 0) {
+      if (!stream->connected() || millis() - tsLastRead >= OTA_HTTP_TIMEOUT) {
+        break;
+      }
+      vTaskDelay(1);
+      continue;
+    }
+    size_t wanted = std::min(available, (size_t)OTA_CHUNK_SIZE);
+    if (!this->isGzip) {
+      wanted = std::min(wanted, this->size - written);
+    }
+    int n = stream->read(this->chunk, wanted);
+    bool isWritten =
+        n > 0 && (this->isGzip
+                      ? this->inflater.write(this->chunk, n, writeImage)
+                      : writeImage(this->chunk, n));
+    if (!isWritten) {
+      break;
+    }
+    tsLastRead = millis();
+  }
+  http.end();
+  bool isInflateFailed = this->isGzip && this->inflater.hasFailed();
+  bool isInflated = this->isGzip && this->inflater.isDone();
+  this->inflater.end();
+
+  if (isInflateFailed || (isInflated && written < this->size)) {
+    HH_LOGW("OTA image could not be inflated after %u bytes",
+            (unsigned int)written);
+    this->failure = "invalid gzip image";
+    Update.abort();
+    return false;
+  }
+  if (written < this->size) {
+    HH_LOGW("OTA download interrupted after %u bytes", (unsigned int)written);
+    this->failure = "download interrupted";
+    Update.abort();
+    return false;
+  }
+  // Update.end() makes the new image bootable, so the trial is stored first
+  // and a reset at any point afterwards still boots the image on trial
+  otaTrialState.magic = OTA_TRIAL_STATE_MAGIC;
+  otaTrialState.nBoots = 0;
+  otaTrialState.previousSubtype = esp_ota_get_running_partition()->subtype;
+  otaTrialState.isRolledBack = false;
+  if (!storeTrialState()) {
+    this->failure = "could not store the trial state";
+    otaTrialState = {};
+    Update.abort();
+    return false;
+  }
+  if (!Update.end()) {
+    HH_LOGW("OTA image rejected, %s", Update.errorString());
+    this->failure = "image verification failed";
+    clearTrialState();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Boot the image that was running before the update, the job is reported as
+ * failed by that image
+ */
+void OtaUpdater::rollBack() {
+  const esp_partition_t *previous = esp_partition_find_first(
+      ESP_PARTITION_TYPE_APP,
+      (esp_partition_subtype_t)otaTrialState.previousSubtype, NULL);
+  this->isTrial = false;
+  if (!previous || esp_ota_set_boot_partition(previous) != ESP_OK) {
+    HH_LOGE("Could not roll back the OTA image");
+    clearTrialState();
+    return;
+  }
+  otaTrialState.isRolledBack = true;
+  storeTrialState();
+  HH_LOGW("ROLLING BACK the OTA image %s", HH_FIRMWARE_VERSION);
+  logFlush();
+  ESP.restart();
+}
+
+/**
+ * Run the download and hand its outcome to the network task, the failure is
+ * set before the state is stored so the network task sees both. The trial state
+ * is only touched by this task while the download runs
+ *
+ * @param arg The updater
+ */
+void OtaUpdater::downloadTask(void *arg) {
+  OtaUpdater *updater = (OtaUpdater *)arg;
+  updater->state =
+      updater->download() ? OTA_STATE_DOWNLOADED : OTA_STATE_FAILED;
+  vTaskDelete(NULL);
+}
+
+#endif  // __HAPPY_HERBS_NO_OTA
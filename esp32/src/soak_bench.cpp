@@ -0,0 +1,236 @@
+#include "soak_bench.h"
+
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+
+static const char *const LATENCY_NAMES[BENCH_LATENCY_COUNT] = {
+    "actuation",
+    "echo",
+    "cloudToActuator",
+    "endToEnd",
+};
+
+/**
+ * Get the part of the free heap that can not be allocated in one block
+ *
+ * @param freeHeap The free heap's size
+ * @param largestBlock The size of the largest free block
+ * @return The fragmentation between 0 and 1
+ */
+static float heapFragmentation(uint32_t freeHeap, uint32_t largestBlock) {
+  return freeHeap > 0 ? 1 - (float)largestBlock / freeHeap : 0;
+}
+
+/**
+ * Add a latency to its reservoir, a latency replaces a random sample once the
+ * reservoir is full so that every latency is kept with the same probability
+ *
+ * NOTE: The caller must hold the mux
+ *
+ * @param latency The measured latency
+ * @param micros The latency's duration in microseconds
+ */
+void SoakBench::recordLatency(BenchLatency latency, int64_t micros) {
+  LatencyReservoir &reservoir = this->reservoirs[latency];
+  uint32_t value = micros < 0 ? 0 : (uint32_t)micros;
+  if (reservoir.count < BENCH_LATENCY_SAMPLES) {
+    reservoir.samples[reservoir.count] = value;
+  } else {
+    uint32_t slot = esp_random() % (reservoir.count + 1);
+    if (slot < BENCH_LATENCY_SAMPLES) {
+      reservoir.samples[slot] = value;
+    }
+  }
+  if (reservoir.count < UINT32_MAX) {
+    reservoir.count++;
+  }
+  if (value > reservoir.maxMicros) {
+    reservoir.maxMicros = value;
+  }
+}
+
+/**
+ * Start following the command of a delta that has just been received, a
+ * command that is still followed is dropped
+ *
+ * @param tsArrival When the delta was received, from esp_timer_get_time()
+ */
+void SoakBench::recordDeltaArrival(int64_t tsArrival) {
+  portENTER_CRITICAL(&this->mux);
+  this->tsDeltaArrival = tsArrival;
+  this->tsActuation = 0;
+  this->actuatedFields = 0;
+  portEXIT_CRITICAL(&this->mux);
+}
+
+/**
+ * Record that an actuator's GPIO has been written, the first actuation after
+ * the delta's arrival is the command's actuation. Actuations that do not follow
+ * a delta within BENCH_PROBE_TIMEOUT are not measured
+ *
+ * @param fields Bit flags of the shadow's fields of the actuator
+ */
+void SoakBench::recordActuation(uint32_t fields) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&this->mux);
+  if (this->tsDeltaArrival != 0 &&
+      now - this->tsDeltaArrival <= (int64_t)BENCH_PROBE_TIMEOUT * 1000) {
+    if (this->tsActuation == 0) {
+      this->tsActuation = now;
+      this->recordLatency(BENCH_LATENCY_ACTUATION, now - this->tsDeltaArrival);
+    }
+    this->actuatedFields |= fields;
+  }
+  portEXIT_CRITICAL(&this->mux);
+}
+
+/**
+ * Record that AWS has accepted one of the device's updates, the command is
+ * complete when the update reports an actuated field and has been sent after
+ * the actuation. The cloud's leg is estimated as half of the update's round
+ * trip, since AWS stamps the deltas in seconds only
+ *
+ * @param fields Bit flags of the fields included in the update
+ * @param tsSent When the update was sent, from millis()
+ */
+void SoakBench::recordAccepted(uint32_t fields, unsigned long tsSent) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&this->mux);
+  if (this->tsActuation != 0 && (fields & this->actuatedFields) != 0 &&
+      (int64_t)tsSent >= this->tsActuation / 1000) {
+    int64_t echo = (int64_t)(millis() - tsSent) * 1000;
+    int64_t actuation = this->tsActuation - this->tsDeltaArrival;
+    this->recordLatency(BENCH_LATENCY_ECHO, echo);
+    this->recordLatency(BENCH_LATENCY_CLOUD_TO_ACTUATOR, echo / 2 + actuation);
+    this->recordLatency(BENCH_LATENCY_END_TO_END, now - this->tsDeltaArrival);
+    this->tsDeltaArrival = 0;
+    this->tsActuation = 0;
+    this->actuatedFields = 0;
+  }
+  portEXIT_CRITICAL(&this->mux);
+}
+
+/**
+ * Count a publish of the load, the current step starts with its first publish
+ *
+ * NOTE: The load is only driven by the network task
+ *
+ * @param isSent True if the message was published
+ * @param length The message's length
+ */
+void SoakBench::recordLoadPublish(bool isSent, size_t length) {
+  BenchRateStep &current = this->currentStep;
+  if (current.nAttempted == 0) {
+    current.rate = BENCH_PUBLISH_RATES[this->step];
+    this->tsStepStart = millis();
+  }
+  current.nAttempted++;
+  if (isSent) {
+    current.nSent++;
+    current.nBytes += length;
+  }
+}
+
+/**
+ * Get the interval between the publishes of the current step
+ *
+ * @return The interval in milliseconds
+ */
+unsigned long SoakBench::loadInterval() {
+  return 1000 / BENCH_PUBLISH_RATES[this->step];
+}
+
+/**
+ * Move the load to the next rate once the current step has lasted for
+ * BENCH_RATE_STEP_DURATION, the rates start over after the last step so the
+ * load keeps cycling during the soak
+ *
+ * @return True if the rate has changed
+ */
+bool SoakBench::advanceLoad() {
+  BenchRateStep &current = this->currentStep;
+  unsigned long elapsed = millis() - this->tsStepStart;
+  if (current.nAttempted == 0 || elapsed < BENCH_RATE_STEP_DURATION) {
+    return false;
+  }
+  current.duration = elapsed;
+  this->steps[this->step] = current;
+  current = {};
+  this->step = (this->step + 1) % BENCH_RATE_STEPS;
+  if (this->step == 0) {
+    this->nCycles++;
+  }
+  this->sampleHeap();
+  return true;
+}
+
+/**
+ * Track the heap's worst fragmentation since boot
+ */
+void SoakBench::sampleHeap() {
+  uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  this->maxFragmentation = fmaxf(this->maxFragmentation,
+                                 heapFragmentation(freeHeap, largestBlock));
+  if (largestBlock < this->minLargestBlock) {
+    this->minLargestBlock = largestBlock;
+  }
+}
+
+/**
+ * Write the percentiles of every latency, the last result of every rate of the
+ * load, and the heap's fragmentation into the given object, then reset the
+ * latencies
+ *
+ * @param benchObj The object that receives the results
+ */
+void SoakBench::report(JsonObject benchObj) {
+  JsonObject latencyObj = benchObj.createNestedObject("latency");
+  for (int i = 0; i < BENCH_LATENCY_COUNT; i++) {
+    LatencyReservoir reservoir;
+    portENTER_CRITICAL(&this->mux);
+    reservoir = this->reservoirs[i];
+    this->reservoirs[i] = {};
+    portEXIT_CRITICAL(&this->mux);
+    if (reservoir.count == 0) {
+      continue;
+    }
+
+    uint32_t n = std::min(reservoir.count, (uint32_t)BENCH_LATENCY_SAMPLES);
+    std::sort(reservoir.samples, reservoir.samples + n);
+    // nearest-rank percentiles
+    JsonObject percentilesObj = latencyObj.createNestedObject(LATENCY_NAMES[i]);
+    percentilesObj["n"] = reservoir.count;
+    percentilesObj["p50"] = reservoir.samples[(n * 50 + 99) / 100 - 1];
+    percentilesObj["p99"] = reservoir.samples[(n * 99 + 99) / 100 - 1];
+    percentilesObj["max"] = reservoir.maxMicros;
+  }
+
+  JsonArray loadArr = benchObj.createNestedArray("load");
+  for (int i = 0; i < BENCH_RATE_STEPS; i++) {
+    const BenchRateStep &step = this->steps[i];
+    if (step.duration == 0) {
+      continue;
+    }
+    JsonObject stepObj = loadArr.createNestedObject();
+    stepObj["rate"] = step.rate;
+    stepObj["attempted"] = step.nAttempted;
+    stepObj["sent"] = step.nSent;
+    stepObj["sentRate"] = step.nSent * 1000.0f / step.duration;
+    stepObj["bytesRate"] = step.nBytes * 1000.0f / step.duration;
+  }
+  benchObj["loadCycles"] = this->nCycles;
+
+  this->sampleHeap();
+  uint32_t freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  uint32_t largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  JsonObject heapObj = benchObj.createNestedObject("heap");
+  heapObj["free"] = freeHeap;
+  heapObj["largestBlock"] = largestBlock;
+  heapObj["fragmentation"] = heapFragmentation(freeHeap, largestBlock);
+  heapObj["maxFragmentation"] = this->maxFragmentation;
+  heapObj["minLargestBlock"] = this->minLargestBlock;
+  heapObj["minFree"] = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+}
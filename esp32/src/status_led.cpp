@@ -0,0 +1,66 @@
+#include "status_led.h"
+
+#include <Arduino.h>
+
+StatusLed::StatusLed(int pinID) { this->pinID = pinID; }
+
+/**
+ * Set up the task that runs the queued blink patterns. The task is only enabled
+ * while there are patterns to be run
+ *
+ * @param scheduler The scheduler that will run the task
+ */
+void StatusLed::begin(Scheduler &scheduler) {
+  this->taskBlink.set(TASK_IMMEDIATE, TASK_FOREVER, [this]() { this->step(); });
+  scheduler.addTask(this->taskBlink);
+}
+
+/**
+ * Queue a blink pattern, the pattern is run after every previously queued
+ * pattern has finished.
+ *
+ * NOTE: The pattern is dropped if STATUS_LED_QUEUE_SIZE patterns are queued
+ *
+ * @param onDuration Number of milliseconds that the pin is put on HIGH
+ * @param offDuration Number of milliseconds that the pin is put on LOW
+ * @param n Number of cycles
+ * @return True if the pattern is queued
+ */
+bool StatusLed::blink(int onDuration, int offDuration, int n) {
+  if (n <= 0 || this->patternsCount >= STATUS_LED_QUEUE_SIZE) {
+    return false;
+  }
+  int tail = (this->patternsHead + this->patternsCount) % STATUS_LED_QUEUE_SIZE;
+  this->patterns[tail] = {onDuration, offDuration, n};
+  this->patternsCount++;
+  if (!this->taskBlink.isEnabled()) {
+    this->taskBlink.enable();
+  }
+  return true;
+}
+
+/**
+ * Advance the current pattern by one edge and wait for the duration of the new
+ * pin's state before the next edge. The task disables itself once the queue is
+ * empty
+ */
+void StatusLed::step() {
+  BlinkPattern &pattern = this->patterns[this->patternsHead];
+  if (!this->isOn) {
+    digitalWrite(this->pinID, HIGH);
+    this->isOn = true;
+    this->taskBlink.setInterval(pattern.onDuration);
+    return;
+  }
+
+  digitalWrite(this->pinID, LOW);
+  this->isOn = false;
+  this->taskBlink.setInterval(pattern.offDuration);
+  if (--pattern.n > 0) {
+    return;
+  }
+  this->patternsHead = (this->patternsHead + 1) % STATUS_LED_QUEUE_SIZE;
+  if (--this->patternsCount == 0) {
+    this->taskBlink.disable();
+  }
+}
@@ -0,0 +1,173 @@
+#include "telemetry_buffer.h"
+
+#include "FS.h"
+#include "SPIFFS.h"
+
+static const uint32_t TELEMETRY_BUFFER_MAGIC = 0x48484254;  // "HHBT"
+static const uint16_t TELEMETRY_BUFFER_VERSION = 3;
+
+/**
+ * Header that is stored at the beginning of the buffer's file, the record's
+ * size changes with the number of zones
+ */
+struct __attribute__((packed)) TelemetryBufferHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recordSize;
+  uint16_t capacity;
+  uint16_t head;
+  uint16_t count;
+};
+
+TelemetryBuffer::TelemetryBuffer(const String &path, uint16_t capacity) {
+  this->path = path;
+  this->capacity = capacity;
+}
+
+/**
+ * Load the buffer's position from its file, the file is recreated if it does
+ * not exist or was created with a different layout.
+ *
+ * NOTE: SPIFFS must be started before calling this method
+ *
+ * @return True if the buffer can be used
+ */
+bool TelemetryBuffer::begin() {
+  File f = SPIFFS.open(this->path, "r");
+  if (f) {
+    TelemetryBufferHeader header;
+    bool isValid =
+        f.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+        header.magic == TELEMETRY_BUFFER_MAGIC &&
+        header.version == TELEMETRY_BUFFER_VERSION &&
+        header.recordSize == sizeof(SensorsRecord) &&
+        header.capacity == this->capacity && header.head < this->capacity &&
+        header.count <= this->capacity;
+    f.close();
+    if (isValid) {
+      this->head = header.head;
+      this->count = header.count;
+      return true;
+    }
+  }
+  return this->format();
+}
+
+/**
+ * Create an empty buffer's file with space for every record
+ *
+ * @return True if the file is created
+ */
+bool TelemetryBuffer::format() {
+  File f = SPIFFS.open(this->path, "w");
+  if (!f) {
+    return false;
+  }
+  this->head = 0;
+  this->count = 0;
+
+  TelemetryBufferHeader header = {
+      TELEMETRY_BUFFER_MAGIC, TELEMETRY_BUFFER_VERSION, sizeof(SensorsRecord),
+      this->capacity,         this->head,               this->count};
+  bool isWritten =
+      f.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  SensorsRecord emptyRecord = {};
+  for (uint16_t i = 0; isWritten && i < this->capacity; i++) {
+    isWritten = f.write((const uint8_t *)&emptyRecord, sizeof(emptyRecord)) ==
+                sizeof(emptyRecord);
+  }
+  f.close();
+  return isWritten;
+}
+
+/**
+ * Write a record at the given slot, then update the header with the buffer's
+ * current position
+ *
+ * @param slot Index of the record's slot
+ * @param record The record to be written
+ * @return True if the record and the header are written
+ */
+bool TelemetryBuffer::writeRecord(uint16_t slot, const SensorsRecord &record) {
+  File f = SPIFFS.open(this->path, "r+");
+  if (!f) {
+    return false;
+  }
+  TelemetryBufferHeader header = {
+      TELEMETRY_BUFFER_MAGIC, TELEMETRY_BUFFER_VERSION, sizeof(SensorsRecord),
+      this->capacity,         this->head,               this->count};
+  bool isWritten =
+      f.seek(sizeof(header) + slot * sizeof(record)) &&
+      f.write((const uint8_t *)&record, sizeof(record)) == sizeof(record) &&
+      f.seek(0) &&
+      f.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  f.close();
+  return isWritten;
+}
+
+/**
+ * Append a record to the buffer, the oldest record is overwritten if the buffer
+ * is full
+ *
+ * @param record The record to be appended
+ * @return True if the record is stored
+ */
+bool TelemetryBuffer::push(const SensorsRecord &record) {
+  uint16_t slot = (this->head + this->count) % this->capacity;
+  if (this->count == this->capacity) {
+    this->head = (this->head + 1) % this->capacity;
+  } else {
+    this->count++;
+  }
+  return this->writeRecord(slot, record);
+}
+
+/**
+ * Read the oldest record without removing it from the buffer
+ *
+ * @param record Destination of the read record
+ * @return True if a record is read
+ */
+bool TelemetryBuffer::peek(SensorsRecord &record) {
+  if (this->count == 0) {
+    return false;
+  }
+  File f = SPIFFS.open(this->path, "r");
+  if (!f) {
+    return false;
+  }
+  bool isRead =
+      f.seek(sizeof(TelemetryBufferHeader) + this->head * sizeof(record)) &&
+      f.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+  f.close();
+  return isRead;
+}
+
+/**
+ * Remove the oldest record from the buffer
+ *
+ * @return True if a record is removed
+ */
+bool TelemetryBuffer::pop() {
+  if (this->count == 0) {
+    return false;
+  }
+  this->head = (this->head + 1) % this->capacity;
+  this->count--;
+
+  File f = SPIFFS.open(this->path, "r+");
+  if (!f) {
+    return false;
+  }
+  TelemetryBufferHeader header = {
+      TELEMETRY_BUFFER_MAGIC, TELEMETRY_BUFFER_VERSION, sizeof(SensorsRecord),
+      this->capacity,         this->head,               this->count};
+  bool isWritten =
+      f.write((const uint8_t *)&header, sizeof(header)) == sizeof(header);
+  f.close();
+  return isWritten;
+}
+
+uint16_t TelemetryBuffer::size() { return this->count; }
+
+bool TelemetryBuffer::isEmpty() { return this->count == 0; }
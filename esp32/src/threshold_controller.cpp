@@ -0,0 +1,100 @@
+#include "threshold_controller.h"
+
+ThresholdController::ThresholdController(float band, unsigned long minDwell,
+                                         bool isCompensated,
+                                         unsigned long settleTime) {
+  this->band = band;
+  this->minDwell = minDwell;
+  this->isCompensated = isCompensated;
+  this->settleTime = settleTime;
+}
+
+/**
+ * Take the actuator's current state as the controller's state, the minimum
+ * dwell time does not apply to the next change
+ *
+ * @param isActive True if the actuator is currently active
+ */
+void ThresholdController::reset(bool isActive) {
+  this->isActive = isActive;
+  this->hasSwitched = false;
+  this->isEstimating = false;
+  this->activeOffset = 0;
+}
+
+/**
+ * Copy the controller's state so it can be kept while the MCU is in deep sleep
+ *
+ * @param state Receives the controller's state
+ */
+void ThresholdController::saveState(ThresholdControllerState &state) {
+  state.isActive = this->isActive;
+  state.activeOffset = this->activeOffset;
+}
+
+/**
+ * Restore the controller's state after waking up from deep sleep, the time of
+ * the last change is lost so the minimum dwell time does not apply to the next
+ * change
+ *
+ * @param state The state that was saved before entering deep sleep
+ */
+void ThresholdController::restoreState(const ThresholdControllerState &state) {
+  this->reset(state.isActive);
+  this->activeOffset = state.activeOffset;
+}
+
+/**
+ * Feed a sample to the controller
+ *
+ * @param value The measured value, invalid samples are ignored
+ * @param tsSample The time at which the value was measured
+ * @param threshold The value below which the actuator has to be active
+ * @return True if the actuator has to change its state
+ */
+bool ThresholdController::update(float value, unsigned long tsSample,
+                                 float threshold) {
+  if (isnan(value)) {
+    return false;
+  }
+  unsigned long now = millis();
+  // wait for a sample that was taken after the actuator became active
+  if (this->isEstimating &&
+      (long)(tsSample - this->tsSwitched) >= (long)this->settleTime) {
+    this->activeOffset = max(0.0f, value - this->valueAtSwitch);
+    this->isEstimating = false;
+  }
+  if (this->isEstimating) {
+    return false;
+  }
+
+  bool shouldBeActive;
+  if (this->isActive) {
+    shouldBeActive = value - this->activeOffset <= threshold + this->band;
+  } else {
+    shouldBeActive = value < threshold;
+  }
+  if (shouldBeActive == this->isActive) {
+    return false;
+  }
+  if (this->hasSwitched && now - this->tsSwitched < this->minDwell) {
+    return false;
+  }
+
+  this->isActive = shouldBeActive;
+  this->hasSwitched = true;
+  this->tsSwitched = now;
+  this->activeOffset = 0;
+  if (this->isActive && this->isCompensated) {
+    this->isEstimating = true;
+    this->valueAtSwitch = value;
+  }
+  return true;
+}
+
+/**
+ * Check if the actuator has to be active
+ *
+ * @return True if the actuator has to be active
+ */
+bool ThresholdController::active() { return this->isActive; }
@@ -0,0 +1,70 @@
+#include "wifi_fast_connect.h"
+
+#include <WiFi.h>
+
+#include "constants.h"
+
+static const uint32_t WIFI_CONNECTION_CACHE_MAGIC = 0x48485743;  // "HHWC"
+
+RTC_DATA_ATTR static WiFiConnectionCache wifiConnectionCache;
+
+/**
+ * Wait until the station is connected to the access point
+ *
+ * @param timeout Number of milliseconds to wait, 0 to wait forever
+ * @return True if the station is connected
+ */
+static bool waitForWiFi(unsigned long timeout) {
+  unsigned long tsStart = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (timeout != 0 && millis() - tsStart >= timeout) {
+      return false;
+    }
+    delay(10);
+  }
+  return true;
+}
+
+/**
+ * Connect to the access point with the given credentials. If the parameters of
+ * a previous association are cached, the station joins the same BSSID on the
+ * same channel with the same IP configuration, which skips the channel scan
+ * and the DHCP exchange. If that fails, the cache is dropped and the station
+ * falls back to a full scan with DHCP, then the new parameters are cached.
+ *
+ * NOTE: The fallback path blocks until the station is connected
+ *
+ * @param ssid The access point's SSID
+ * @param password The access point's password
+ * @return True if connected using the cached parameters
+ */
+bool connectWiFi(const char *ssid, const char *password) {
+  WiFiConnectionCache &cache = wifiConnectionCache;
+  if (cache.magic == WIFI_CONNECTION_CACHE_MAGIC) {
+    WiFi.config(IPAddress(cache.localIP), IPAddress(cache.gatewayIP),
+                IPAddress(cache.subnetMask), IPAddress(cache.dnsIP));
+    WiFi.begin(ssid, password, cache.channel, cache.bssid);
+    if (waitForWiFi(WIFI_FAST_CONNECT_TIMEOUT)) {
+      return true;
+    }
+    invalidateWiFiConnectionCache();
+    WiFi.disconnect();
+    // an unset local IP makes the station use DHCP again
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0),
+                IPAddress((uint32_t)0));
+  }
+
+  WiFi.begin(ssid, password);
+  waitForWiFi(0);
+
+  cache.channel = WiFi.channel();
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.localIP = WiFi.localIP();
+  cache.gatewayIP = WiFi.gatewayIP();
+  cache.subnetMask = WiFi.subnetMask();
+  cache.dnsIP = WiFi.dnsIP();
+  cache.magic = WIFI_CONNECTION_CACHE_MAGIC;
+  return false;
+}
+
+void invalidateWiFiConnectionCache() { wifiConnectionCache.magic = 0; }
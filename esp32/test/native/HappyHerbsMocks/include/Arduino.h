@@ -0,0 +1,116 @@
+#ifndef MOCK_ARDUINO_H_
+#define MOCK_ARDUINO_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+typedef uint8_t byte;
+
+#define constrain(amt, low, high) \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+/**
+ * Stand-in for the Arduino core's string, only the operations that are used by
+ * the firmware and by ArduinoJson are provided
+ */
+class String {
+ private:
+  std::string str;
+
+ public:
+  String(const char *cstr = "") : str(cstr ? cstr : "") {}
+  String(const std::string &str) : str(str) {}
+
+  const char *c_str() const { return this->str.c_str(); }
+  unsigned int length() const { return this->str.length(); }
+  bool concat(const char *cstr) {
+    this->str += cstr;
+    return true;
+  }
+  bool concat(char c) {
+    this->str += c;
+    return true;
+  }
+  String &operator+=(const String &rhs) {
+    this->str += rhs.str;
+    return *this;
+  }
+  bool operator==(const String &rhs) const { return this->str == rhs.str; }
+  bool operator!=(const String &rhs) const { return this->str != rhs.str; }
+};
+
+/**
+ * The result of concatenating strings, ArduinoJson expects it to be a string
+ */
+class StringSumHelper : public String {
+ public:
+  StringSumHelper(const String &str) : String(str) {}
+};
+
+inline StringSumHelper operator+(const String &lhs, const String &rhs) {
+  String sum(lhs);
+  sum += rhs;
+  return sum;
+}
+
+/**
+ * Stand-in for the Arduino core's output stream
+ */
+class Print {
+ private:
+  int writeError = 0;
+
+ protected:
+  void setWriteError(int err = 1) { this->writeError = err; }
+
+ public:
+  virtual ~Print() {}
+  int getWriteError() { return this->writeError; }
+  void clearWriteError() { this->setWriteError(0); }
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+      n += this->write(*buffer++);
+    }
+    return n;
+  }
+};
+
+class Stream : public Print {};
+
+/**
+ * The CPU's cycle counter is emulated with the host's monotonic clock
+ */
+class EspClass {
+ public:
+  uint32_t getCycleCount();
+  uint32_t getCpuFreqMHz() { return 240; }
+};
+
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t);
+void pinMode(uint8_t, uint8_t);
+void digitalWrite(uint8_t, uint8_t);
+int digitalRead(uint8_t);
+uint32_t esp_random();
+bool getLocalTime(struct tm *, uint32_t = 5000);
+
+#endif  // MOCK_ARDUINO_H_
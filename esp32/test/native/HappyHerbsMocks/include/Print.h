@@ -0,0 +1,6 @@
+#ifndef MOCK_PRINT_H_
+#define MOCK_PRINT_H_
+
+#include "Arduino.h"
+
+#endif  // MOCK_PRINT_H_
@@ -0,0 +1,45 @@
+#ifndef MOCK_PUBSUBCLIENT_H_
+#define MOCK_PUBSUBCLIENT_H_
+
+#include <Arduino.h>
+
+#include <string>
+
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+/**
+ * Stand-in for the MQTT client that is always connected and keeps every
+ * published message's size instead of sending it, so the benchmarks can count
+ * the bytes that an event causes to be published
+ */
+class PubSubClient : public Print {
+ private:
+  std::string publishTopic;
+  std::string publishPayload;
+  bool isPublishing = false;
+
+  void recordPublish(const std::string &, const std::string &);
+
+ public:
+  bool isConnected = true;
+  size_t nPublished = 0;
+  size_t nPublishedBytes = 0;
+  size_t maxPublishedBytes = 0;
+  std::string lastTopic;
+  std::string lastPayload;
+
+  bool connect(const char *);
+  bool connected();
+  bool loop();
+  int state();
+  bool subscribe(const char *, uint8_t = 0);
+
+  bool publish(const char *, const char *);
+  bool beginPublish(const char *, unsigned int, bool);
+  size_t write(uint8_t) override;
+  size_t write(const uint8_t *, size_t) override;
+  int endPublish();
+};
+
+#endif  // MOCK_PUBSUBCLIENT_H_
@@ -0,0 +1,13 @@
+#ifndef MOCK_TASK_SCHEDULER_DECLARATIONS_H_
+#define MOCK_TASK_SCHEDULER_DECLARATIONS_H_
+
+// The service does not schedule any task by itself, the benchmarks call its
+// methods directly
+class Scheduler {};
+
+class Task {
+ public:
+  Task() {}
+};
+
+#endif  // MOCK_TASK_SCHEDULER_DECLARATIONS_H_
@@ -0,0 +1,6 @@
+#ifndef MOCK_WSTRING_H_
+#define MOCK_WSTRING_H_
+
+#include "Arduino.h"
+
+#endif  // MOCK_WSTRING_H_
@@ -0,0 +1,11 @@
+#ifndef MOCK_WIRE_H_
+#define MOCK_WIRE_H_
+
+#include <Arduino.h>
+
+// The I2C bus is never accessed, the light sensor's readings are mocked
+class TwoWire {};
+
+extern TwoWire Wire;
+
+#endif  // MOCK_WIRE_H_
@@ -0,0 +1,11 @@
+#ifndef MOCK_DRIVER_ADC_H_
+#define MOCK_DRIVER_ADC_H_
+
+#include "esp_err.h"
+
+typedef enum {
+  ADC1_CHANNEL_0 = 0,
+  ADC1_CHANNEL_MAX = 10,
+} adc1_channel_t;
+
+#endif  // MOCK_DRIVER_ADC_H_
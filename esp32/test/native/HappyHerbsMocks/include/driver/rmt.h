@@ -0,0 +1,18 @@
+#ifndef MOCK_DRIVER_RMT_H_
+#define MOCK_DRIVER_RMT_H_
+
+#include "esp_err.h"
+
+typedef enum {
+  GPIO_NUM_0 = 0,
+  GPIO_NUM_MAX = 48,
+} gpio_num_t;
+
+typedef enum {
+  RMT_CHANNEL_0 = 0,
+  RMT_CHANNEL_MAX = 8,
+} rmt_channel_t;
+
+typedef void *RingbufHandle_t;
+
+#endif  // MOCK_DRIVER_RMT_H_
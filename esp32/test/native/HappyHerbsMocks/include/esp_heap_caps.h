@@ -0,0 +1,14 @@
+#ifndef MOCK_ESP_HEAP_CAPS_H_
+#define MOCK_ESP_HEAP_CAPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+// The host's heap is not measured, every size is reported as 0
+inline size_t heap_caps_get_free_size(uint32_t) { return 0; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return 0; }
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return 0; }
+
+#endif  // MOCK_ESP_HEAP_CAPS_H_
@@ -0,0 +1,31 @@
+#ifndef MOCK_ESP_TIMER_H_
+#define MOCK_ESP_TIMER_H_
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *);
+
+typedef enum {
+  ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+  esp_timer_cb_t callback;
+  void *arg;
+  esp_timer_dispatch_t dispatch_method;
+  const char *name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+// Timers are created and armed but never fire on the host
+esp_err_t esp_timer_create(const esp_timer_create_args_t *,
+                           esp_timer_handle_t *);
+esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t, uint64_t);
+esp_err_t esp_timer_stop(esp_timer_handle_t);
+int64_t esp_timer_get_time();
+
+#endif  // MOCK_ESP_TIMER_H_
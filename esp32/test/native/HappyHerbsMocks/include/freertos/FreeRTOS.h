@@ -0,0 +1,23 @@
+#ifndef MOCK_FREERTOS_H_
+#define MOCK_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+
+// The benchmarks run on a single thread, so critical sections do nothing
+typedef struct {
+  int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+#endif  // MOCK_FREERTOS_H_
@@ -0,0 +1,12 @@
+#ifndef MOCK_FREERTOS_QUEUE_H_
+#define MOCK_FREERTOS_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct QueueDefinition *QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+BaseType_t xQueueSend(QueueHandle_t, const void *, TickType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void *, TickType_t);
+
+#endif  // MOCK_FREERTOS_QUEUE_H_
@@ -0,0 +1,10 @@
+#ifndef MOCK_FREERTOS_TASK_H_
+#define MOCK_FREERTOS_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 0; }
+
+#endif  // MOCK_FREERTOS_TASK_H_
@@ -0,0 +1,11 @@
+#ifndef MOCK_HARDWARE_H_
+#define MOCK_HARDWARE_H_
+
+// Readings that the mocked sensors give, a conversion always succeeds right
+// away with these values
+extern float mockLux;
+extern float mockTemperature;
+extern float mockHumidity;
+extern float mockMoisture;
+
+#endif  // MOCK_HARDWARE_H_
@@ -0,0 +1,77 @@
+#include "PubSubClient.h"
+
+bool PubSubClient::connect(const char *) { return this->isConnected; }
+
+bool PubSubClient::connected() { return this->isConnected; }
+
+bool PubSubClient::loop() { return this->isConnected; }
+
+int PubSubClient::state() {
+  return this->isConnected ? MQTT_CONNECTED : MQTT_DISCONNECTED;
+}
+
+bool PubSubClient::subscribe(const char *, uint8_t) {
+  return this->isConnected;
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload) {
+  if (!this->isConnected) {
+    return false;
+  }
+  this->recordPublish(topic, payload);
+  return true;
+}
+
+bool PubSubClient::beginPublish(const char *topic, unsigned int length,
+                                bool) {
+  if (!this->isConnected) {
+    return false;
+  }
+  this->publishTopic = topic;
+  this->publishPayload.clear();
+  this->publishPayload.reserve(length);
+  this->isPublishing = true;
+  return true;
+}
+
+size_t PubSubClient::write(uint8_t c) {
+  if (!this->isPublishing) {
+    return 0;
+  }
+  this->publishPayload += (char)c;
+  return 1;
+}
+
+size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
+  if (!this->isPublishing) {
+    return 0;
+  }
+  this->publishPayload.append((const char *)buffer, size);
+  return size;
+}
+
+int PubSubClient::endPublish() {
+  if (!this->isPublishing) {
+    return 0;
+  }
+  this->isPublishing = false;
+  this->recordPublish(this->publishTopic, this->publishPayload);
+  return 1;
+}
+
+/**
+ * Keep the size and the content of a published message
+ *
+ * @param topic The message's topic
+ * @param payload The message's payload
+ */
+void PubSubClient::recordPublish(const std::string &topic,
+                                 const std::string &payload) {
+  this->nPublished++;
+  this->nPublishedBytes += payload.size();
+  if (payload.size() > this->maxPublishedBytes) {
+    this->maxPublishedBytes = payload.size();
+  }
+  this->lastTopic = topic;
+  this->lastPayload = payload;
+}
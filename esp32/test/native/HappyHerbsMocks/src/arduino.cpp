@@ -0,0 +1,86 @@
+#include <Arduino.h>
+#include <Wire.h>
+#include <esp_timer.h>
+
+#include <chrono>
+#include <random>
+
+EspClass ESP;
+TwoWire Wire;
+
+static const std::chrono::steady_clock::time_point tsBoot =
+    std::chrono::steady_clock::now();
+static const int GPIO_PINS_COUNT = 64;
+static uint8_t pinLevels[GPIO_PINS_COUNT];
+static std::mt19937 randomEngine;
+
+static int64_t nanosSinceBoot() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - tsBoot)
+      .count();
+}
+
+uint32_t EspClass::getCycleCount() {
+  return (uint32_t)(nanosSinceBoot() * this->getCpuFreqMHz() / 1000);
+}
+
+unsigned long millis() { return nanosSinceBoot() / 1000000; }
+
+unsigned long micros() { return nanosSinceBoot() / 1000; }
+
+void delay(uint32_t ms) {
+  unsigned long tsStart = millis();
+  while (millis() - tsStart < ms) {
+  }
+}
+
+void pinMode(uint8_t, uint8_t) {}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  if (pin < GPIO_PINS_COUNT) {
+    pinLevels[pin] = level;
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < GPIO_PINS_COUNT && pinLevels[pin] ? HIGH : LOW;
+}
+
+uint32_t esp_random() { return randomEngine(); }
+
+bool getLocalTime(struct tm *info, uint32_t) {
+  time_t now = time(nullptr);
+  localtime_r(&now, info);
+  return true;
+}
+
+/**
+ * A timer that is armed but never fires
+ */
+struct esp_timer {
+  esp_timer_create_args_t args;
+  bool isArmed;
+};
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *handle) {
+  *handle = new esp_timer{*args, false};
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t) {
+  timer->isArmed = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t) {
+  timer->isArmed = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  timer->isArmed = false;
+  return ESP_OK;
+}
+
+int64_t esp_timer_get_time() { return nanosSinceBoot() / 1000; }
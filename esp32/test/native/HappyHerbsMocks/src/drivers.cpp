@@ -0,0 +1,135 @@
+#include <stdarg.h>
+
+#include "async_sensors.h"
+#include "logging.h"
+#include "mock_hardware.h"
+#include "moisture_sensor.h"
+#include "status_led.h"
+#include "telemetry_buffer.h"
+
+float mockLux = 100.0;
+float mockTemperature = 25.0;
+float mockHumidity = 50.0;
+float mockMoisture = 40.0;
+
+AsyncBH1750::AsyncBH1750(uint8_t address, TwoWire &wire) {
+  this->address = address;
+  this->wire = &wire;
+}
+
+bool AsyncBH1750::begin() { return true; }
+
+bool AsyncBH1750::startConversion() {
+  this->isConverting = true;
+  return true;
+}
+
+ConversionStatus AsyncBH1750::pollConversion(float &lux) {
+  if (!this->isConverting) {
+    return CONVERSION_IDLE;
+  }
+  this->isConverting = false;
+  lux = mockLux;
+  return CONVERSION_DONE;
+}
+
+AsyncDHT::AsyncDHT(int pin, int channel, DHTType type) {
+  this->pin = (gpio_num_t)pin;
+  this->channel = (rmt_channel_t)channel;
+  this->type = type;
+}
+
+bool AsyncDHT::begin() { return true; }
+
+bool AsyncDHT::startConversion() {
+  this->isConverting = true;
+  return true;
+}
+
+ConversionStatus AsyncDHT::pollConversion(float &temperature,
+                                          float &humidity) {
+  if (!this->isConverting) {
+    return CONVERSION_IDLE;
+  }
+  this->isConverting = false;
+  temperature = mockTemperature;
+  humidity = mockHumidity;
+  return CONVERSION_DONE;
+}
+
+MoistureSensor::MoistureSensor(const int *channels, const int *zones,
+                               int nChannels, int rawDry, int rawWet) {
+  this->nChannels = constrain(nChannels, 0, HH_MOISTURE_PROBE_COUNT);
+  for (int i = 0; i < this->nChannels; i++) {
+    this->channels[i] = (adc1_channel_t)channels[i];
+    this->zones[i] = zones[i];
+  }
+  this->setCalibration(rawDry, rawWet);
+}
+
+bool MoistureSensor::begin(unsigned long) { return true; }
+
+void MoistureSensor::setCalibration(int rawDry, int rawWet) {
+  this->rawDry = rawDry;
+  this->rawWet = rawWet;
+}
+
+int MoistureSensor::readRaw(int channel) {
+  if (channel < 0 || channel >= this->nChannels) {
+    return -1;
+  }
+  return this->rawDry + (this->rawWet - this->rawDry) * mockMoisture / 100;
+}
+
+float MoistureSensor::readPercent(int channel) {
+  if (channel < 0 || channel >= this->nChannels) {
+    return NAN;
+  }
+  return mockMoisture;
+}
+
+float MoistureSensor::readZonePercent(int zone) {
+  for (int i = 0; i < this->nChannels; i++) {
+    if (this->zones[i] == zone) {
+      return mockMoisture;
+    }
+  }
+  return NAN;
+}
+
+StatusLed::StatusLed(int pinID) { this->pinID = pinID; }
+
+void StatusLed::begin(Scheduler &) {}
+
+bool StatusLed::blink(int, int, int) { return true; }
+
+// Nothing is buffered on the host, the benchmarks are always connected
+TelemetryBuffer::TelemetryBuffer(const String &path, uint16_t capacity) {
+  this->path = path;
+  this->capacity = capacity;
+}
+
+bool TelemetryBuffer::begin() { return true; }
+
+bool TelemetryBuffer::push(const SensorsRecord &) { return false; }
+
+bool TelemetryBuffer::peek(SensorsRecord &) { return false; }
+
+bool TelemetryBuffer::pop() { return false; }
+
+uint16_t TelemetryBuffer::size() { return 0; }
+
+bool TelemetryBuffer::isEmpty() { return true; }
+
+bool logBegin() { return true; }
+
+void logPrintf(char level, const char *format, ...) {
+  char line[LOG_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  printf("[%c] %s\n", level, line);
+}
+
+void logFlush() { fflush(stdout); }
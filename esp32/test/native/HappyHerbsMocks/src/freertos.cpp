@@ -0,0 +1,37 @@
+#include <freertos/queue.h>
+#include <string.h>
+
+#include <deque>
+#include <vector>
+
+/**
+ * A bounded queue of fixed sized items, items are copied in and out as in
+ * FreeRTOS
+ */
+struct QueueDefinition {
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  std::deque<std::vector<uint8_t>> items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  return new QueueDefinition{length, itemSize, {}};
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t) {
+  if (queue->items.size() >= queue->length) {
+    return pdFALSE;
+  }
+  const uint8_t *bytes = static_cast<const uint8_t *>(item);
+  queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t) {
+  if (queue->items.empty()) {
+    return pdFALSE;
+  }
+  memcpy(item, queue->items.front().data(), queue->itemSize);
+  queue->items.pop_front();
+  return pdTRUE;
+}
@@ -0,0 +1,317 @@
+#include <ArduinoJson.h>
+#include <unity.h>
+
+#include <chrono>
+
+#include "happy_herbs.h"
+#include "mock_hardware.h"
+
+/**
+ * Replays recorded shadow traffic through HappyHerbsService::handleCallback
+ * and reports, for every kind of message, the time taken to parse and dispatch
+ * it, the bytes that the device publishes in reaction, and the peak memory of
+ * the JSON documents. The recordings are templates whose version, timestamp
+ * and values are filled in on every replay, so each message is applied as a
+ * new one and the version never skips
+ */
+
+static const char *const THING_NAME = "bench";
+static const int N_REPLAYS = 1000;
+
+// $aws/things/{thing}/shadow/update/delta, the tokens are filled in by
+// fillRecording, $V is the version, $T the timestamp, $L the lamp's state and
+// $H the light threshold
+static const char *const RECORDED_UPDATE_DELTA =
+    "{\"version\":$V,\"timestamp\":$T,\"state\":{\"lampState\":$L,"
+    "\"lightThreshold\":$H},\"metadata\":{\"lampState\":{\"timestamp\":$T},"
+    "\"lightThreshold\":{\"timestamp\":$T}}}";
+
+// $aws/things/{thing}/shadow/get/accepted, only the delta and the desired
+// metadata pass the service's filter
+static const char *const RECORDED_GET_ACCEPTED =
+    "{\"state\":{\"desired\":{\"lampState\":$L,\"pumpState\":false,"
+    "\"lightThreshold\":$H,\"moistureThreshold\":30,\"luxDeadband\":10,"
+    "\"moistureDeadband\":2,\"temperatureDeadband\":0.5,"
+    "\"humidityDeadband\":2},\"reported\":{\"lampState\":false,"
+    "\"pumpState\":false,\"lightThreshold\":100,\"moistureThreshold\":30,"
+    "\"luxDeadband\":10,\"moistureDeadband\":2,\"temperatureDeadband\":0.5,"
+    "\"humidityDeadband\":2},\"delta\":{\"lampState\":$L,"
+    "\"lightThreshold\":$H}},\"metadata\":{\"desired\":{\"lampState\":{"
+    "\"timestamp\":$T},\"pumpState\":{\"timestamp\":$T},"
+    "\"lightThreshold\":{\"timestamp\":$T},\"moistureThreshold\":{"
+    "\"timestamp\":$T},\"luxDeadband\":{\"timestamp\":$T},"
+    "\"moistureDeadband\":{\"timestamp\":$T},\"temperatureDeadband\":{"
+    "\"timestamp\":$T},\"humidityDeadband\":{\"timestamp\":$T}},"
+    "\"reported\":{\"lampState\":{\"timestamp\":$T},\"pumpState\":{"
+    "\"timestamp\":$T},\"lightThreshold\":{\"timestamp\":$T},"
+    "\"moistureThreshold\":{\"timestamp\":$T}}},\"version\":$V,"
+    "\"timestamp\":$T}";
+
+// $aws/things/{thing}/shadow/update/accepted for an update of another client,
+// it carries no client token of this device
+static const char *const RECORDED_OTHER_UPDATE_ACCEPTED =
+    "{\"state\":{\"reported\":{\"lampState\":$L,\"lightThreshold\":$H}},"
+    "\"metadata\":{\"reported\":{\"lampState\":{\"timestamp\":$T},"
+    "\"lightThreshold\":{\"timestamp\":$T}}},\"version\":$V,"
+    "\"timestamp\":$T}";
+
+/**
+ * What was measured for one kind of message
+ */
+struct BenchResult {
+  const char *name;
+  int nEvents;
+  int64_t totalNanos;
+  int64_t maxNanos;
+  size_t nPublished;
+  size_t nPublishedBytes;
+};
+
+PubSubClient pubsubClient;
+AsyncBH1750 lightSensorBH1750(HH_I2C_BH1750_ADDR);
+AsyncDHT tempHumidSensorDHT(HH_GPIO_DHT, HH_RMT_CHANNEL_DHT, DHT_TYPE_DHT11);
+MoistureSensor moistureSensor(HH_ADC1_CHANNELS_MOISTURE,
+                              HH_MOISTURE_PROBE_ZONES, HH_MOISTURE_PROBE_COUNT,
+                              MOISTURE_RAW_DRY, MOISTURE_RAW_WET);
+HappyHerbsState hhState(lightSensorBH1750, tempHumidSensorDHT, HH_GPIO_LAMP,
+                        HH_GPIO_PUMPS, moistureSensor);
+HappyHerbsService hhService(hhState, pubsubClient);
+
+String topicPrefix = String("$aws/things/") + THING_NAME + "/shadow";
+int shadowVersion = 1;
+int shadowTimestamp = 1600000000;
+char payload[MQTT_MESSAGE_BUFFER_SIZE];
+
+/**
+ * Fill in a recorded message with the next version and timestamp of the
+ * shadow. The tokens are replaced by hand since positional printf arguments
+ * are not supported by every host's C library
+ *
+ * @param recording The message's template
+ * @param lampState The lamp's state that the message carries
+ * @param lightThreshold The light threshold that the message carries
+ * @return The message's length
+ */
+static unsigned int fillRecording(const char *recording, bool lampState,
+                                  int lightThreshold) {
+  char version[12];
+  char timestamp[12];
+  char threshold[12];
+  snprintf(version, sizeof(version), "%d", shadowVersion++);
+  snprintf(timestamp, sizeof(timestamp), "%d", shadowTimestamp++);
+  snprintf(threshold, sizeof(threshold), "%d", lightThreshold);
+
+  size_t length = 0;
+  for (const char *c = recording; *c; c++) {
+    const char *value = nullptr;
+    if (c[0] == '$') {
+      switch (c[1]) {
+        case 'V':
+          value = version;
+          break;
+        case 'T':
+          value = timestamp;
+          break;
+        case 'L':
+          value = lampState ? "true" : "false";
+          break;
+        case 'H':
+          value = threshold;
+          break;
+      }
+    }
+    if (!value) {
+      TEST_ASSERT_TRUE(length + 1 < sizeof(payload));
+      payload[length++] = *c;
+      continue;
+    }
+    size_t valueLength = strlen(value);
+    TEST_ASSERT_TRUE(length + valueLength < sizeof(payload));
+    memcpy(payload + length, value, valueLength);
+    length += valueLength;
+    c++;
+  }
+  payload[length] = '\0';
+  return length;
+}
+
+/**
+ * Build the update/accepted message that AWS echoes for the last update that
+ * the device has published
+ *
+ * @return The message's length
+ */
+static unsigned int fillEchoOfLastUpdate() {
+  DynamicJsonDocument doc(JSON_LARGE_DOCUMENT_CAPACITY);
+  TEST_ASSERT_FALSE(deserializeJson(doc, pubsubClient.lastPayload));
+  doc["version"] = shadowVersion++;
+  doc["timestamp"] = shadowTimestamp++;
+  size_t length = serializeJson(doc, payload, sizeof(payload));
+  TEST_ASSERT_TRUE(length > 0 && length < sizeof(payload));
+  return length;
+}
+
+/**
+ * Pass the filled in message to the service as if it was received from the
+ * broker, then let the service react to it
+ *
+ * @param result Receives the measurements of the message
+ * @param topic The topic's suffix after the shadow's prefix
+ * @param length The message's length
+ */
+static void replay(BenchResult &result, const char *topic,
+                   unsigned int length) {
+  String fullTopic = topicPrefix + topic;
+  size_t nPublished = pubsubClient.nPublished;
+  size_t nPublishedBytes = pubsubClient.nPublishedBytes;
+
+  auto tsStart = std::chrono::steady_clock::now();
+  hhService.handleCallback(fullTopic.c_str(), (byte *)payload, length);
+  int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - tsStart)
+                      .count();
+  hhService.processCommands();
+  hhService.loop();
+
+  result.nEvents++;
+  result.totalNanos += nanos;
+  if (nanos > result.maxNanos) {
+    result.maxNanos = nanos;
+  }
+  result.nPublished += pubsubClient.nPublished - nPublished;
+  result.nPublishedBytes += pubsubClient.nPublishedBytes - nPublishedBytes;
+}
+
+static void printResult(const BenchResult &result) {
+  printf("%-28s %6d %10.2f %10.2f %8.2f %10.1f\n", result.name, result.nEvents,
+         result.totalNanos / 1000.0 / result.nEvents, result.maxNanos / 1000.0,
+         (double)result.nPublished / result.nEvents,
+         (double)result.nPublishedBytes / result.nEvents);
+}
+
+static void printPoolStats(const char *name, const JsonPoolStats &stats) {
+  printf("%-8s capacity %5u x %u, peak leased %u, peak memory %5u bytes\n",
+         name, (unsigned int)stats.capacity, (unsigned int)stats.count,
+         (unsigned int)stats.maxLeased, (unsigned int)stats.maxMemoryUsage);
+}
+
+/**
+ * Check that the last message published by the device reports the values of a
+ * delta and nothing else
+ *
+ * @param lampState The lamp's state that the delta carried
+ * @param lightThreshold The light threshold that the delta carried
+ */
+static void assertReportOfDelta(bool lampState, int lightThreshold) {
+  DynamicJsonDocument doc(JSON_LARGE_DOCUMENT_CAPACITY);
+  TEST_ASSERT_FALSE(deserializeJson(doc, pubsubClient.lastPayload));
+  JsonObjectConst reportedObj = doc["state"]["reported"];
+  TEST_ASSERT_EQUAL(2, reportedObj.size());
+  TEST_ASSERT_EQUAL(lampState, reportedObj["lampState"].as<bool>());
+  TEST_ASSERT_EQUAL(lightThreshold, reportedObj["lightThreshold"].as<int>());
+}
+
+/**
+ * Check that a pool's documents were used, never all leased at once by the
+ * replays, and never filled up
+ *
+ * @param stats The pool's high-water marks
+ */
+static void assertPoolHeadroom(const JsonPoolStats &stats) {
+  TEST_ASSERT_TRUE(stats.maxLeased > 0);
+  TEST_ASSERT_TRUE(stats.maxLeased <= stats.count);
+  TEST_ASSERT_TRUE(stats.maxMemoryUsage < stats.capacity);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+/**
+ * A change made in the cloud: the delta is applied, the device reports its new
+ * state, and AWS echoes the device's update
+ */
+void test_delta_round_trip() {
+  BenchResult deltaResult = {"update/delta", 0, 0, 0, 0, 0};
+  BenchResult echoResult = {"update/accepted (own)", 0, 0, 0, 0, 0};
+  for (int i = 0; i < N_REPLAYS; i++) {
+    bool lampState = i % 2 == 0;
+    replay(deltaResult, "/update/delta",
+           fillRecording(RECORDED_UPDATE_DELTA, lampState, 100 + i));
+    TEST_ASSERT_EQUAL(lampState, hhState.readLampPinID());
+    // only the changed fields are reported
+    assertReportOfDelta(lampState, 100 + i);
+    replay(echoResult, "/update/accepted", fillEchoOfLastUpdate());
+  }
+  printResult(deltaResult);
+  printResult(echoResult);
+  // every applied delta is reported once, and a matching echo is not
+  // reported again
+  TEST_ASSERT_EQUAL(N_REPLAYS, deltaResult.nPublished);
+  TEST_ASSERT_EQUAL(0, echoResult.nPublished);
+}
+
+/**
+ * The full shadow that is fetched after connecting, most of it is dropped by
+ * the service's filter
+ */
+void test_get_accepted() {
+  BenchResult result = {"get/accepted", 0, 0, 0, 0, 0};
+  for (int i = 0; i < N_REPLAYS; i++) {
+    replay(result, "/get/accepted",
+           fillRecording(RECORDED_GET_ACCEPTED, i % 2 != 0, 200 + i));
+    assertReportOfDelta(i % 2 != 0, 200 + i);
+    // acknowledge the device's report so the window of updates never fills
+    BenchResult echoResult = {"", 0, 0, 0, 0, 0};
+    replay(echoResult, "/update/accepted", fillEchoOfLastUpdate());
+  }
+  printResult(result);
+  TEST_ASSERT_EQUAL(N_REPLAYS, result.nPublished);
+}
+
+/**
+ * The echoes of the updates of the other clients, they are only used to track
+ * the shadow's version
+ */
+void test_other_update_accepted() {
+  BenchResult result = {"update/accepted (other)", 0, 0, 0, 0, 0};
+  for (int i = 0; i < N_REPLAYS; i++) {
+    replay(result, "/update/accepted",
+           fillRecording(RECORDED_OTHER_UPDATE_ACCEPTED, i % 2 == 0, 300 + i));
+  }
+  printResult(result);
+  TEST_ASSERT_EQUAL(0, result.nPublished);
+}
+
+/**
+ * The high-water marks of the JSON documents over every replayed message
+ */
+void test_json_memory() {
+  JsonPoolStats smallStats = hhService.getSmallJsonPoolStats();
+  JsonPoolStats largeStats = hhService.getLargeJsonPoolStats();
+  printPoolStats("small", smallStats);
+  printPoolStats("large", largeStats);
+  printf("largest published payload %u bytes\n",
+         (unsigned int)pubsubClient.maxPublishedBytes);
+  assertPoolHeadroom(smallStats);
+  assertPoolHeadroom(largeStats);
+  TEST_ASSERT_TRUE(pubsubClient.maxPublishedBytes < MQTT_MESSAGE_BUFFER_SIZE);
+}
+
+int main(int argc, char **argv) {
+  hhState.begin();
+  hhState.refreshSensors();
+  hhService.setThingName(THING_NAME);
+  hhService.setupPlantWatering(5 * 1000);
+  hhService.begin();
+  hhService.connect();
+
+  UNITY_BEGIN();
+  printf("%-28s %6s %10s %10s %8s %10s\n", "message", "n", "mean us", "max us",
+         "pub/msg", "bytes/msg");
+  RUN_TEST(test_delta_round_trip);
+  RUN_TEST(test_get_accepted);
+  RUN_TEST(test_other_update_accepted);
+  RUN_TEST(test_json_memory);
+  return UNITY_END();
+}